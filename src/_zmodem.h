@@ -57,6 +57,8 @@
 #define ZFREECNT 17	/* Request for free bytes on filesystem */
 #define ZCOMMAND 18	/* Command from sending program */
 #define ZSTDERR 19	/* Output to standard error, data follows */
+#define ZSACK 20	/* Resend the subpacket at this position */
+#define ZFEC 21	/* XOR of the subpackets from this position follows */
 
 /* ZDLE sequences */
 #define ZCRCE 'h'	/* CRC next, frame ends, header packet follows */
@@ -96,6 +98,8 @@
 #define ESC8    0x80	/* Receiver expects 8th bit to be escaped */
 /* Bit Masks for ZRINIT flags byze ZF1 */
 #define ZF1_CANVHDR  0x01  /* Variable headers OK, unused in lrzsz */
+#define ZF1_CANSACK  0x02  /* Rx keeps data past an error, asks with ZSACK */
+#define ZF1_CANFEC   0x04  /* Rx rebuilds a subpacket from ZFEC parity */
 
 /* Parameters for ZSINIT frame */
 #define ZATTNLEN 32	/* Max length of attention string */
@@ -126,8 +130,10 @@
 #define ZTLZW	1	/* Lempel-Ziv compression */
 #define ZTCRYPT	2	/* Encryption */
 #define ZTRLE	3	/* Run Length encoding */
+#define ZTXOR	4	/* ZFEC parity frames, with ZXSACK */
 /* Extended options for ZF3, bit encoded */
 #define ZXSPARS	64	/* Encoding for sparse file operations */
+#define ZXSACK	1	/* Sender answers ZSACK, frames each subpacket */
 
 /* Parameters for ZCOMMAND frame ZF0 (otherwise 0) */
 #define ZCACK1	1	/* Acknowledge, then do command */
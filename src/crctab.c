@@ -2,6 +2,16 @@
  *  Crc calculation stuff
  */
 
+#include "config.h"
+#include "crctab.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC_HAVE_CLMUL 1
+#include <immintrin.h>
+#endif
+
 /* crctab calculated by Mark G. Mendel, Network Systems Corporation */
 unsigned short crctab[256] = {
     0x0000,  0x1021,  0x2042,  0x3063,  0x4084,  0x50a5,  0x60c6,  0x70e7,
@@ -134,4 +144,340 @@ UPDC32(int b, long c)
   return cr3tab[((int)c ^ b) & 0xff] ^ ((c >> 8) & 0x00FFFFFF);
 }
 
+/*
+ * Block CRC-32.  The slicing-by-8 tables are derived from cr3tab:
+ * crc32_slice[k][b] is the register contribution of byte b followed
+ * by k zero bytes, so eight bytes can be folded in with eight
+ * independent lookups instead of eight dependent ones.
+ */
+static uint32_t crc32_slice[8][256];
+
+static void
+crc32_slice_init(void)
+{
+	for (int i = 0; i < 256; i++)
+		crc32_slice[0][i] = (uint32_t) cr3tab[i];
+	for (int i = 0; i < 256; i++) {
+		uint32_t c = crc32_slice[0][i];
+		for (int k = 1; k < 8; k++) {
+			c = crc32_slice[0][c & 0xff] ^ (c >> 8);
+			crc32_slice[k][i] = c;
+		}
+	}
+}
+
+static uint32_t
+crc32_update_slice8(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len >= 8) {
+		crc ^= (uint32_t) p[0] | ((uint32_t) p[1] << 8)
+			| ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+		crc = crc32_slice[7][crc & 0xff]
+			^ crc32_slice[6][(crc >> 8) & 0xff]
+			^ crc32_slice[5][(crc >> 16) & 0xff]
+			^ crc32_slice[4][crc >> 24]
+			^ crc32_slice[3][p[4]]
+			^ crc32_slice[2][p[5]]
+			^ crc32_slice[1][p[6]]
+			^ crc32_slice[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32_slice[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC_HAVE_CLMUL
+/*
+ * Carry-less multiply folding, after Gopal et al., "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+ * (Intel, 2009).  The constants are the bit-reflected x^n mod P
+ * values for the 0xedb88320 polynomial given in that paper.  Folds
+ * four 128 bit lanes at a time, then reduces to 32 bits with a
+ * Barrett reduction.  Requires len >= 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc32_fold_clmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+	p += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *) (p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				   _mm_loadu_si128((const __m128i *) (p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				   _mm_loadu_si128((const __m128i *) (p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				   _mm_loadu_si128((const __m128i *) (p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one. */
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				   _mm_loadu_si128((const __m128i *) p));
+		p += 16;
+		len -= 16;
+	}
+
+	/* 128 -> 64 bits. */
+	x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits. */
+	x2 = _mm_and_si128(x1, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+	x2 = _mm_and_si128(x2, mask32);
+	x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_update_clmul(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (len >= 64) {
+		size_t n = len & ~(size_t) 15;
+		crc = crc32_fold_clmul(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return crc32_update_slice8(crc, p, len);
+}
+#endif
+
+/*
+ * Block CRC-16/XMODEM.  crctab is the MSB-first table for 0x1021;
+ * crc16_slice[k] is crctab with k zero bytes appended, so eight input
+ * bytes can be looked up independently and combined.
+ */
+static uint16_t crc16_slice[8][256];
+
+static void
+crc16_slice_init(void)
+{
+	for (int i = 0; i < 256; i++)
+		crc16_slice[0][i] = crctab[i];
+	for (int i = 0; i < 256; i++) {
+		uint16_t c = crc16_slice[0][i];
+		for (int k = 1; k < 8; k++) {
+			c = (uint16_t) ((c << 8) ^ crc16_slice[0][c >> 8]);
+			crc16_slice[k][i] = c;
+		}
+	}
+}
+
+static uint16_t
+crc16_update_slice8(uint16_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len >= 8) {
+		crc ^= (uint16_t) ((p[0] << 8) | p[1]);
+		crc = crc16_slice[7][crc >> 8]
+			^ crc16_slice[6][crc & 0xff]
+			^ crc16_slice[5][p[2]]
+			^ crc16_slice[4][p[3]]
+			^ crc16_slice[3][p[4]]
+			^ crc16_slice[2][p[5]]
+			^ crc16_slice[1][p[6]]
+			^ crc16_slice[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (uint16_t) ((crc << 8) ^ crc16_slice[0][(crc >> 8) ^ *p++]);
+	return crc;
+}
+
+#ifdef CRC_HAVE_CLMUL
+/*
+ * Carry-less multiply folding for the MSB-first 0x1021 polynomial.
+ * Each 16 byte block is byte-swapped so the first message byte holds
+ * the highest-order terms; a 128 bit remainder R is carried forward
+ * as R * x^128 + next block, computed as hi(R) * (x^192 mod P) ^
+ * lo(R) * (x^128 mod P) ^ next.  The folded remainder is then run
+ * through the table, which multiplies by x^16 and reduces mod P.
+ * Requires len >= 64 and a multiple of 16.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint16_t
+crc16_fold_clmul(uint16_t crc, const unsigned char *p, size_t len)
+{
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					    7, 6, 5, 4, 3, 2, 1, 0);
+	const __m128i k128 = _mm_set_epi64x(0x650b, 0xaefc);	/* x^192, x^128 */
+	const __m128i k512 = _mm_set_epi64x(0x8832, 0x13fc);	/* x^576, x^512 */
+	unsigned char first[16];
+	unsigned char rem[16];
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	/* The initial register is XORed into the first two message bytes. */
+	memcpy(first, p, 16);
+	first[0] ^= (unsigned char) (crc >> 8);
+	first[1] ^= (unsigned char) crc;
+
+#define CRC16_LOAD(q) _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (q)), bswap)
+	x1 = CRC16_LOAD(first);
+	x2 = CRC16_LOAD(p + 0x10);
+	x3 = CRC16_LOAD(p + 0x20);
+	x4 = CRC16_LOAD(p + 0x30);
+	p += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, k512, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, k512, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, k512, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, k512, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k512, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k512, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k512, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k512, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), CRC16_LOAD(p + 0x00));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), CRC16_LOAD(p + 0x10));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), CRC16_LOAD(p + 0x20));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), CRC16_LOAD(p + 0x30));
+		p += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one. */
+	x5 = _mm_clmulepi64_si128(x1, k128, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k128, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, k128, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k128, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, k128, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k128, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, k128, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k128, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), CRC16_LOAD(p));
+		p += 16;
+		len -= 16;
+	}
+#undef CRC16_LOAD
+
+	_mm_storeu_si128((__m128i *) rem, _mm_shuffle_epi8(x1, bswap));
+	return crc16_update_slice8(0, rem, 16);
+}
+
+static uint16_t
+crc16_update_clmul(uint16_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (len >= 64) {
+		size_t n = len & ~(size_t) 15;
+		crc = crc16_fold_clmul(crc, p, n);
+		p += n;
+		len -= n;
+	}
+	return crc16_update_slice8(crc, p, len);
+}
+#endif
+
+static uint16_t crc16_update_resolve(uint16_t crc, const void *buf, size_t len);
+static uint16_t (*crc16_update_impl)(uint16_t, const void *, size_t) = crc16_update_resolve;
+static uint32_t crc32_update_resolve(uint32_t crc, const void *buf, size_t len);
+static uint32_t (*crc32_update_impl)(uint32_t, const void *, size_t) = crc32_update_resolve;
+
+/* Build the tables and pick the block CRC implementations for this
+ * CPU.  Runs once at load time; crc32_update_resolve covers
+ * compilers without constructors. */
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void
+crc_init(void)
+{
+	crc16_slice_init();
+	crc32_slice_init();
+	crc16_update_impl = crc16_update_slice8;
+	crc32_update_impl = crc32_update_slice8;
+#ifdef CRC_HAVE_CLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+		crc16_update_impl = crc16_update_clmul;
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+		crc32_update_impl = crc32_update_clmul;
+#endif
+}
+
+static uint16_t
+crc16_update_resolve(uint16_t crc, const void *buf, size_t len)
+{
+	crc_init();
+	return crc16_update_impl(crc, buf, len);
+}
+
+static uint32_t
+crc32_update_resolve(uint32_t crc, const void *buf, size_t len)
+{
+	crc_init();
+	return crc32_update_impl(crc, buf, len);
+}
+
+uint16_t
+crc16_update(uint16_t crc, const void *buf, size_t len)
+{
+	return crc16_update_impl(crc, buf, len);
+}
+
+uint32_t
+crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32_update_impl(crc, buf, len);
+}
+
 /* End of crctab.c */
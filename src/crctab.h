@@ -1,6 +1,9 @@
 #ifndef LIBZMODEM_CRCTAB_H
 #define LIBZMODEM_CRCTAB_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 unsigned short updcrc(unsigned short cp, unsigned short crc);
 long UPDC32(int b, long c);
 // extern unsigned short crctab[256];
@@ -8,4 +11,18 @@ long UPDC32(int b, long c);
 /* extern long cr3tab[]; */
 /* #define UPDC32(b, c) (cr3tab[((int)c ^ b) & 0xff] ^ ((c >> 8) & 0x00FFFFFF)) */
 
+/* Run LEN bytes of BUF through the 16-bit CRC register CRC
+   (CRC-16/XMODEM, MSB first) and return the new register.  Unlike
+   updcrc, the register is not augmented: starting from 0, the result
+   is the value updcrc gives after the same bytes and two zero bytes,
+   and it is 0 after the bytes and their big-endian CRC. */
+uint16_t crc16_update(uint16_t crc, const void *buf, size_t len);
+
+/* Run LEN bytes of BUF through the 32-bit CRC register CRC and return
+   the new register.  This is the same as calling UPDC32 once per
+   byte: the caller does the 0xFFFFFFFF preset and the final
+   complement.  The fastest implementation for the CPU is chosen at
+   startup. */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
 #endif
@@ -32,7 +32,6 @@
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
-#include <utime.h>
 #include <time.h>
 #include <string.h>
 #include <fcntl.h>
@@ -43,13 +42,49 @@
 #include "zmodem.h"
 #include "crctab.h"
 #include "zm.h"
+#include "rzpipe.h"
 
 #define MAX_BLOCK 8192
 
-const char *program_name;		/* the name by which we were called */
-
 static int no_timeout=FALSE;
 
+/* "OOSB" means Out Of Sync Block. I once thought that if sz sents
+ * blocks a,b,c,d, of which a is ok, b fails, we might want to save
+ * c and d. But, alas, i never saw c and d.
+ *
+ * Streaming senders do send c and d before they hear the ZRPOS for b,
+ * so they are kept in a pool: an arena of MAX_BLOCK slots, taken from
+ * the memory budget the first time one is needed, and an array of the
+ * blocks in it sorted by position.  Nothing is allocated after that.
+ * When the pool is full, the block furthest ahead gives way.
+ */
+#define OOSB_BUDGET (128 * 1024)
+/* With ZSACK the pool must hold what the sender has in flight by the
+ * time it hears of a bad subpacket. */
+#define OOSB_SACK_BUDGET (2 * 1024 * 1024)
+/* ZFEC rebuilds a subpacket from the others of its group, some of
+ * which may be written out already; the last FEC_HISTORY bytes written
+ * are kept for that. */
+#define FEC_HISTORY (64 * 1024)
+
+typedef struct {
+	size_t pos;
+	size_t len;
+	char *data;		/* a slot of the arena */
+} oosb_t;
+
+typedef struct {
+	size_t budget;		/* Constant: bytes the arena may take */
+	size_t nslots;
+	char *arena;		/* NSLOTS slots, or NULL until needed */
+	oosb_t *blocks;		/* the NUSED blocks kept, sorted by POS */
+	size_t nused;
+	char **spare;		/* the NSPARE slots not in use */
+	size_t nspare;
+	unsigned long saved;	/* Statistic: bytes not sent again */
+	unsigned long dropped;	/* Statistic: blocks that found no room */
+} oosb_pool_t;
+
 struct rz_ {
 	zm_t *zm;		/* Zmodem comm primitives' state. */
 	// Workspaces
@@ -61,6 +96,9 @@ struct rz_ {
 				     * blocks */
 	// Dynamic state
 	FILE *fout;		/* FP to output file. */
+	rz_disk_t *disk;	/* writes binary data to FOUT behind the
+				 * protocol, or NULL */
+	rz_reader_t *reader;	/* reads the line ahead, or NULL */
 	int lastrx;		/* Either 0, or CAN if last receipt
 				 * was sender-cancelled */
 	int firstsec;
@@ -73,10 +111,28 @@ struct rz_ {
 	int in_tcpsync;		/* True when we receive special file
 				 * '$tcp$.t' */
 	int tcp_socket;		/* A socket file descriptor */
+	int io_mode_fd;		/* terminal to set modes on, or -1 */
+	int dirfd;		/* directory relative pathnames are in */
+	io_mode_t io_mode;	/* terminal modes saved by io_mode */
+	size_t total_received;	/* bytes of the files received completely */
+	double timing_start;	/* start of the current timing() interval */
+	char *name_static;	/* storage for the current zi->fname */
+	oosb_pool_t oosb;	/* saved out of sync blocks */
+	int sack_file;		/* A flag. The sender of this file
+				 * answers ZSACK. */
+	size_t sack_pos;	/* where the last ZSACK asked for data */
+	unsigned long file_sacks; /* ZSACKs sent for this file */
+	unsigned long sacks;	/* Statistic: ZSACKs sent */
+	int fec_file;		/* A flag. ZFEC frames follow the data
+				 * of this file. */
+	char *fec_hist;		/* FEC_HISTORY bytes, the last ones
+				 * written each at its position modulo
+				 * FEC_HISTORY, or NULL */
+	unsigned long repaired;	/* Statistic: subpackets rebuilt */
 	char zconv;		/* ZMODEM file conversion request. */
 	char zmanag;		/* ZMODEM file management request. */
-	char ztrans;		/* SET BUT UNUSED: ZMODEM file transport
-				 * request byte */
+	char ztrans;		/* ZMODEM file transport request byte,
+				 * ZTXOR or unused */
 	int tryzhdrtype;         /* Header type to send corresponding
 				  * to Last rx close */
 
@@ -88,6 +144,8 @@ struct rz_ {
 			     restricted > 0 restrict files to curdir or PUBDIR
 			   */
 	int topipe;		/* A flag. When true, open the file as a pipe. */
+	int sack;		/* A flag. When true, offer ZF1_CANSACK. */
+	int fec;		/* A flag. When true, offer ZF1_CANFEC. */
 	int makelcpathname;  /* A flag. When true, make received pathname lowercase. */
 	int nflag;		/* A flag. Don't really transfer files */
 	int rxclob;		/* A flag. Allow clobbering existing file */
@@ -129,14 +187,14 @@ struct rz_ {
 
 typedef struct rz_ rz_t;
 
-rz_t *rz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
+rz_t *rz_init(zmodem_transport_t *tp, size_t readnum, size_t bufsize, int no_timeout,
 	      int rxtimeout, int znulls, int eflag, int baudrate, int zctlesc, int zrwindow,
 	      int under_rsh, int restricted, char lzmanag,
 	      int nflag, int junk_path,
 	      unsigned long min_bps, long min_bps_time,
 	      time_t stop_time, int try_resume,
 	      int makelcpathname, int rxclob,
-	      int o_sync, int tcp_flag, int topipe,
+	      int o_sync, int tcp_flag, int topipe, size_t oosb_budget,
 	      bool tick_cb(const char *fname, long bytes_sent, long bytes_total,
 			   long last_bps, int min_left, int sec_left),
 	      void complete_cb(const char *filename, int result, size_t size, time_t date),
@@ -146,12 +204,13 @@ rz_t *rz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
 
 static int rz_receive_files (rz_t *rz, struct zm_fileinfo *);
 static int rz_zmodem_session_startup (rz_t *rz);
-static void rz_checkpath (rz_t *rz, const char *name);
+static int rz_checkpath (rz_t *rz, const char *name);
 static void chkinvok(const char *s, int *ptopipe);
 static void report (int sct);
 static void uncaps (char *s);
 static int IsAnyLower (const char *s);
 static int rz_write_string_to_file (rz_t *rz, struct zm_fileinfo *zi, char *buf, size_t n);
+static void rz_fec_keep (rz_t *rz, size_t pos, const char *buf, size_t n);
 static int rz_process_header (rz_t *rz, char *name, struct zm_fileinfo *);
 static int rz_receive_sector (rz_t *rz, size_t *Blklen, char *rxbuf, unsigned int maxtime);
 static int rz_receive_sectors (rz_t *rz, struct zm_fileinfo *);
@@ -161,27 +220,34 @@ static int rz_receive_file (rz_t *rz, struct zm_fileinfo *);
 static void exec2 (const char *s);
 static int rz_closeit (rz_t *rz, struct zm_fileinfo *);
 static int sys2 (const char *s);
-static void write_modem_escaped_string_to_stdout (const char *s);
+static void write_modem_escaped_string_to_stdout (zm_t *zm, const char *s);
 static size_t getfree (void);
+static FILE *rz_fopen (rz_t *rz, const char *name, const char *mode);
 
 rz_t*
-rz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
+rz_init(zmodem_transport_t *tp, size_t readnum, size_t bufsize, int no_timeout,
 	      int rxtimeout, int znulls, int eflag, int baudrate, int zctlesc, int zrwindow,
 	int under_rsh, int restricted, char lzmanag,
 	int nflag, int junk_path,
 	unsigned long min_bps, long min_bps_time,
 	time_t stop_time, int try_resume,
 	int makelcpathname, int rxclob, int o_sync, int tcp_flag, int topipe,
+	size_t oosb_budget,
 	bool tick_cb(const char *fname, long bytes_sent, long bytes_total,
 		     long last_bps, int min_left, int sec_left),
 	void complete_cb(const char *filename, int result, size_t size, time_t date),
 	bool approver_cb(const char *filename, size_t size, time_t date)
 	)
 {
-	rz_t *rz = (rz_t *)malloc(sizeof(rz_t));
-	memset (rz, 0, sizeof(rz_t));
-	rz->zm = zm_init(fd, readnum, bufsize, no_timeout,
+	rz_t *rz = (rz_t *)calloc(1, sizeof(rz_t));
+	if (!rz)
+		return NULL;
+	rz->zm = zm_init(tp, readnum, bufsize, no_timeout,
 			 rxtimeout, znulls, eflag, baudrate, zctlesc, zrwindow);
+	if (!rz->zm) {
+		free(rz);
+		return NULL;
+	}
 	rz->under_rsh = under_rsh;
 	rz->restricted = restricted;
 	rz->lzmanag = lzmanag;
@@ -201,9 +267,11 @@ rz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
 	rz->in_tcpsync = 0;
 	rz->fout = NULL;
 	rz->topipe = topipe;
+	rz->oosb.budget = oosb_budget;
 	rz->errors = 0;
 	rz->tryzhdrtype=ZRINIT;
 	rz->tcp_socket = -1;
+	rz->dirfd = AT_FDCWD;
 	rz->rxclob = FALSE;
 	rz->skip_if_not_found = FALSE;
 	rz->tick_cb = tick_cb;
@@ -213,36 +281,48 @@ rz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
 
 }
 
-/* called by signal interrupt or terminate to clean things up */
 static void
-bibi(int n)
+rz_free(rz_t *rz)
 {
-	//FIXME: figure out how to avoid global zmodem_requested
-	// if (zmodem_requested)
-	// 	write_modem_escaped_string_to_stdout(Attn);
-	// canit(zr, STDOUT_FILENO);
-	io_mode(0,0);
-	log_fatal(_("caught signal %s; exiting"), n);
-	exit(128+n);
+	free(rz->oosb.arena);
+	free(rz->oosb.blocks);
+	free(rz->oosb.spare);
+	free(rz->fec_hist);
+	rz_disk_free(rz->disk);
+	if (rz->dirfd != AT_FDCWD)
+		close(rz->dirfd);
+	zm_free(rz->zm);
+	free(rz->pathname);
+	free(rz->name_static);
+	free(rz);
 }
 
 /*
  * Let's receive something already.
  */
 
-size_t zmodem_receive(const char *directory,
-		      bool approver_cb(const char *filename, size_t size, time_t date),
-		      bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
-		      void complete_cb(const char *filename, int result, size_t size, time_t date),
-		      uint64_t min_bps,
-		      uint32_t flags)
+/* Run a receive session over TP.  IO_MODE_FD is the terminal whose
+   modes are set for the transfer, or -1 to leave terminal modes
+   alone.  Store the bytes of the files received in *BYTES, and
+   return the exit code. */
+static int
+rz_session(zmodem_transport_t *tp, int io_mode_fd,
+	   const char *directory,
+	   bool approver_cb(const char *filename, size_t size, time_t date),
+	   bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+	   void complete_cb(const char *filename, int result, size_t size, time_t date),
+	   uint64_t min_bps,
+	   uint32_t flags,
+	   const zmodem_options_t *options,
+	   size_t *bytes)
 {
 	log_set_level(LOG_ERROR);
-	rz_t *rz = rz_init(0, /* fd */
+	rz_t *rz = rz_init(tp, /* transport */
 			   8192, /* readnum */
 			   16384, /* bufsize */
-			   1, /* no_timeout */
-			   100,		 /* rxtimeout */
+			   !(options && options->timeout), /* no_timeout */
+			   options && options->timeout
+			   ? options->timeout : 100, /* rxtimeout */
 			   0,		 /* znulls */
 			   0,		 /* eflag */
 			   2400,	 /* baudrate */
@@ -262,26 +342,110 @@ size_t zmodem_receive(const char *directory,
 			   0,		 /* o_sync */
 			   0,		 /* tcp_flag */
 			   0,		 /* topipe */
+			   OOSB_BUDGET,	 /* oosb_budget */
 			   tick_cb,
 			   complete_cb,
 			   approver_cb
 		);
-	rz->zm->baudrate = io_mode(0,1);
+	*bytes = 0;
+	if (!rz) {
+		log_fatal(_("out of memory"));
+		return 1;
+	}
+	if (directory) {
+		rz->dirfd = open(directory, O_RDONLY | O_DIRECTORY);
+		if (rz->dirfd == -1) {
+			log_error(_("cannot open %s: %s"), directory, strerror(errno));
+			rz_free(rz);
+			return 1;
+		}
+	}
+	rz->io_mode_fd = io_mode_fd;
+	if (rz->io_mode_fd >= 0)
+		rz->zm->baudrate = io_mode(&rz->io_mode,rz->io_mode_fd,1);
+	if (flags & RZSZ_FLAGS_PIPELINE) {
+		/* Decoding stays on this thread, which answers each
+		 * subpacket as soon as it is checked. */
+		rz->reader = rz_reader_new(tp);
+		if (rz->reader)
+			rz->zm->tp = rz->zm->zr->tp = rz_reader_transport(rz->reader);
+		rz->disk = rz_disk_new();
+	}
+	if (flags & (RZSZ_FLAGS_SACK | RZSZ_FLAGS_FEC)) {
+		rz->sack = 1;
+		rz->oosb.budget = OOSB_SACK_BUDGET;
+	}
+	if (options && options->oosb_budget)
+		rz->oosb.budget = options->oosb_budget;
+	if (flags & RZSZ_FLAGS_FEC) {
+		rz->fec_hist = calloc(1, FEC_HISTORY);
+		rz->fec = rz->fec_hist != NULL;
+	}
 	int exitcode = 0;
 	if (rz_receive(rz)==ERROR) {
 		exitcode=0200;
-		zreadline_canit(rz->zm->zr, STDOUT_FILENO);
+		zm_flush(rz->zm);
+		zm_canit(rz->zm);
 	}
-	io_mode(0,0);
+	zm_flush(rz->zm);
+	log_debug("wire output: %lu bytes in %lu writes",
+		  rz->zm->tx_bytes, rz->zm->tx_writes);
+	log_debug("out-of-sync blocks: %lu bytes not resent, %lu blocks dropped, %lu ZSACKs, %lu rebuilt",
+		  rz->oosb.saved, rz->oosb.dropped, rz->sacks, rz->repaired);
+	if (rz->reader) {
+		rz->zm->tp = rz->zm->zr->tp = tp;
+		rz_reader_free(rz->reader);
+		rz->reader = NULL;
+	}
+	if (tp->drain)
+		tp->drain(tp->ctx);
+	if (rz->io_mode_fd >= 0)
+		io_mode(&rz->io_mode,rz->io_mode_fd,0);
 	if (exitcode && !rz->zm->zmodem_requested)
-		zreadline_canit(rz->zm->zr, STDOUT_FILENO);
+		zm_canit(rz->zm);
+	*bytes = rz->total_received;
+	rz_free(rz);
 	if (exitcode)
 		log_info(_("Transfer incomplete"));
 	else
 		log_info(_("Transfer complete"));
-	exit(exitcode);
+	return exitcode;
+}
+
+size_t zmodem_receive(const char *directory,
+		      bool approver_cb(const char *filename, size_t size, time_t date),
+		      bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+		      void complete_cb(const char *filename, int result, size_t size, time_t date),
+		      uint64_t min_bps,
+		      uint32_t flags)
+{
+	zmodem_transport_t *tp = NULL;
+	size_t bytes;
+
+	if (flags & RZSZ_FLAGS_URING)
+		tp = zmodem_transport_uring(0, 1);
+	if (!tp)
+		tp = zmodem_transport_fd(0, 1);
+	rz_session(tp, 0, directory, approver_cb, tick_cb,
+		   complete_cb, min_bps, flags, NULL, &bytes);
+	zmodem_transport_free(tp);
+	return bytes;
+}
 
-	return 0u;
+size_t zmodem_receive_ex(zmodem_transport_t *tp,
+			 const char *directory,
+			 bool approver_cb(const char *filename, size_t size, time_t date),
+			 bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+			 void complete_cb(const char *filename, int result, size_t size, time_t date),
+			 uint64_t min_bps,
+			 uint32_t flags,
+			 const zmodem_options_t *options)
+{
+	size_t bytes;
+
+	rz_session(tp, -1, directory, approver_cb, tick_cb, complete_cb,
+		   min_bps, flags, options, &bytes);
+	return bytes;
 }
 
 
@@ -313,7 +477,7 @@ rz_receive(rz_t *rz)
 			goto fubar;
 	} else {
 		for (;;) {
-			timing(1,NULL);
+			timing(&rz->timing_start,1,NULL);
 			if (rz_receive_pathname(rz, &zi, rz->secbuf)== ERROR)
 				goto fubar;
 			if (rz->secbuf[0]==0)
@@ -325,7 +489,7 @@ rz_receive(rz_t *rz)
 
 			double d;
 			long bps;
-			d=timing(0,NULL);
+			d=timing(&rz->timing_start,0,NULL);
 			if (d==0)
 				d=0.5; /* can happen if timing uses time() */
 			bps=(zi.bytes_received-zi.bytes_skipped)/d;
@@ -337,16 +501,21 @@ rz_receive(rz_t *rz)
 	}
 	return OK;
 fubar:
-	zreadline_canit(rz->zm->zr, STDOUT_FILENO);
+	zm_canit(rz->zm);
+	if (rz->disk)
+		rz_disk_sync(rz->disk);
 	if (rz->topipe && rz->fout) {
 		pclose(rz->fout);  return ERROR;
 	}
-	if (rz->fout)
+	/* Only a file still open is incomplete: rz->pathname goes on
+	 * naming the last one after it was closed. */
+	if (rz->fout) {
 		fclose(rz->fout);
-
-	if (rz->restricted && rz->pathname) {
-		unlink(rz->pathname);
-		log_info(_("%s: %s removed."), program_name, rz->pathname);
+		rz->fout = NULL;
+		if (rz->restricted && rz->pathname) {
+			unlinkat(rz->dirfd, rz->pathname, 0);
+			log_info(_("%s: %s removed."), program_name, rz->pathname);
+		}
 	}
 	return ERROR;
 }
@@ -367,22 +536,19 @@ rz_receive_pathname(rz_t *rz, struct zm_fileinfo *zi, char *rpn)
 et_tu:
 	rz->firstsec=TRUE;
 	zi->eof_seen=FALSE;
-	putchar(WANTCRC);
-	fflush(stdout);
+	zm_send_byte(rz->zm, WANTCRC);
 	zreadline_flushline(rz->zm->zr); /* Do read next time ... */
 	while ((c = rz_receive_sector(rz, &Blklen, rpn, 100)) != 0) {
 		if (c == WCEOT) {
 			log_error( _("Pathname fetch returned EOT"));
-			putchar(ACK);
-			fflush(stdout);
+			zm_send_byte(rz->zm, ACK);
 			zreadline_flushline(rz->zm->zr);	/* Do read next time ... */
 			zreadline_getc(rz->zm->zr, 1);
 			goto et_tu;
 		}
 		return ERROR;
 	}
-	putchar(ACK);
-	fflush(stdout);
+	zm_send_byte(rz->zm, ACK);
 	return OK;
 }
 
@@ -402,8 +568,7 @@ rz_receive_sectors(rz_t *rz, struct zm_fileinfo *zi)
 	sendchar=WANTCRC;
 
 	for (;;) {
-		putchar(sendchar);	/* send it now, we're ready! */
-		fflush(stdout);
+		zm_send_byte(rz->zm, sendchar);	/* send it now, we're ready! */
 		zreadline_flushline(rz->zm->zr);	/* Do read next time ... */
 		sectcurr=rz_receive_sector(rz, &Blklen, rz->secbuf,
 			(unsigned int) ((sectnum&0177) ? 50 : 130));
@@ -424,8 +589,7 @@ rz_receive_sectors(rz_t *rz, struct zm_fileinfo *zi)
 		else if (sectcurr==WCEOT) {
 			if (rz_closeit(rz, zi))
 				return ERROR;
-			putchar(ACK);
-			fflush(stdout);
+			zm_send_byte(rz->zm, ACK);
 			zreadline_flushline(rz->zm->zr);	/* Do read next time ... */
 			return OK;
 		}
@@ -518,18 +682,16 @@ humbug:
 				;
 		}
 		if (rz->firstsec) {
-			putchar(WANTCRC);
-			fflush(stdout);
+			zm_send_byte(rz->zm, WANTCRC);
 			zreadline_flushline(rz->zm->zr);	/* Do read next time ... */
 		} else {
 			maxtime=40;
-			putchar(NAK);
-			fflush(stdout);
+			zm_send_byte(rz->zm, NAK);
 			zreadline_flushline(rz->zm->zr);	/* Do read next time ... */
 		}
 	}
 	/* try to stop the bubble machine. */
-	zreadline_canit(rz->zm->zr, STDOUT_FILENO);
+	zm_canit(rz->zm);
 	return ERROR;
 }
 
@@ -542,11 +704,10 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 {
 	const char *openmode;
 	char *p;
-	static char *name_static=NULL;
 	char *nameend;
 
-	if (name_static)
-		free(name_static);
+	free(rz->name_static);
+	rz->name_static = NULL;
 	if (rz->junk_path) {
 		p=strrchr(name,'/');
 		if (p) {
@@ -559,13 +720,13 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 			name=p;
 		}
 	}
-	name_static=malloc(strlen(name)+1);
-	if (!name_static) {
+	rz->name_static=malloc(strlen(name)+1);
+	if (!rz->name_static) {
 		log_fatal(_("out of memory"));
-		exit(1);
+		return ERROR;
 	}
-	strcpy(name_static,name);
-	zi->fname=name_static;
+	strcpy(rz->name_static,name);
+	zi->fname=rz->name_static;
 
 	log_debug(_("zmanag=%d, Lzmanag=%d"), rz->zmanag, rz->lzmanag);
 	log_debug(_("zconv=%d"),rz->zconv);
@@ -616,7 +777,7 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 	if (rz->zconv != ZCRESUM && !rz->rxclob && (rz->zmanag&ZF1_ZMMASK) != ZF1_ZMCLOB
 		&& (rz->zmanag&ZF1_ZMMASK) != ZF1_ZMAPND
 	    && !rz->in_tcpsync
-		&& (rz->fout=fopen(name, "r"))) {
+		&& (rz->fout=rz_fopen(rz, name, "r"))) {
 		struct stat sta;
 		char *tmpname;
 		char *ptr;
@@ -664,25 +825,25 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 			i=0;
 			do {
 				sprintf(ptr,"%d",i++);
-			} while (i<1000 && stat(tmpname,&sta)==0);
+			} while (i<1000 && fstatat(rz->dirfd,tmpname,&sta,0)==0);
 			if (i==1000) {
 				free (tmpname);
 				return ERROR;
 			}
-			free(name_static);
-			name_static=malloc(strlen(tmpname)+1);
-			if (!name_static) {
+			free(rz->name_static);
+			rz->name_static=malloc(strlen(tmpname)+1);
+			if (!rz->name_static) {
 				log_fatal(_("out of memory"));
-				exit(1);
+				return ERROR;
 			}
-			strcpy(name_static,tmpname);
+			strcpy(rz->name_static,tmpname);
 			free(tmpname);
-			zi->fname=name_static;
+			zi->fname=rz->name_static;
 		}
 	}
 
 	if (!*nameend) {		/* File coming from CP/M system */
-		for (p=name_static; *p; ++p)		/* change / to _ */
+		for (p=rz->name_static; *p; ++p)		/* change / to _ */
 			if ( *p == '/')
 				*p = '_';
 
@@ -694,19 +855,19 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 		rz->fout=tmpfile();
 		if (!rz->fout) {
 			log_fatal(_("cannot tmpfile() for tcp protocol synchronization: %s"), strerror(errno));
-			exit(1);
+			return ERROR;
 		}
 		zi->bytes_received=0;
 		return OK;
 	}
 
 
-	if (!rz->zm->zmodem_requested && rz->makelcpathname && !IsAnyLower(name_static)
+	if (!rz->zm->zmodem_requested && rz->makelcpathname && !IsAnyLower(rz->name_static)
 	  && !(zi->mode&UNIXFILE))
-		uncaps(name_static);
+		uncaps(rz->name_static);
 
 	if (rz->approver_cb)
-		if (!rz->approver_cb(name_static, zi->bytes_total, zi->modtime)) {
+		if (!rz->approver_cb(rz->name_static, zi->bytes_total, zi->modtime)) {
 			log_info("%s: rejected by approver callback", rz->pathname);
 			return ERROR;
 		}
@@ -717,9 +878,9 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 		rz->pathname=malloc((PATH_MAX)*2);
 		if (!rz->pathname) {
 			log_fatal(_("out of memory"));
-			exit(1);
+			return ERROR;
 		}
-		sprintf(rz->pathname, "%s %s", program_name+2, name_static);
+		sprintf(rz->pathname, "%s %s", program_name+2, rz->name_static);
 		log_info("%s: %s %s",
 			 _("Topipe"),
 			 rz->pathname, rz->thisbinary?"BIN":"ASCII");
@@ -731,25 +892,26 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 		rz->pathname=malloc((PATH_MAX)*2);
 		if (!rz->pathname) {
 			log_fatal(_("out of memory"));
-			exit(1);
+			return ERROR;
 		}
-		strcpy(rz->pathname, name_static);
+		strcpy(rz->pathname, rz->name_static);
 		/* overwrite the "waiting to receive" line */
-		log_info(_("Receiving: %s"), name_static);
-		rz_checkpath(rz, name_static);
+		log_info(_("Receiving: %s"), rz->name_static);
+		if (rz_checkpath(rz, rz->name_static) == ERROR)
+			return ERROR;
 		if (rz->nflag)
 		{
-			free(name_static);
-			name_static=(char *) strdup("/dev/null");
-			if (!name_static)
+			free(rz->name_static);
+			rz->name_static=(char *) strdup("/dev/null");
+			if (!rz->name_static)
 			{
 				log_fatal(_("out of memory"));
-				exit(1);
+				return ERROR;
 			}
 		}
 		if (rz->thisbinary && rz->zconv==ZCRESUM) {
 			struct stat st;
-			rz->fout = fopen(name_static, "r+");
+			rz->fout = rz_fopen(rz, rz->name_static, "r+");
 			if (rz->fout && 0==fstat(fileno(rz->fout),&st))
 			{
 				int can_resume=TRUE;
@@ -782,10 +944,10 @@ rz_process_header(rz_t *rz, char *name, struct zm_fileinfo *zi)
 			if (rz->fout)
 				fclose(rz->fout);
 		}
-		rz->fout = fopen(name_static, openmode);
+		rz->fout = rz_fopen(rz, rz->name_static, openmode);
 		if ( !rz->fout)
 		{
-			log_error(_("cannot open %s: %s"), name_static, strerror(errno));
+			log_error(_("cannot open %s: %s"), rz->name_static, strerror(errno));
 			return ERROR;
 		}
 	}
@@ -818,7 +980,12 @@ rz_write_string_to_file(rz_t *rz, struct zm_fileinfo *zi, char *buf, size_t n)
 
 	if (n == 0)
 		return OK;
+	/* Parity covers the bytes as sent, not as converted. */
+	if (rz->fec_file)
+		rz_fec_keep(rz, zi->bytes_received, buf, n);
 	if (rz->thisbinary) {
+		if (rz->disk)
+			return rz_disk_write(rz->disk, rz->fout, buf, n) ? ERROR : OK;
 		if (fwrite(buf,n,1,rz->fout)!=1)
 			return ERROR;
 	}
@@ -894,7 +1061,30 @@ chkinvok(const char *s, int *ptopipe)
 /*
  * Totalitarian Communist pathname processing
  */
-static void
+/* Open NAME as fopen would, but with a relative NAME taken to be in
+   the session's directory.  MODE is "r", "r+", "w" or "a". */
+static FILE *
+rz_fopen(rz_t *rz, const char *name, const char *mode)
+{
+	int flags, fd;
+	FILE *f;
+
+	if (mode[0] == 'r')
+		flags = mode[1] == '+' ? O_RDWR : O_RDONLY;
+	else if (mode[0] == 'a')
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+	else
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+	fd = openat(rz->dirfd, name, flags, 0666);
+	if (fd == -1)
+		return NULL;
+	f = fdopen(fd, mode);
+	if (!f)
+		close(fd);
+	return f;
+}
+
+static int
 rz_checkpath(rz_t *rz, const char *name)
 {
 	if (rz->restricted) {
@@ -906,11 +1096,11 @@ rz_checkpath(rz_t *rz, const char *name)
 			p=name;
 		/* don't overwrite any file in very restricted mode.
 		 * don't overwrite hidden files in restricted mode */
-		if ((rz->restricted==2 || *name=='.') && fopen(name, "r") != NULL) {
-			zreadline_canit(rz->zm->zr, STDOUT_FILENO);
+		if ((rz->restricted==2 || *name=='.') && faccessat(rz->dirfd, name, F_OK, 0) == 0) {
+			zm_canit(rz->zm);
 			log_info(_("%s: %s exists"),
 				program_name, name);
-			bibi(-1);
+			return ERROR;
 		}
 		/* restrict pathnames to current tree or uucppublic */
 		if ( strstr(name, "../")
@@ -919,18 +1109,19 @@ rz_checkpath(rz_t *rz, const char *name)
 		 	strlen(PUBDIR)))
 #endif
 		) {
-			zreadline_canit(rz->zm->zr, STDOUT_FILENO);
+			zm_canit(rz->zm);
 			log_info(_("%s: Security Violation"),program_name);
-			bibi(-1);
+			return ERROR;
 		}
 		if (rz->restricted > 1) {
 			if (name[0]=='.' || strstr(name,"/.")) {
-				zreadline_canit(rz->zm->zr, STDOUT_FILENO);
+				zm_canit(rz->zm);
 				log_info(_("%s: Security Violation"),program_name);
-				bibi(-1);
+				return ERROR;
 			}
 		}
 	}
+	return OK;
 }
 
 /*
@@ -945,6 +1136,15 @@ rz_zmodem_session_startup(rz_t *rz)
 	register int c, n;
 	int zrqinits_received=0;
 	size_t bytes_in_block=0;
+	/* A sender that answers ZSACK may still be sending a frame
+	 * and a ZEOF for each ZSACK about the last file that it had
+	 * not heard by the ZEOF this receiver took.  Those do not use
+	 * up tries. */
+	unsigned long stale = rz->sack_file ? 2 * rz->file_sacks : 0;
+	/* A ZRPOS it hears at its ZEOF has it send the rest of the
+	 * file again, ZFEC and all, so past those only every 16th
+	 * frame or header error uses up a try. */
+	unsigned hunted = 0;
 
 	/* Spec 8.1: "When the ZMODEM receive program starts, it
 	   immediately sends a ZRINIT header to initiate ZMODEM file
@@ -955,22 +1155,27 @@ rz_zmodem_session_startup(rz_t *rz)
 	   On startup rz->tryzhdrtype is, by default, set to ZRINIT
 	*/
 
+	/* Our escape mode is settled; pick the data subpacket loops. */
+	zm_select_data_loops(rz->zm);
+
 	for (n=rz->zm->zmodem_requested?15:5;
 		 (--n + zrqinits_received) >=0 && zrqinits_received<10; ) {
-		/* Set buffer length (0) and capability flags */
+		/* Set buffer length (0) and capability flags (ZF0) */
 
 		/* We're going to snd a ZRINIT packet. */  
-		zm_set_header_payload_bytes(rz->zm,
+		zm_set_header_payload_bytes(rz->zm, 0, 0,
+					    (rz->sack ? ZF1_CANSACK : 0)
+					    | (rz->fec ? ZF1_CANFEC : 0),
 #ifdef CANBREAK
 					    (rz->zm->zctlesc ?
 					     (CANFC32|CANFDX|CANOVIO|CANBRK|TESCCTL)
-					     : (CANFC32|CANFDX|CANOVIO|CANBRK)),
+					     : (CANFC32|CANFDX|CANOVIO|CANBRK))
 #else
 					    (rz->zm->zctlesc ?
 					     (CANFC32|CANFDX|CANOVIO|TESCCTL)
-					     : (CANFC32|CANFDX|CANOVIO)),
+					     : (CANFC32|CANFDX|CANOVIO))
 #endif
-					    0, 0, 0);
+					    );
 		zm_send_hex_header(rz->zm, rz->tryzhdrtype);
 
 		if (rz->tcp_socket==-1 && strlen(rz->tcp_buf) > 0) {
@@ -999,7 +1204,22 @@ again:
 			continue;
 
 		case ZEOF:
+			if (stale) {
+				stale--;
+				n++;
+			}
 			continue;
+		case ZFEC:
+		case ZDATA:
+			if (stale)
+				stale--;
+			else if (!rz->sack_file || hunted++ % 16 == 0)
+				continue;
+			do
+				c = zm_receive_data(rz->zm, rz->secbuf,
+						    MAX_BLOCK, &bytes_in_block);
+			while (c == GOTCRCG || c == GOTCRCQ);
+			goto again;
 		case TIMEOUT:
 			continue;
 		case ZFILE:
@@ -1014,9 +1234,13 @@ again:
 			}
 			rz->zmanag = rz->zm->Rxhdr[ZF1];
 			rz->ztrans = rz->zm->Rxhdr[ZF2];
+			rz->sack_file = rz->sack && (rz->zm->Rxhdr[ZF3] & ZXSACK);
+			rz->fec_file = rz->fec && rz->sack_file
+				&& rz->ztrans == ZTXOR;
 			rz->tryzhdrtype = ZRINIT;
 			c = zm_receive_data(rz->zm, rz->secbuf, MAX_BLOCK,&bytes_in_block);
-			rz->zm->baudrate = io_mode(0,3);
+			if (rz->io_mode_fd >= 0)
+				rz->zm->baudrate = io_mode(&rz->io_mode,rz->io_mode_fd,3);
 			if (c == GOTCRCW)
 				return ZFILE;
 			zm_send_hex_header(rz->zm, ZNAK);
@@ -1041,7 +1265,7 @@ again:
 			 * - sender receives TESCCTL and uses "|=..."
 			 * so: sz escapes, but rz doesn't unescape ... not good.
 			 */
-			rz->zm->zctlesc |= (TESCCTL & rz->zm->Rxhdr[ZF0]);
+			zm_set_zctlesc(rz->zm, zm_get_zctlesc(rz->zm) | (TESCCTL & rz->zm->Rxhdr[ZF0]));
 			if (zm_receive_data(rz->zm, rz->attn, ZATTNLEN, &bytes_in_block) == GOTCRCW) {
 				/* Spec 8.1: "[after receiving a
 				 * ZSINIT] the receiver sends a ZACK
@@ -1060,6 +1284,10 @@ again:
 			goto again;
 		case ZCOMPL:
 			goto again;
+		case ERROR:
+			if (rz->sack_file && hunted++ % 16)
+				goto again;
+			continue;
 		default:
 			continue;
 		case ZFIN:
@@ -1090,14 +1318,14 @@ rz_receive_files(rz_t *rz, struct zm_fileinfo *zi)
 	register int c;
 
 	for (;;) {
-		timing(1,NULL);
+		timing(&rz->timing_start,1,NULL);
 		c = rz_receive_file(rz, zi);
 		switch (c) {
 		case ZEOF:
 		{
 			double d;
 			long bps;
-			d=timing(0,NULL);
+			d=timing(&rz->timing_start,0,NULL);
 			if (d==0)
 				d=0.5; /* can happen if timing uses time() */
 			bps=(zi->bytes_received-zi->bytes_skipped)/d;
@@ -1127,17 +1355,332 @@ rz_receive_files(rz_t *rz, struct zm_fileinfo *zi)
 	}
 }
 
-/* "OOSB" means Out Of Sync Block. I once thought that if sz sents
- * blocks a,b,c,d, of which a is ok, b fails, we might want to save
- * c and d. But, alas, i never saw c and d.
- */
-typedef struct oosb_t {
-	size_t pos;
+/* Forget the blocks kept, as their positions belong to another file. */
+static void
+oosb_reset(oosb_pool_t *p)
+{
+	size_t i;
+
+	if (!p->arena)
+		return;
+	p->nused = 0;
+	for (i = 0; i < p->nslots; i++)
+		p->spare[i] = p->arena + i * MAX_BLOCK;
+	p->nspare = p->nslots;
+}
+
+/* Set up the pool.  Returns -1 if it is out of budget or memory, which
+ * leaves it disabled. */
+static int
+oosb_alloc(oosb_pool_t *p)
+{
+	p->nslots = p->budget / MAX_BLOCK;
+	if (p->nslots == 0)
+		return -1;
+	p->arena = malloc(p->nslots * MAX_BLOCK);
+	p->blocks = malloc(p->nslots * sizeof(oosb_t));
+	p->spare = malloc(p->nslots * sizeof(char *));
+	if (!p->arena || !p->blocks || !p->spare) {
+		free(p->arena);
+		free(p->blocks);
+		free(p->spare);
+		p->arena = NULL;
+		p->blocks = NULL;
+		p->spare = NULL;
+		p->budget = 0;
+		return -1;
+	}
+	oosb_reset(p);
+	return 0;
+}
+
+/* The index of the first block kept at POS or after it. */
+static size_t
+oosb_index(const oosb_pool_t *p, size_t pos)
+{
+	size_t i, hi;
+
+	for (i = 0, hi = p->nused; i < hi; ) {
+		size_t mid = i + (hi - i) / 2;
+
+		if (p->blocks[mid].pos < pos)
+			i = mid + 1;
+		else
+			hi = mid;
+	}
+	return i;
+}
+
+/* Keep the LEN bytes at BUF, a block at POS ahead of the file.
+ * Returns -1 if a block, this one or another, had to be dropped. */
+static int
+oosb_save(oosb_pool_t *p, size_t pos, const char *buf, size_t len)
+{
+	oosb_t *b;
+	size_t i;
+	int ret = 0;
+
+	if (len == 0)
+		return 0;
+	if (len > MAX_BLOCK || (!p->arena && oosb_alloc(p) < 0))
+		return -1;
+	i = oosb_index(p, pos);
+	if (i < p->nused && p->blocks[i].pos == pos) {
+		b = &p->blocks[i];
+		if (len > b->len) {
+			memcpy(b->data, buf, len);
+			b->len = len;
+		}
+		return 0;
+	}
+	if (p->nspare == 0) {
+		p->dropped++;
+		if (i == p->nused)
+			return -1;
+		p->spare[p->nspare++] = p->blocks[--p->nused].data;
+		ret = -1;
+	}
+	memmove(&p->blocks[i + 1], &p->blocks[i],
+		(p->nused - i) * sizeof(oosb_t));
+	b = &p->blocks[i];
+	b->pos = pos;
+	b->len = len;
+	b->data = p->spare[--p->nspare];
+	memcpy(b->data, buf, len);
+	p->nused++;
+	log_debug("saving out-of-sync-block %lx, len %lu",
+		  (unsigned long) pos, (unsigned long) len);
+	return ret;
+}
+
+/* Write out the blocks kept that the file has caught up with, and drop
+ * those it has passed. */
+static void
+rz_use_oosb(rz_t *rz, struct zm_fileinfo *zi)
+{
+	oosb_pool_t *p = &rz->oosb;
+	size_t i;
+
+	if (p->nused == 0)
+		return;
+	for (i = 0; i < p->nused && p->blocks[i].pos <= zi->bytes_received; i++) {
+		oosb_t *b = &p->blocks[i];
+		size_t skip = zi->bytes_received - b->pos;
+
+		if (skip < b->len) {
+			log_debug("using saved out-of-sync-paket %lx, len %lu",
+				  (unsigned long) (b->pos + skip),
+				  (unsigned long) (b->len - skip));
+			rz_write_string_to_file(rz, zi, b->data + skip,
+						b->len - skip);
+			zi->bytes_received += b->len - skip;
+			p->saved += b->len - skip;
+		}
+		p->spare[p->nspare++] = b->data;
+	}
+	memmove(p->blocks, p->blocks + i, (p->nused - i) * sizeof(oosb_t));
+	p->nused -= i;
+}
+
+/* Ask for the data at the file position, which is missing. */
+static void
+rz_send_sack(rz_t *rz, struct zm_fileinfo *zi)
+{
+	rz->sack_pos = zi->bytes_received;
+	rz->file_sacks++;
+	rz->sacks++;
+	zm_set_header_payload(rz->zm, zi->bytes_received);
+	zm_send_hex_header(rz->zm, ZSACK);
+}
+
+/* Keep the N bytes at BUF, written out at POS, for rz_receive_fec. */
+static void
+rz_fec_keep(rz_t *rz, size_t pos, const char *buf, size_t n)
+{
+	size_t off, k;
+
+	if (n > FEC_HISTORY) {
+		buf += n - FEC_HISTORY;
+		pos += n - FEC_HISTORY;
+		n = FEC_HISTORY;
+	}
+	for (off = pos % FEC_HISTORY; n > 0; off = 0) {
+		k = FEC_HISTORY - off;
+		if (k > n)
+			k = n;
+		memcpy(rz->fec_hist + off, buf, k);
+		buf += k;
+		n -= k;
+	}
+}
+
+/* XOR the LEN bytes at POS, which were written out, into BUF.  Returns
+ * -1 if they are no longer kept. */
+static int
+rz_fec_xor_written(rz_t *rz, struct zm_fileinfo *zi, size_t pos,
+		   char *buf, size_t len)
+{
+	size_t i;
+
+	if (pos + FEC_HISTORY < zi->bytes_received)
+		return -1;
+	for (i = 0; i < len; i++)
+		buf[i] ^= rz->fec_hist[(pos + i) % FEC_HISTORY];
+	return 0;
+}
+
+/* Take in the ZFEC frame for the group of subpackets at POS.  Its data
+ * is their XOR, each padded to the length of the first, followed by
+ * their count and the length of the last, in two bytes, LSB first.
+ * If just one of them is missing it is rebuilt, and kept like an
+ * out-of-sync block.  Returns 0, or ZCAN. */
+static int
+rz_receive_fec(rz_t *rz, struct zm_fileinfo *zi, size_t pos)
+{
+	char *buf = rz->secbuf;
+	size_t len, plen, count, last, end, i, j;
+	size_t missing = (size_t) -1;
+	int c;
+
+	c = zm_receive_data(rz->zm, buf, MAX_BLOCK, &len);
+	switch (c) {
+	case GOTCRCW:
+	case GOTCRCG:
+	case GOTCRCE:
+	case GOTCRCQ:
+		break;
+	case ZCAN:
+		return ZCAN;
+	default:
+		return 0;
+	}
+	if (!rz->fec_file || len < 4)
+		return 0;
+	plen = len - 3;
+	count = (unsigned char) buf[plen];
+	last = (unsigned char) buf[plen + 1]
+		| (size_t) (unsigned char) buf[plen + 2] << 8;
+	if (count == 0 || last == 0 || last > plen)
+		return 0;
+	end = pos + (count - 1) * plen + last;
+	if (end <= zi->bytes_received)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		size_t bpos = pos + i * plen;
+		size_t blen = i + 1 < count ? plen : last;
+		const oosb_t *b;
+
+		if (bpos + blen <= zi->bytes_received) {
+			if (rz_fec_xor_written(rz, zi, bpos, buf, blen) < 0)
+				break;
+			continue;
+		}
+		j = oosb_index(&rz->oosb, bpos);
+		b = &rz->oosb.blocks[j];
+		if (j < rz->oosb.nused && b->pos == bpos && b->len == blen) {
+			for (j = 0; j < blen; j++)
+				buf[j] ^= b->data[j];
+			continue;
+		}
+		/* Partly written out is as good as missing. */
+		if (bpos < zi->bytes_received || missing != (size_t) -1)
+			break;
+		missing = i;
+	}
+	if (i == count && missing != (size_t) -1) {
+		size_t bpos = pos + missing * plen;
+		size_t blen = missing + 1 < count ? plen : last;
+
+		log_debug("rebuilt subpacket %lx, len %lu",
+			  (unsigned long) bpos, (unsigned long) blen);
+		rz->repaired++;
+		if (bpos == zi->bytes_received) {
+			rz_write_string_to_file(rz, zi, buf, blen);
+			zi->bytes_received += blen;
+		} else
+			oosb_save(&rz->oosb, bpos, buf, blen);
+	}
+	/* A gap left up to the end of the group will not be filled
+	 * by the parity for the next. */
+	rz_use_oosb(rz, zi);
+	if (zi->bytes_received < end && rz->sack_pos != zi->bytes_received)
+		rz_send_sack(rz, zi);
+	return 0;
+}
+
+/* Take in the frame at POS, which is not where the file is, from a
+ * sender that answers ZSACK.  Its subpackets are kept and the data
+ * before them asked for.  Returns 0 to go on with the next header,
+ * ERROR when the data could not be kept or there is no gap to ask
+ * for, so that everything from the file position has to be sent
+ * again, or ZCAN. */
+static int
+rz_receive_sack_frame(rz_t *rz, struct zm_fileinfo *zi, size_t pos)
+{
 	size_t len;
-	char *data;
-	struct oosb_t *next;
-} oosb_t;
-struct oosb_t *anker=NULL;
+	int c;
+
+	for (;;) {
+		c = zm_receive_data(rz->zm, rz->secbuf, MAX_BLOCK, &len);
+		switch (c) {
+		case GOTCRCW:
+		case GOTCRCG:
+		case GOTCRCE:
+		case GOTCRCQ:
+			break;
+		case ZCAN:
+			return ZCAN;
+		default:
+			/* The rest of the frame cannot be placed.  A
+			 * frame from before the file position may have
+			 * ended with a ZCRCW after a restart: ask for
+			 * the hole again, or for a restart if there is
+			 * none.  One from ahead of it asks only for a
+			 * new gap, unless ZFEC may yet fill that. */
+			if (pos <= zi->bytes_received) {
+				if (!rz->oosb.nused)
+					return ERROR;
+				rz_send_sack(rz, zi);
+			} else if (!rz->fec_file
+				   && rz->sack_pos != zi->bytes_received)
+				rz_send_sack(rz, zi);
+			return 0;
+		}
+		if (pos + len > zi->bytes_received
+		    && oosb_save(&rz->oosb, pos, rz->secbuf, len) < 0)
+			return ERROR;
+		/* A sender waiting on a ZCRCW hears nothing else, so
+		 * ask again even if the answer may be on its way.
+		 * Otherwise, with ZFEC, the parity may yet fill the gap. */
+		if (pos > zi->bytes_received
+		    && (c == GOTCRCW || (!rz->fec_file
+					 && rz->sack_pos != zi->bytes_received)))
+			rz_send_sack(rz, zi);
+		else if (c == GOTCRCW) {
+			/* Ends at or past the hole: whatever it adds is
+			 * saved, so catch up before answering. */
+			rz_use_oosb(rz, zi);
+			if (rz->oosb.nused)
+				rz_send_sack(rz, zi);
+			else {
+				zm_set_header_payload(rz->zm, zi->bytes_received);
+				zm_send_hex_header(rz->zm, ZACK);
+			}
+			return 0;
+		}
+		pos += len;
+		switch (c) {
+		case GOTCRCQ:
+			zm_set_header_payload(rz->zm, zi->bytes_received);
+			zm_send_hex_header(rz->zm, ZACK);
+			break;
+		case GOTCRCW:
+		case GOTCRCE:
+			return 0;
+		}
+	}
+}
 
 /*
  * Receive a file with ZMODEM protocol
@@ -1150,46 +1693,37 @@ rz_receive_file(rz_t *rz, struct zm_fileinfo *zi)
 	long last_rxbytes=0;
 	unsigned long last_bps=0;
 	long not_printed=0;
+	unsigned stale=0;	/* header errors since the last good ZDATA */
 	time_t low_bps=0;
 	size_t bytes_in_block=0;
 
 	zi->eof_seen=FALSE;
 
 	n = 20;
+	oosb_reset(&rz->oosb);
+	rz->sack_pos = (size_t) -1;
+	rz->file_sacks = 0;
 
 	if (rz_process_header(rz, rz->secbuf,zi) == ERROR) {
 		return (rz->tryzhdrtype = ZSKIP);
 	}
 
 	for (;;) {
+		/* Everything read ahead went out before the sender
+		 * hears this ZRPOS, so it is all to be resent.  Hunting
+		 * through it for headers would only use up N. */
+		if (rz->reader)
+			rz_reader_discard(rz->reader);
 		zm_set_header_payload(rz->zm, zi->bytes_received);
 		zm_send_hex_header(rz->zm, ZRPOS);
 		goto skip_oosb;
 nxthdr:
-		if (anker) {
-			oosb_t *akt,*last,*next;
-			for (akt=anker,last=NULL;akt;last= akt ? akt : last ,akt=next) {
-				if (akt->pos==zi->bytes_received) {
-					rz_write_string_to_file(rz, zi, akt->data, akt->len);
-					zi->bytes_received += akt->len;
-					log_debug("using saved out-of-sync-paket %lx, len %ld",
-						  akt->pos,akt->len);
-					goto nxthdr;
-				}
-				next=akt->next;
-				if (akt->pos<zi->bytes_received) {
-					log_debug("removing unneeded saved out-of-sync-paket %lx, len %ld",
-						  akt->pos,akt->len);
-					if (last)
-						last->next=akt->next;
-					else
-						anker=akt->next;
-					free(akt->data);
-					free(akt);
-					akt=NULL;
-				}
-			}
-		}
+		rz_use_oosb(rz, zi);
+		/* Saved blocks left over mean there is another gap,
+		 * unless ZFEC may yet fill it. */
+		if (rz->sack_file && !rz->fec_file && rz->oosb.nused
+		    && rz->sack_pos != zi->bytes_received)
+			rz_send_sack(rz, zi);
 	skip_oosb:
 		c = zm_get_header(rz->zm, NULL);
 		switch (c) {
@@ -1205,6 +1739,10 @@ nxthdr:
 		case ZFILE:
 			zm_receive_data(rz->zm, rz->secbuf, MAX_BLOCK,&bytes_in_block);
 			continue;
+		case ZFEC:
+			if (rz_receive_fec(rz, zi, zm_reclaim_receive_header(rz->zm)) == ZCAN)
+				return ERROR;
+			goto nxthdr;
 		case ZEOF:
 			if (zm_reclaim_receive_header(rz->zm) != (long) zi->bytes_received) {
 				/*
@@ -1213,6 +1751,17 @@ nxthdr:
 				 *  out before we sent our zrpos.
 				 */
 				rz->errors = 0;
+				/* A sender that answers ZSACK waits on
+				 * its ZEOF: ask for what is missing. */
+				if (rz->sack_file)
+					rz_send_sack(rz, zi);
+				goto nxthdr;
+			}
+			/* Blocks kept from past the end mean the sender
+			 * took this for the end too early: ask for the
+			 * gap before them rather than cut the file short. */
+			if (rz->sack_file && rz->oosb.nused) {
+				rz_send_sack(rz, zi);
 				goto nxthdr;
 			}
 			if (rz_closeit(rz, zi)) {
@@ -1221,15 +1770,31 @@ nxthdr:
 				return ERROR;
 			}
 			log_debug("rz_receive_file: normal EOF");
+			rz->total_received += zi->bytes_received;
 			if (rz->complete_cb)
 				rz->complete_cb(zi->fname, 0, zi->bytes_sent, zi->modtime);
 			return c;
 		case ERROR:	/* Too much garbage in header search error */
+			/* What the sender had in flight before our ZRPOS
+			 * reached it turns up false headers, so only
+			 * every 16th of those counts against N and asks
+			 * again.  A ZCRCW, which leaves no frame type,
+			 * means the sender waits for us. */
+			if (!rz->sack_file && rz->zm->rxframeind
+			    && stale++ % 16)
+				goto skip_oosb;
 			if ( --n < 0) {
 				log_debug("rz_receive_file: zm_get_header returned %d", c);
 				return ERROR;
 			}
-			write_modem_escaped_string_to_stdout(rz->attn);
+			/* The block behind a garbled header shows up as
+			 * a gap once a later one comes in, unless it was
+			 * the one asked for. */
+			if (rz->sack_file && rz->oosb.nused) {
+				rz_send_sack(rz, zi);
+				goto skip_oosb;
+			}
+			write_modem_escaped_string_to_stdout(rz->zm, rz->attn);
 			continue;
 		case ZSKIP:
 			rz_closeit(rz, zi);
@@ -1237,37 +1802,40 @@ nxthdr:
 			return c;
 		case ZDATA:
 			if (zm_reclaim_receive_header(rz->zm) != (long) zi->bytes_received) {
-				oosb_t *neu;
 				size_t pos=zm_reclaim_receive_header(rz->zm);
 				if ( --n < 0) {
 					log_debug("rz_receive_file: out of sync");
 					return ERROR;
 				}
+				if (rz->sack_file) {
+					c = rz_receive_sack_frame(rz, zi, pos);
+					if (c == ZCAN)
+						return ERROR;
+					if (c == 0) {
+						n = 20;
+						goto nxthdr;
+					}
+					/* Have it all sent again,
+					 * without asking for the gap
+					 * as well. */
+					oosb_reset(&rz->oosb);
+					rz->sack_pos = zi->bytes_received;
+					write_modem_escaped_string_to_stdout(rz->zm, rz->attn);
+					continue;
+				}
 				switch (c = zm_receive_data(rz->zm, rz->secbuf, MAX_BLOCK,&bytes_in_block))
 				{
 				case GOTCRCW:
 				case GOTCRCG:
 				case GOTCRCE:
 				case GOTCRCQ:
-					if (pos>zi->bytes_received) {
-						neu=malloc(sizeof(oosb_t));
-						if (neu)
-							neu->data=malloc(bytes_in_block);
-						if (neu && neu->data) {
-							log_debug("saving out-of-sync-block %lx, len %lu",pos,
-								  (unsigned long) bytes_in_block);
-							memcpy(neu->data,rz->secbuf,bytes_in_block);
-							neu->pos=pos;
-							neu->len=bytes_in_block;
-							neu->next=anker;
-							anker=neu;
-						}
-						else if (neu)
-							free(neu);
-					}
+					if (pos>zi->bytes_received)
+						oosb_save(&rz->oosb, pos, rz->secbuf,
+							  bytes_in_block);
 				}
-				write_modem_escaped_string_to_stdout(rz->attn);  continue;
+				write_modem_escaped_string_to_stdout(rz->zm, rz->attn);  continue;
 			}
+			stale = 0;
 moredata:
 			if ((rz->min_bps || rz->stop_time || rz->tick_cb)
 			    && (not_printed > (rz->min_bps ? 3 : 7)
@@ -1276,7 +1844,7 @@ moredata:
 				int secleft =  0;
 				time_t now;
 				double d;
-				d=timing(0,&now);
+				d=timing(&rz->timing_start,0,&now);
 				if (d==0)
 					d=0.5; /* timing() might use time() */
 				last_bps=zi->bytes_received/d;
@@ -1327,7 +1895,15 @@ moredata:
 					log_debug("rz_receive_file: zm_get_header returned %d", c);
 					return ERROR;
 				}
-				write_modem_escaped_string_to_stdout(rz->attn);
+				/* With ZFEC the parity may fill the gap,
+				 * unless this was what was asked for. */
+				if (rz->sack_file) {
+					if (!rz->fec_file
+					    || rz->sack_pos == zi->bytes_received)
+						rz_send_sack(rz, zi);
+					goto skip_oosb;
+				}
+				write_modem_escaped_string_to_stdout(rz->zm, rz->attn);
 				continue;
 			case TIMEOUT:
 				if ( --n < 0) {
@@ -1339,6 +1915,15 @@ moredata:
 				n = 20;
 				rz_write_string_to_file(rz, zi, rz->secbuf, bytes_in_block);
 				zi->bytes_received += bytes_in_block;
+				/* The sender waits for all it sent, and
+				 * takes a ZACK short of it for a restart. */
+				if (rz->sack_file) {
+					rz_use_oosb(rz, zi);
+					if (rz->oosb.nused) {
+						rz_send_sack(rz, zi);
+						goto nxthdr;
+					}
+				}
 				zm_set_header_payload(rz->zm, zi->bytes_received);
 				zm_send_hex_header(rz->zm, ZACK | 0x80);
 				goto nxthdr;
@@ -1369,7 +1954,7 @@ moredata:
  *   and \335 (break signal)
  */
 static void
-write_modem_escaped_string_to_stdout(const char *s)
+write_modem_escaped_string_to_stdout(zm_t *zm, const char *s)
 {
 	const char *p;
 
@@ -1378,18 +1963,21 @@ write_modem_escaped_string_to_stdout(const char *s)
 		p=strpbrk(s,"\335\336");
 		if (!p)
 		{
-			write(1,s,strlen(s));
+			zm_put(zm, s, strlen(s));
+			zm_flush(zm);
 			return;
 		}
 		if (p!=s)
 		{
-			write(1,s,(size_t) (p-s));
+			zm_put(zm, s, (size_t) (p-s));
 			s=p;
 		}
+		zm_flush(zm);
 		if (*p=='\336')
 			sleep(1);
 		else
-			sendbrk(0);
+			if (zm->tp->send_break)
+				zm->tp->send_break(zm->tp->ctx);
 		p++;
 	}
 }
@@ -1401,34 +1989,48 @@ static int
 rz_closeit(rz_t *rz, struct zm_fileinfo *zi)
 {
 	int ret;
+	int write_failed = FALSE;
+	FILE *fout = rz->fout;
+
+	/* Closed whatever happens, so that the error path does not
+	 * close it again. */
+	rz->fout = NULL;
+	if (rz->disk && rz_disk_sync(rz->disk)) {
+		log_error(_("file write error: %s"), strerror(errno));
+		write_failed = TRUE;
+	}
 	if (rz->topipe) {
-		if (pclose(rz->fout)) {
+		if (pclose(fout) || write_failed) {
 			return ERROR;
 		}
 		return OK;
 	}
 	if (rz->in_tcpsync) {
-		rewind(rz->fout);
-		if (!fgets(rz->tcp_buf, sizeof(rz->tcp_buf), rz->fout)) {
+		rewind(fout);
+		if (!fgets(rz->tcp_buf, sizeof(rz->tcp_buf), fout)) {
 			log_fatal(_("fgets for tcp protocol synchronization failed: %s"), strerror(errno));
-			exit(1);
+			fclose(fout);
+			return ERROR;
 		}
-		fclose(rz->fout);
+		fclose(fout);
 		return OK;
 	}
-	ret=fclose(rz->fout);
-	if (ret) {
-		log_error(_("file close error: %s"), strerror(errno));
+	ret=fclose(fout);
+	if (ret || write_failed) {
+		if (ret)
+			log_error(_("file close error: %s"), strerror(errno));
 		/* this may be any sort of error, including random data corruption */
 
-		unlink(rz->pathname);
+		unlinkat(rz->dirfd, rz->pathname, 0);
 		return ERROR;
 	}
 	if (zi->modtime) {
-		struct utimbuf timep;
-		timep.actime = time(NULL);
-		timep.modtime = zi->modtime;
-		utime(rz->pathname, &timep);
+		struct timespec timep[2];
+		timep[0].tv_sec = 0;
+		timep[0].tv_nsec = UTIME_NOW;
+		timep[1].tv_sec = zi->modtime;
+		timep[1].tv_nsec = 0;
+		utimensat(rz->dirfd, rz->pathname, timep, 0);
 	}
 	if (S_ISREG(zi->mode)) {
 		/* we must not make this program executable if running
@@ -1436,9 +2038,9 @@ rz_closeit(rz_t *rz, struct zm_fileinfo *zi)
 		 * unrestricted shell.
 		 */
 		if (rz->under_rsh)
-			chmod(rz->pathname, (00666 & zi->mode));
+			fchmodat(rz->dirfd, rz->pathname, (00666 & zi->mode), 0);
 		else
-			chmod(rz->pathname, (07777 & zi->mode));
+			fchmodat(rz->dirfd, rz->pathname, (07777 & zi->mode), 0);
 	}
 	return OK;
 }
@@ -1463,7 +2065,7 @@ exec2(const char *s)
 {
 	if (*s == '!')
 		++s;
-	io_mode(0,0);
+	io_mode(NULL,0,0);
 	execl("/bin/sh", "sh", "-c", s, NULL);
 	log_fatal("execl: %s", strerror(errno));
 	exit(1);
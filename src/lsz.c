@@ -47,9 +47,38 @@
 #include "zmodem.h"
 #include "crctab.h"
 #include "zm.h"
+#include "szpipe.h"
 
 #define MAX_BLOCK 8192
 
+/* When reading a pipe, the last RING_SIZE bytes sent are kept to
+ * answer a ZRPOS with. */
+#define RING_SIZE (1024 * 1024)
+
+/* A ZFEC frame follows every FEC_KMIN to FEC_KMAX data subpackets,
+ * starting at FEC_KSTART.  Each ZSACK halves the number, as the
+ * parity did not help, and FEC_CLEAN frames without one double it.
+ * A group spans at most FEC_SPAN bytes, well within what the receiver
+ * keeps of the data it wrote out. */
+#define FEC_KMIN 2
+#define FEC_KMAX 16
+#define FEC_KSTART 8
+#define FEC_CLEAN 16
+#define FEC_SPAN (32 * 1024)
+
+/* A restart halves the subpacket length, down to BLK_MIN, and every
+ * BLK_ROUND subpackets without one add BLK_STEP.  It never goes over
+ * what the receiver takes, nor over what the recent error rate makes
+ * worth the resends. */
+#define BLK_MIN 32
+#define BLK_STEP 128
+#define BLK_ROUND 4
+
+/* The extents of the last SENT_LOG data subpackets are kept, so that a
+ * ZSACK gets back the subpacket it lost, however long the ones sent
+ * since are. */
+#define SENT_LOG 1024
+
 struct sz_ {
 	zm_t *zm;		/* zmodem comm primitives' state */
 	// state
@@ -57,6 +86,9 @@ struct sz_ {
 	FILE *input_f;
 	size_t mm_size;
 	void *mm_addr;
+	char *ring;		/* the last bytes read from a pipe, or NULL */
+	size_t ring_size;	/* how many bytes RING keeps */
+	size_t ring_end;	/* the file position just past them */
 	size_t lastsync;		/* Last offset to which we got a ZRPOS */
 	size_t bytcnt;
 	char crcflg;
@@ -82,10 +114,66 @@ struct sz_ {
 	time_t stop_time;
 	char *tcp_server_address;
 	int tcp_socket;
-	int error_count;
 	jmp_buf intrjmp;	/* For the interrupt on RX CAN */
 	int zrqinits_sent;
 	int play_with_sigint;
+	int dont_send_zrqinit;	/* sz_getzrxinit: first ZRQINIT not yet answered */
+	double timing_start;	/* start of the current timing() interval */
+
+	/* sz_transmit_file_contents_by_zmodem */
+	int junkcount;		/* Counts garbage chars received by TX */
+	size_t last_txpos;	/* position at the last progress report */
+	long last_bps;
+	long not_printed;
+	time_t low_bps;		/* when the rate dropped below min_bps */
+	int pipeline;		/* RZSZ_FLAGS_PIPELINE was given */
+	sz_pipe_t *pipe;	/* the read-ahead and encoder threads */
+	sz_writer_t *writer;	/* the writer thread, if any */
+	int use_monitor;	/* RZSZ_FLAGS_MONITOR was given */
+	sz_monitor_t *monitor;	/* reads the back channel once data was sent */
+	int use_sack;		/* RZSZ_FLAGS_SACK was given */
+	int sack;		/* the receiver takes ZXSACK */
+	int sack_file;		/* ZXSACK was offered for this file */
+	size_t sackpos;		/* where the last ZSACK asked for data */
+	unsigned long resent;	/* bytes sent again for ZSACKs */
+	int use_fec;		/* RZSZ_FLAGS_FEC was given */
+	int fec;		/* the receiver takes ZTXOR */
+	int fec_file;		/* ZTXOR was asked for this file */
+	unsigned fec_k;		/* data subpackets per ZFEC frame */
+	unsigned fec_clean;	/* ZFEC frames sent since the last ZSACK */
+	unsigned fec_n;		/* data subpackets in the group so far */
+	size_t fec_pos;		/* where the group starts */
+	size_t fec_plen;	/* the length of its first subpacket */
+	size_t fec_last;	/* the length of its last */
+	char fec_buf[MAX_BLOCK + 3];	/* the XOR of the group */
+	unsigned long parity;	/* bytes sent in ZFEC frames */
+
+	/* sz_next_block_length */
+	size_t blk_max;		/* the longest subpacket the receiver takes */
+	size_t blk_errpos;	/* where the last error was, to count it once */
+	int blk_cut;		/* a restart came since the last subpacket */
+	unsigned blk_clean;	/* subpackets since the last change */
+	unsigned long blk_mark;	/* wire bytes sent up to the last error */
+	unsigned long blk_bpe;	/* wire bytes per error, averaged, or 0 */
+	unsigned long blk_data;	/* data bytes sent in subpackets */
+
+	/* sz_calculate_block_length, with the legacy_blklen option */
+	int legacy_blklen;
+	int error_count;
+	long wire_sent;		/* bytes put on the wire, for the block length */
+	long total_bytes;	/* bytes in the files */
+	int calcs_done;
+	long last_error_count;
+	int last_blklen;
+	long last_bytes_per_error;
+
+	/* sz_resend_subpacket */
+	size_t sent_pos[SENT_LOG];	/* where the subpackets started */
+	unsigned short sent_len[SENT_LOG]; /* and their lengths */
+	unsigned sent_next;	/* the slot for the next one */
+	unsigned sent_count;	/* slots used for this file */
+
+	size_t eof_pos;		/* where the last ZEOF said the file ends */
 
 	// parameters
 	char lzconv;	/* Local ZMODEM file conversion request */
@@ -105,7 +193,9 @@ struct sz_ {
 	long min_bps;
 	long min_bps_time;
 	int hyperterm;
-	int io_mode_fd;
+	int io_mode_fd;		/* terminal to set modes on, or -1 */
+	io_mode_t io_mode;	/* terminal modes saved by io_mode */
+	size_t total_sent;	/* bytes of the files sent completely */
 
 	void (*complete_cb)(const char *filename, int result, size_t size, time_t date);
 	bool (*tick_cb)(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left);
@@ -116,10 +206,10 @@ struct sz_ {
 typedef struct sz_ sz_t;
 
 static sz_t*
-sz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
+sz_init(zmodem_transport_t *tp, size_t readnum, size_t bufsize, int no_timeout,
 	int rxtimeout, int znulls, int eflag, int baudrate, int zctlesc, int zrwindow,
 	char lzconv, char lzmanag, int lskipnocor, int tcp_flag, unsigned txwindow, unsigned txwspac,
-	int under_rsh, int no_unixmode, int canseek, int restricted,
+	int under_rsh, int no_unixmode, int canseek, size_t ringsize, int restricted,
 	int fullname, unsigned blkopt, int tframlen, int wantfcs32,
 	size_t max_blklen, size_t start_blklen, time_t stop_time,
 	long min_bps, long min_bps_time,
@@ -128,10 +218,15 @@ sz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
 	bool (*tick_cb)(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left)
 	)
 {
-	sz_t *sz = malloc(sizeof(sz_t));
-	memset(sz, 0, sizeof(sz_t));
-	sz->zm = zm_init(fd, readnum, bufsize, no_timeout,
+	sz_t *sz = calloc(1, sizeof(sz_t));
+	if (!sz)
+		return NULL;
+	sz->zm = zm_init(tp, readnum, bufsize, no_timeout,
 			 rxtimeout, znulls, eflag, baudrate, zctlesc, zrwindow);
+	if (!sz->zm) {
+		free(sz);
+		return NULL;
+	}
 	sz->lzconv = lzconv;
 	sz->lzmanag = lzmanag;
 	sz->lskipnocor = lskipnocor;
@@ -143,6 +238,11 @@ sz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
 	sz->under_rsh = under_rsh;
 	sz->no_unixmode = no_unixmode;
 	sz->canseek = canseek;
+	/* A receiver with a window answers before the sender gets
+	 * further ahead than that, so a ZRPOS is never older. */
+	sz->ring_size = ringsize;
+	if (txwindow && sz->ring_size < txwindow + MAX_BLOCK)
+		sz->ring_size = txwindow + MAX_BLOCK;
 	sz->filesleft = 0;
 	sz->restricted = restricted;
 	sz->fullname = fullname;
@@ -163,9 +263,19 @@ sz_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
 	sz->hyperterm = hyperterm;
 	sz->complete_cb = complete_cb;
 	sz->tick_cb = tick_cb;
+	sz->dont_send_zrqinit = 1;
 	return sz;
 }
 
+static void
+sz_free(sz_t *sz)
+{
+	zm_free(sz->zm);
+	free(sz->ring);
+	free(sz->tcp_server_address);
+	free(sz);
+}
+
 static int sz_transmit_file_by_zmodem (sz_t *sz, struct zm_fileinfo *zi, const char *buf, size_t blen);
 static int sz_getnak (sz_t *sz);
 static int sz_transmit_pathname (sz_t *sz, struct zm_fileinfo *);
@@ -173,18 +283,23 @@ static int sz_transmit_file (sz_t *sz, const char *oname, const char *remotename
 static size_t sz_zfilbuf (sz_t *sz, struct zm_fileinfo *zi);
 static size_t sz_filbuf (sz_t *sz, char *buf, size_t count);
 static int sz_getzrxinit (sz_t *sz);
+static size_t sz_next_block_length (sz_t *sz);
 static int sz_calculate_block_length (sz_t *sz, long total_sent);
+static void sz_block_error (sz_t *sz, size_t pos, int restart);
 static int sz_sendzsinit (sz_t *sz);
 static int sz_transmit_file_contents (sz_t *sz, struct zm_fileinfo *);
 static int sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *);
+static int sz_transmit_file_data (sz_t *sz, struct zm_fileinfo *);
 static int sz_getinsync (sz_t *sz, struct zm_fileinfo *, int flag);
+static int sz_get_header (sz_t *sz, uint32_t *rxpos);
+static void sz_stop_monitor (sz_t *sz);
+static void sz_saybibi (sz_t *sz);
 static void sz_countem (sz_t *sz, int argc, char **argv);
 static int sz_transmit_files (sz_t *sz, int argc, char *argp[]);
 static int sz_transmit_sector (sz_t *sz, char *buf, int sectnum, size_t cseclen);
 static int sz_send_pseudo(sz_t *sz, const char *name, const char *data);
 
-#define ZM_SEND_DATA(x,y,z)						\
-	do { if (sz->zm->crc32t) {zm_send_data32(sz->zm,x,y,z); } else {zm_send_data(sz->zm,x,y,z);}} while(0)
+#define ZM_SEND_DATA(x,y,z) sz->zm->send_data(sz->zm,x,y,z)
 #define DATAADR (sz->mm_addr ? ((char *)sz->mm_addr)+zi->bytes_sent : sz->txbuf)
 
 
@@ -217,8 +332,8 @@ bibi (int n)
 {
 	// canit(zr, STDOUT_FILENO);
 	fflush (stdout);
-	// FIXME, should be io_mode (sz->io_mode_fd, 0);
-	io_mode(0, 0);
+	// FIXME, should be io_mode (&sz->io_mode, sz->io_mode_fd, 0);
+	io_mode(NULL, 0, 0);
 	if (n == 99)
 		log_fatal(_("io_mode(,2) in rbsb.c not implemented"));
 	else
@@ -241,19 +356,28 @@ onintr(int n LRZSZ_ATTRIB_UNUSED)
 const char *program_name = "sz";
 
 
-size_t zmodem_send(int file_count,
-		   const char **file_list,
-		   bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
-		   void (*complete)(const char *filename, int result, size_t size, time_t date),
-		   uint64_t min_bps,
-		   uint32_t flags)
+/* Run a send session over TP.  IO_MODE_FD is the terminal whose
+   modes are set for the transfer, or -1 to leave terminal modes
+   alone.  Store the bytes of the files sent in *BYTES, and return
+   the exit code. */
+static int
+sz_session(zmodem_transport_t *tp, int io_mode_fd,
+	   int file_count,
+	   const char **file_list,
+	   bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+	   void (*complete)(const char *filename, int result, size_t size, time_t date),
+	   uint64_t min_bps,
+	   uint32_t flags,
+	   const zmodem_options_t *options,
+	   size_t *bytes)
 {
 	log_set_level(LOG_ERROR);
-	sz_t *sz = sz_init(0, /* fd */
+	sz_t *sz = sz_init(tp, /* transport */
 			   128, /* readnum */
 			   256, /* bufsize */
-			   1, /* no_timeout */
-			   600,	/* rxtimeout */
+			   !(options && options->timeout), /* no_timeout */
+			   options && options->timeout
+			   ? 6 * options->timeout : 600, /* rxtimeout */
 			   0, 	/* znulls */
 			   0,	/* eflag */
 			   2400, /* baudrate */
@@ -268,6 +392,8 @@ size_t zmodem_send(int file_count,
 			   0,	  /* under_rsh */
 			   0,	  /* no_unixmode */
 			   1,	  /* canseek */
+			   options && options->ring_size
+			   ? options->ring_size : RING_SIZE, /* ringsize */
 			   0,	  /* restricted */
 			   0,	  /* fullname */
 			   0,	  /* blkopt */
@@ -284,6 +410,11 @@ size_t zmodem_send(int file_count,
 			   complete,  /* file complete callback */
 			   tick	      /* tick callback */
 		);
+	*bytes = 0;
+	if (!sz) {
+		log_fatal(_("out of memory"));
+		return 1;
+	}
 	log_info("initial protocol is ZMODEM");
 	if (sz->start_blklen==0) {
 		sz->start_blklen=1024;
@@ -291,13 +422,27 @@ size_t zmodem_send(int file_count,
 			sz->start_blklen=sz->max_blklen=sz->tframlen;
 		}
 	}
-	sz->zm->baudrate = io_mode(sz->io_mode_fd,1);
+	sz->io_mode_fd = io_mode_fd;
+	if (sz->io_mode_fd >= 0)
+		sz->zm->baudrate = io_mode(&sz->io_mode,sz->io_mode_fd,1);
+	if (flags & RZSZ_FLAGS_PIPELINE) {
+		/* The protocol thread keeps reading the line itself; only
+		 * its output goes through the writer thread. */
+		sz->writer = sz_writer_new(tp);
+		if (sz->writer)
+			sz->zm->tp = sz_writer_transport(sz->writer);
+		sz->pipeline = 1;
+	}
+	sz->use_monitor = (flags & RZSZ_FLAGS_MONITOR) != 0;
+	sz->use_sack = (flags & (RZSZ_FLAGS_SACK | RZSZ_FLAGS_FEC)) != 0;
+	sz->use_fec = (flags & RZSZ_FLAGS_FEC) != 0;
+	sz->fec_k = FEC_KSTART;
+	sz->legacy_blklen = options && options->legacy_blklen;
 
 	/* Spec 8.1: "The sending program may send the string "rz\r" to
 	   invoke the receiving program from a possible command
 	   mode." */
-	display("rz\r");
-	fflush(stdout);
+	zm_put(sz->zm, "rz\r", 3);
 
 	/* Spec 8.1: "The sending program may then display a message
 	 * intended for human consumption."  That would happen here,
@@ -308,24 +453,9 @@ size_t zmodem_send(int file_count,
 	 * might be useful if the receiver has already died or
 	 * if there is dirt left if the line
 	 */
-	struct timeval t;
-	unsigned char throwaway;
-	fd_set f;
-
-	zreadline_flushline(sz->zm->zr);
-
-	t.tv_sec = 0;
-	t.tv_usec = 0;
-
-	FD_ZERO(&f);
-	FD_SET(sz->io_mode_fd,&f);
-
-	while (select(1,&f,NULL,NULL,&t)) {
-		if (0==read(sz->io_mode_fd,&throwaway,1)) /* EOF ... */
-			break;
-	}
-
 	zreadline_flushline(sz->zm->zr);
+	while (zreadline_ready(sz->zm->zr))
+		zreadline_flush(sz->zm->zr);
 
 	/* Spec 8.1: "Then the sender may send a ZRQINIT. The ZRQINIT
 	   header causes a previously started receive program to send
@@ -337,15 +467,26 @@ size_t zmodem_send(int file_count,
 		sz->totalleft+=256; /* tcp never needs more */
 		sz->filesleft++;
 	}
-	fflush(stdout);
+	zm_flush(sz->zm);
 
 	/* This is the main loop.  */
 	if (sz_transmit_files(sz, file_count, file_list)==ERROR) {
+		sz_stop_monitor(sz);
 		sz->exitcode=0200;
-		zreadline_canit(sz->zm->zr, STDOUT_FILENO);
+		zm_flush(sz->zm);
+		zm_canit(sz->zm);
 	}
-	fflush(stdout);
-	io_mode(sz->io_mode_fd, 0);
+	zm_flush(sz->zm);
+	if (sz->writer) {
+		sz_writer_free(sz->writer);
+		sz->zm->tp = tp;
+	}
+	if (tp->drain)
+		tp->drain(tp->ctx);
+	log_debug("wire output: %lu bytes in %lu writes, %lu resent for ZSACK, %lu parity",
+		  sz->zm->tx_bytes, sz->zm->tx_writes, sz->resent, sz->parity);
+	if (sz->io_mode_fd >= 0)
+		io_mode(&sz->io_mode,sz->io_mode_fd, 0);
 	int dm = 0;
 	if (sz->exitcode)
 		dm=sz->exitcode;
@@ -353,15 +494,49 @@ size_t zmodem_send(int file_count,
 		dm=1;
 	else
 		dm=0;
+	*bytes = sz->total_sent;
+	sz_free(sz);
 	if (dm)
 		log_info(_("Transfer incomplete"));
 	else
 		log_info(_("Transfer complete"));
-	exit(dm);
-	/*NOTREACHED*/
+	return dm;
+}
 
+size_t zmodem_send(int file_count,
+		   const char **file_list,
+		   bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+		   void (*complete)(const char *filename, int result, size_t size, time_t date),
+		   uint64_t min_bps,
+		   uint32_t flags)
+{
+	zmodem_transport_t *tp = NULL;
+	size_t bytes;
+
+	if (flags & RZSZ_FLAGS_URING)
+		tp = zmodem_transport_uring(0, 1);
+	if (!tp)
+		tp = zmodem_transport_fd(0, 1);
+	sz_session(tp, 0, file_count, file_list, tick, complete,
+		   min_bps, flags, NULL, &bytes);
+	zmodem_transport_free(tp);
+	return bytes;
+}
+
+size_t zmodem_send_ex(zmodem_transport_t *tp,
+		      int file_count,
+		      const char **file_list,
+		      bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+		      void (*complete)(const char *filename, int result, size_t size, time_t date),
+		      uint64_t min_bps,
+		      uint32_t flags,
+		      const zmodem_options_t *options)
+{
+	size_t bytes;
 
-	return 0u;
+	sz_session(tp, -1, file_count, file_list, tick, complete,
+		   min_bps, flags, options, &bytes);
+	return bytes;
 }
 
 static int
@@ -382,7 +557,7 @@ sz_send_pseudo(sz_t *sz, const char *name, const char *data)
 	tmp=malloc(PATH_MAX+1);
 	if (!tmp) {
 		log_fatal(_("out of memory"));
-		exit(1);
+		return 1;
 	}
 
 	plen=strlen(p);
@@ -456,7 +631,7 @@ sz_transmit_files (sz_t *sz, int argc, char *argp[])
 		d=tcp_server(buf);
 		if (sz_send_pseudo(sz, "/$tcp$.t",buf)) {
 			log_fatal(_("tcp protocol init failed"));
-			exit(1);
+			return ERROR;
 		}
 		/* ok, now that this file is sent we can switch to tcp */
 
@@ -474,13 +649,13 @@ sz_transmit_files (sz_t *sz, int argc, char *argp[])
 	}
 	sz->totsecs = 0;
 	if (sz->filcnt == 0) {			/* bitch if we couldn't open ANY files */
-		zreadline_canit(sz->zm->zr, STDOUT_FILENO);
+		zm_canit(sz->zm);
 		log_info (_ ("Can't open any requested files."));
 		return ERROR;
 	}
 	if (sz->zm->zmodem_requested)
 		/* The session to the receiver is terminated here. */
-		zm_saybibi (sz->zm);
+		sz_saybibi (sz);
 	else {
 		struct zm_fileinfo zi;
 		char pa[PATH_MAX+1];
@@ -519,9 +694,9 @@ sz_transmit_file(sz_t *sz, const char *oname, const char *remotename)
 		 	strlen(MK_STRING(PUBDIR))))
 #endif
 		) {
-			zreadline_canit(sz->zm->zr, STDOUT_FILENO);
+			zm_canit(sz->zm);
 			log_fatal(_("security violation: not allowed to upload from %s"),oname);
-			exit(1);
+			return ERROR;
 		}
 	}
 
@@ -553,6 +728,17 @@ sz_transmit_file(sz_t *sz, const char *oname, const char *remotename)
 		fclose(sz->input_f);
 		return OK;
 	}
+	/* A pipe cannot go back for a ZRPOS, so keep what was read
+	 * of it.  Without the memory, errors end the transfer as
+	 * before. */
+	free(sz->ring);
+	sz->ring = NULL;
+	sz->ring_end = 0;
+	if (!S_ISREG(f.st_mode)) {
+		sz->ring = malloc(sz->ring_size);
+		if (!sz->ring)
+			log_error(_("out of memory"));
+	}
 
 	/* Here we finally start filling in information about the
          * file in a ZI structure.  We need this for the ZMODEM
@@ -574,7 +760,7 @@ sz_transmit_file(sz_t *sz, const char *oname, const char *remotename)
 	zi.bytes_received=0;
 	zi.bytes_skipped=0;
 	zi.eof_seen=0;
-	timing(1,NULL);
+	timing(&sz->timing_start,1,NULL);
 
 	++sz->filcnt;
 	/* Now that the file information is validated and is in a ZI
@@ -594,12 +780,13 @@ sz_transmit_file(sz_t *sz, const char *oname, const char *remotename)
 	/* Here we make a log message the transmission of a single
 	 * file. */
 	long bps;
-	double d=timing(0,NULL);
+	double d=timing(&sz->timing_start,0,NULL);
 	if (d==0) /* can happen if timing() uses time() */
 		d=0.5;
 	bps=zi.bytes_sent/d;
 	log_debug(_("Bytes Sent:%7ld   BPS:%-8ld"),
 		  (long) zi.bytes_sent,bps);
+	sz->total_sent += zi.bytes_sent;
 	if (sz->complete_cb)
 	  sz->complete_cb(zi.fname, 0, zi.bytes_sent, zi.modtime);
 
@@ -730,7 +917,8 @@ sz_getnak(sz_t *sz)
 			continue;
 		case WANTG:
 			/* Set cbreak, XON/XOFF, etc. */
-			io_mode(sz->io_mode_fd, 2);
+			if (sz->io_mode_fd >= 0)
+				io_mode(&sz->io_mode,sz->io_mode_fd, 2);
 			sz->optiong = TRUE;
 			sz->blklen=1024;
 		case WANTCRC:
@@ -789,8 +977,7 @@ sz_transmit_file_contents(sz_t *sz, struct zm_fileinfo *zi)
 	attempts=0;
 	do {
 		zreadline_flushline(sz->zm->zr);
-		putchar(EOT);
-		fflush(stdout);
+		zm_send_byte(sz->zm, EOT);
 		++attempts;
 	} while ((firstch=(zreadline_getc(sz->zm->zr, sz->zm->rxtimeout)) != ACK) && attempts < RETRYMAX);
 	if (attempts == RETRYMAX) {
@@ -809,31 +996,35 @@ sz_transmit_sector(sz_t *sz, char *buf, int sectnum, size_t cseclen)
 	unsigned oldcrc;
 	int firstch;
 	int attempts;
+	char head[3], tail[2];
 
 	firstch=0;	/* part of logic to detect CAN CAN */
 
 	log_debug(_("Zmodem sectors/kbytes sent: %3d/%2dk"), sz->totsecs, sz->totsecs/8 );
 	for (attempts=0; attempts <= RETRYMAX; attempts++) {
 		sz->lastrx= firstch;
-		putchar(cseclen==1024?STX:SOH);
-		putchar(sectnum & 0xFF);
+		head[0] = cseclen==1024?STX:SOH;
+		head[1] = (char) (sectnum & 0xFF);
 		/* FIXME: clarify the following line - mlg */
-		putchar((-sectnum -1) & 0xFF);
+		head[2] = (char) ((-sectnum -1) & 0xFF);
+		zm_put(sz->zm, head, 3);
+		zm_put(sz->zm, buf, cseclen);
 		oldcrc=checksum=0;
 		for (wcj=cseclen,cp=buf; --wcj>=0; ) {
-			putchar(*cp);
 			oldcrc=updcrc((0377& *cp), oldcrc);
 			checksum += *cp++;
 		}
 		if (sz->crcflg) {
 			oldcrc=updcrc(0,updcrc(0,oldcrc));
-			putchar(((int)oldcrc>>8) & 0xFF);
-			putchar(((int)oldcrc) & 0xFF);
+			tail[0] = (char) (((int)oldcrc>>8) & 0xFF);
+			tail[1] = (char) (((int)oldcrc) & 0xFF);
+			zm_put(sz->zm, tail, 2);
 		}
-		else
-			putchar(checksum & 0xFF);
-
-		fflush(stdout);
+		else {
+			tail[0] = (char) (checksum & 0xFF);
+			zm_put(sz->zm, tail, 1);
+		}
+		zm_flush(sz->zm);
 		if (sz->optiong) {
 			sz->firstsec = FALSE; return OK;
 		}
@@ -912,16 +1103,97 @@ sz_filbuf(sz_t *sz, char *buf, size_t count)
 	return count;
 }
 
+/* Keep the N bytes at BUF, just read from the pipe, in the ring. */
+static void
+sz_ring_keep (sz_t *sz, const char *buf, size_t n)
+{
+	size_t off, m;
+
+	if (n > sz->ring_size) {
+		buf += n - sz->ring_size;
+		sz->ring_end += n - sz->ring_size;
+		n = sz->ring_size;
+	}
+	off = sz->ring_end % sz->ring_size;
+	m = sz->ring_size - off;
+	if (m > n)
+		m = n;
+	memcpy (sz->ring + off, buf, m);
+	memcpy (sz->ring, buf + m, n - m);
+	sz->ring_end += n;
+}
+
+/* Read up to N bytes at POS of the pipe into BUF: from the ring as
+ * far as it goes, then from the pipe.  POS is at most RING_END and
+ * still in the ring.  Returns the bytes read, short only at the end
+ * of the input. */
+static size_t
+sz_ring_read (sz_t *sz, size_t pos, char *buf, size_t n)
+{
+	size_t got = 0;
+
+	while (got < n && pos + got < sz->ring_end) {
+		size_t off = (pos + got) % sz->ring_size;
+		size_t m = n - got;
+
+		if (m > sz->ring_end - pos - got)
+			m = sz->ring_end - pos - got;
+		if (m > sz->ring_size - off)
+			m = sz->ring_size - off;
+		memcpy (buf + got, sz->ring + off, m);
+		got += m;
+	}
+	if (got < n) {
+		size_t m = fread (buf + got, 1, n - got, sz->input_f);
+
+		sz_ring_keep (sz, buf + got, m);
+		got += m;
+	}
+	return got;
+}
+
+/* Go to POS of the input for a ZRPOS or a ZSACK.  A pipe goes back
+ * only as far as the ring reaches, and forward by reading. */
+static int
+sz_seek (sz_t *sz, size_t pos)
+{
+	size_t oldest;
+
+	if (sz->mm_addr)
+		return OK;
+	if (!sz->ring)
+		return fseek (sz->input_f, (long) pos, 0) ? ERROR : OK;
+	oldest = sz->ring_end > sz->ring_size
+		? sz->ring_end - sz->ring_size : 0;
+	if (pos < oldest) {
+		log_error (_("cannot go back to %lu, only to %lu"),
+			   (unsigned long) pos, (unsigned long) oldest);
+		return ERROR;
+	}
+	while (sz->ring_end < pos) {
+		size_t m = pos - sz->ring_end;
+
+		if (m > sizeof (sz->txbuf))
+			m = sizeof (sz->txbuf);
+		if (sz_ring_read (sz, sz->ring_end, sz->txbuf, m) < m)
+			return ERROR;
+	}
+	return OK;
+}
+
 /* Fill buffer with blklen chars */
 static size_t
 sz_zfilbuf (sz_t *sz, struct zm_fileinfo *zi)
 {
 	size_t n;
 
-	n = fread (sz->txbuf, 1, sz->blklen, sz->input_f);
+	if (sz->ring)
+		n = sz_ring_read (sz, zi->bytes_sent, sz->txbuf, sz->blklen);
+	else
+		n = fread (sz->txbuf, 1, sz->blklen, sz->input_f);
 	if (n < sz->blklen)
 		zi->eof_seen = 1;
-	else {
+	else if (!sz->ring || zi->bytes_sent + n == sz->ring_end) {
 		/* save one empty paket in case file ends ob blklen boundary */
 		int c = getc(sz->input_f);
 
@@ -1007,7 +1279,6 @@ usage(int exitcode, const char *what)
 static int
 sz_getzrxinit(sz_t *sz)
 {
-	static int dont_send_zrqinit=1;
 	int old_timeout=sz->zm->rxtimeout;
 	int n;
 	struct stat f;
@@ -1023,12 +1294,12 @@ sz_getzrxinit(sz_t *sz)
 		 * Never send more then 4 ZRQINIT, because
 		 * omen rz stops if it saw 5 of them.
 		 */
-		if (sz->zrqinits_sent<4 && n!=10 && !dont_send_zrqinit) {
+		if (sz->zrqinits_sent<4 && n!=10 && !sz->dont_send_zrqinit) {
 			sz->zrqinits_sent++;
 			zm_set_header_payload(sz->zm, 0L);
 			zm_send_hex_header(sz->zm, ZRQINIT);
 		}
-		dont_send_zrqinit=0;
+		sz->dont_send_zrqinit=0;
 
 		switch (zm_get_header(sz->zm, &rxpos)) {
 		case ZCHALLENGE:	/* Echo receiver's challenge numbr */
@@ -1046,13 +1317,22 @@ sz_getzrxinit(sz_t *sz)
 				if (sz->zm->zctlesc && !old)
 					zm_escape_sequence_update(sz->zm);
 			}
+			zm_select_data_loops(sz->zm);
 			sz->rxbuflen = (0377 & sz->zm->Rxhdr[ZP0])+((0377 & sz->zm->Rxhdr[ZP1])<<8);
 			if ( !(sz->rxflags & CANFDX))
 				sz->txwindow = 0;
+			/* A window asks for ZACKs with subpackets that
+			 * continue the frame, which ZXSACK does not
+			 * have. */
+			sz->sack = sz->use_sack && !sz->txwindow
+				&& (sz->rxflags2 & ZF1_CANSACK);
+			sz->fec = sz->sack && sz->use_fec
+				&& (sz->rxflags2 & ZF1_CANFEC);
 			log_debug("Rxbuflen=%d Tframlen=%d", sz->rxbuflen, sz->tframlen);
 			if ( sz->play_with_sigint)
 				signal(SIGINT, SIG_IGN);
-			io_mode(sz->io_mode_fd,2);	/* Set cbreak, XON/XOFF, etc. */
+			if (sz->io_mode_fd >= 0)
+				io_mode(&sz->io_mode,sz->io_mode_fd,2);	/* Set cbreak, XON/XOFF, etc. */
 			/* Override to force shorter frame length */
 			if (sz->tframlen && sz->rxbuflen > sz->tframlen)
 				sz->rxbuflen = sz->tframlen;
@@ -1087,6 +1367,22 @@ sz_getzrxinit(sz_t *sz)
 				sz->blklen = sz->rxbuflen;
 			if (sz->blkopt && sz->blklen > sz->blkopt)
 				sz->blklen = sz->blkopt;
+			/* Data subpackets start at START_BLKLEN and
+			 * stay within the buffer length the receiver
+			 * gave, or MAX_BLKLEN if it gave none. */
+			sz->blk_max = (0377 & sz->zm->Rxhdr[ZP0])
+				+ ((0377 & sz->zm->Rxhdr[ZP1]) << 8);
+			if (!sz->blk_max)
+				sz->blk_max = sz->max_blklen;
+			if (sz->tframlen && sz->blk_max > sz->tframlen)
+				sz->blk_max = sz->tframlen;
+			if (sz->blkopt && sz->blk_max > sz->blkopt)
+				sz->blk_max = sz->blkopt;
+			if (sz->blk_max > MAX_BLOCK)
+				sz->blk_max = MAX_BLOCK;
+			if (sz->start_blklen)
+				sz->blklen = sz->start_blklen < sz->blk_max
+					? sz->start_blklen : sz->blk_max;
 			log_debug("Rxbuflen=%d blklen=%d", sz->rxbuflen, sz->blklen);
 			log_debug("Txwindow = %u Txwspac = %d", sz->txwindow, sz->txwspac);
 			sz->zm->rxtimeout = old_timeout;
@@ -1160,14 +1456,30 @@ sz_transmit_file_by_zmodem(sz_t *sz, struct zm_fileinfo *zi, const char *buf, si
 		sz->zm->Txhdr[ZF1] = sz->lzmanag;	/* file management request */
 		if (sz->lskipnocor)
 			sz->zm->Txhdr[ZF1] |= ZF1_ZMSKNOLOC;
-		sz->zm->Txhdr[ZF2] = 0;	/* file transport compression request */
-		sz->zm->Txhdr[ZF3] = 0; /* extended options */
+		/* Resending a subpacket means seeking back to it. */
+		sz->sack_file = sz->sack && (sz->canseek > 0 || sz->ring);
+		sz->fec_file = sz->fec && sz->sack_file;
+		sz->fec_n = 0;
+		sz->blk_errpos = (size_t) -1;
+		/* The old calculation starts from the length of the
+		 * files, which sz_countem gave it on the command line. */
+		if (sz->legacy_blklen && !sz->total_bytes)
+			sz_calculate_block_length(sz, (long) zi->bytes_total);
+		sz->sent_count = 0;
+		sz->eof_pos = 0;
+		sz->zm->Txhdr[ZF2] = sz->fec_file ? ZTXOR : 0;	/* file transport compression request */
+		sz->zm->Txhdr[ZF3] = sz->sack_file ? ZXSACK : 0; /* extended options */
 		zm_send_binary_header(sz->zm, ZFILE);
 		ZM_SEND_DATA(buf, blen, ZCRCW);
 again:
-		c = zm_get_header(sz->zm, &rxpos);
+		c = sz_get_header(sz, &rxpos);
 		switch (c) {
 		case ZRINIT:
+			if (sz->monitor) {
+				if (sz_monitor_wait(sz->monitor, 5000))
+					goto again;
+				continue;
+			}
 			while ((c = zreadline_getc(sz->zm->zr, 50)) > 0)
 				if (c == ZPAD) {
 					goto again;
@@ -1213,16 +1525,11 @@ again:
 				}
 			}
 			if (sz->mm_addr) {
-				size_t i;
 				size_t count;
-				char *p=sz->mm_addr;
 				count=(rxpos < sz->mm_size && rxpos > 0)? rxpos: sz->mm_size;
-				for (i=0;i<count;i++,p++) {
-					crc = UPDC32(*p, crc);
-				}
-				crc = ~crc;
+				crc = ~crc32_update(crc, sz->mm_addr, count);
 			} else
-			if (sz->canseek >= 0) {
+			if (sz->canseek >= 0 && !sz->ring) {
 				if (rxpos==0) {
 					struct stat st;
 					if (0==fstat(fileno(sz->input_f),&st)) {
@@ -1230,9 +1537,7 @@ again:
 					} else
 						rxpos=-1;
 				}
-				while (rxpos-- && ((c = getc(sz->input_f)) != EOF))
-					crc = UPDC32(c, crc);
-				crc = ~crc;
+				crc = zm_file_crc32(sz->input_f, rxpos);
 				clearerr(sz->input_f);	/* Clear EOF */
 				fseek(sz->input_f, 0L, 0);
 			}
@@ -1262,8 +1567,7 @@ again:
 			 * Suppress zcrcw request otherwise triggered by
 			 * lastsync==bytcnt
 			 */
-			if (!sz->mm_addr)
-			if (rxpos && fseek(sz->input_f, (long) rxpos, 0)) {
+			if (rxpos && sz_seek(sz, rxpos) == ERROR) {
 				int er=errno;
 				log_debug("fseek failed: %s", strerror(er));
 				return ERROR;
@@ -1281,17 +1585,188 @@ again:
 	}
 }
 
+/* Stop the back channel monitor, if it runs, before the protocol
+ * thread reads the line itself again. */
+static void
+sz_stop_monitor (sz_t *sz)
+{
+	sz_monitor_free (sz->monitor);
+	sz->monitor = NULL;
+}
+
+/* Say "bibi" to the receiver like zm_saybibi, hearing its ZFIN from
+ * the monitor if one runs, then stop the monitor. */
+static void
+sz_saybibi (sz_t *sz)
+{
+	if (!sz->monitor) {
+		zm_saybibi (sz->zm);
+		return;
+	}
+	for (;;) {
+		zm_set_header_payload (sz->zm, 0);
+		zm_send_hex_header (sz->zm, ZFIN);
+		switch (sz_get_header (sz, NULL)) {
+		case ZFIN:
+			zm_put (sz->zm, "OO", 2);
+			zm_flush (sz->zm);
+			/* **** FALL THRU TO **** */
+		case ZCAN:
+		case TIMEOUT:
+			sz_stop_monitor (sz);
+			return;
+		}
+	}
+}
+
+/* Stop the read-ahead and encoder threads, if they run, before the
+ * file they read is unmapped. */
+static void
+sz_stop_pipe (sz_t *sz)
+{
+	sz_pipe_free (sz->pipe);
+	sz->pipe = NULL;
+}
+
 /* Send the data in the file */
 static int
 sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 {
-	static int c;
-	static int junkcount;				/* Counts garbage chars received by TX */
-	static size_t last_txpos = 0;
-	static long last_bps = 0;
-	static long not_printed = 0;
-	static long total_sent = 0;
-	static time_t low_bps=0;
+	zreadline_t *zr = sz->zm->zr;
+	int c;
+
+	/* Only a full duplex receiver answers while we send.  Once
+	 * started, the monitor reads the line till the ZFIN. */
+	if (sz->use_monitor && (sz->rxflags & CANFDX) && !sz->monitor) {
+		sz->monitor = sz_monitor_new (zr->tp, zr->readline_ptr,
+					      zr->readline_left > 0
+					      ? (size_t) zr->readline_left : 0);
+		if (sz->monitor) {
+			log_debug ("back channel monitor started");
+			zreadline_flush (zr);
+		}
+	}
+	c = sz_transmit_file_data (sz, zi);
+	sz_stop_pipe (sz);
+	return c;
+}
+
+/* Note that the N bytes at POS went out as one subpacket. */
+static void
+sz_sent_log (sz_t *sz, size_t pos, size_t n)
+{
+	sz->sent_pos[sz->sent_next] = pos;
+	sz->sent_len[sz->sent_next] = (unsigned short) n;
+	sz->sent_next = (sz->sent_next + 1) % SENT_LOG;
+	if (sz->sent_count < SENT_LOG)
+		sz->sent_count++;
+}
+
+/* The length of the subpacket last sent at POS, or the current one
+ * if it is no longer kept. */
+static size_t
+sz_sent_length (sz_t *sz, size_t pos)
+{
+	unsigned i, k = sz->sent_next;
+
+	for (i = 0; i < sz->sent_count; i++) {
+		k = (k + SENT_LOG - 1) % SENT_LOG;
+		if (sz->sent_pos[k] == pos)
+			return sz->sent_len[k];
+	}
+	return sz->blklen;
+}
+
+/* Send the subpacket at SZ->SACKPOS again, in a frame of its own
+ * ended with E, for a receiver that kept what came after it. */
+static int
+sz_resend_subpacket (sz_t *sz, struct zm_fileinfo *zi, int e)
+{
+	size_t pos = sz->sackpos;
+	size_t n = sz_sent_length (sz, pos);
+	const char *data = sz->txbuf;
+
+	if (sz->mm_addr) {
+		if (n > sz->mm_size - pos)
+			n = sz->mm_size - pos;
+		data = (const char *) sz->mm_addr + pos;
+	} else if (sz->ring) {
+		if (sz_seek (sz, pos) == ERROR)
+			return ERROR;
+		n = sz_ring_read (sz, pos, sz->txbuf, n);
+	} else {
+		if (fseek (sz->input_f, (long) pos, 0))
+			return ERROR;
+		n = fread (sz->txbuf, 1, n, sz->input_f);
+		if (fseek (sz->input_f, (long) zi->bytes_sent, 0))
+			return ERROR;
+	}
+	log_debug ("resending %lu bytes at %lx for ZSACK",
+		   (unsigned long) n, (unsigned long) pos);
+	zm_set_header_payload (sz->zm, pos);
+	zm_send_binary_header (sz->zm, ZDATA);
+	ZM_SEND_DATA (data, n, e);
+	sz->resent += n;
+	return OK;
+}
+
+/* Send the ZFEC frame for the group so far: the XOR of its
+ * subpackets, then their count and the length of the last. */
+static void
+sz_fec_send (sz_t *sz)
+{
+	size_t plen = sz->fec_plen;
+
+	if (sz->fec_n == 0)
+		return;
+	sz->fec_buf[plen] = (char) sz->fec_n;
+	sz->fec_buf[plen + 1] = (char) (sz->fec_last & 0xff);
+	sz->fec_buf[plen + 2] = (char) (sz->fec_last >> 8);
+	zm_set_header_payload (sz->zm, sz->fec_pos);
+	zm_send_binary_header (sz->zm, ZFEC);
+	ZM_SEND_DATA (sz->fec_buf, plen + 3, ZCRCE);
+	sz->parity += plen + 3;
+	sz->fec_n = 0;
+	if (++sz->fec_clean >= FEC_CLEAN && sz->fec_k < FEC_KMAX) {
+		sz->fec_k *= 2;
+		sz->fec_clean = 0;
+		log_debug ("%u subpackets per ZFEC", sz->fec_k);
+	}
+}
+
+/* Add the N bytes at DATA, just sent at POS, to the group.  All but
+ * the last subpacket of a group have the same length and follow on
+ * from each other, so anything else starts a new one. */
+static void
+sz_fec_add (sz_t *sz, size_t pos, const char *data, size_t n, int eof)
+{
+	size_t i;
+
+	if (n == 0)
+		return;
+	if (sz->fec_n
+	    && (pos != sz->fec_pos + sz->fec_n * sz->fec_plen
+		|| n > sz->fec_plen))
+		sz_fec_send (sz);
+	if (sz->fec_n == 0) {
+		sz->fec_pos = pos;
+		sz->fec_plen = n;
+		memset (sz->fec_buf, 0, n);
+	}
+	for (i = 0; i < n; i++)
+		sz->fec_buf[i] ^= data[i];
+	sz->fec_last = n;
+	sz->fec_n++;
+	if (n < sz->fec_plen || eof || sz->fec_n >= sz->fec_k
+	    || (sz->fec_n + 1) * sz->fec_plen > FEC_SPAN)
+		sz_fec_send (sz);
+}
+
+static int
+sz_transmit_file_data (sz_t *sz, struct zm_fileinfo *zi)
+{
+	int c;
+	int inframe;
 
 	/* memmap that file, if necessary */
 	if (!sz->mm_addr)
@@ -1309,12 +1784,19 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 			}
 		}
 	}
+	/* The pipeline works from the mapping; anything else is read
+	 * on this thread. */
+	if (sz->pipeline && sz->mm_addr && !sz->pipe)
+		sz->pipe = sz_pipe_new (sz->mm_addr, sz->mm_size,
+					zi->bytes_sent, sz->blklen,
+					sz->zm->escape_sequence_table,
+					sz->zm->txctlesc, sz->zm->txfcs32);
 
 	if (sz->play_with_sigint)
 		signal (SIGINT, onintr);
 
 	sz->lrxpos = 0;
-	junkcount = 0;
+	sz->junkcount = 0;
   somemore:
 	/* Note that this whole next block is a
 	 * setjmp block for error recovery.  The
@@ -1323,7 +1805,7 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 	  if (sz->play_with_sigint)
 		  signal (SIGINT, onintr);
 	  waitack:
-		junkcount = 0;
+		sz->junkcount = 0;
 		c = sz_getinsync (sz, zi, 0);
 	  gotack:
 		switch (c) {
@@ -1342,16 +1824,31 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 		case ZACK:
 		case ZRPOS:
 			break;
+		case ZSACK:
+			/* Answer with a ZCRCW, so that the wait goes on
+			 * for what the receiver does next. */
+			if (sz_resend_subpacket (sz, zi, ZCRCW) == ERROR)
+				return ERROR;
+			goto waitack;
 		case ZRINIT:
+			/* The receiver took an earlier ZEOF, so it
+			 * has the whole file, whatever a stale ZRPOS
+			 * had us send again since. */
+			if (sz->eof_pos)
+				zi->bytes_sent = sz->eof_pos;
 			return OK;
 		}
 		/*
 		 * If the reverse channel can be tested for data,
 		 *  this logic may be used to detect error packets
 		 *  sent by the receiver, in place of setjmp/longjmp
-		 *  rdchk(fdes) returns non 0 if a character is available
+		 *  zreadline_ready returns non 0 if a character is available
 		 */
-		while (rdchk (sz->io_mode_fd)) {
+		if (sz->monitor && sz_monitor_pending (sz->monitor)) {
+			c = sz_getinsync (sz, zi, 1);
+			goto gotack;
+		}
+		while (!sz->monitor && zreadline_ready (sz->zm->zr)) {
 			switch (zreadline_getc (sz->zm->zr, 1))
 			{
 			case CAN:
@@ -1375,16 +1872,31 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 	sz->txwcnt = 0;
 	zm_set_header_payload (sz->zm, zi->bytes_sent);
 	zm_send_binary_header (sz->zm, ZDATA);
+	inframe = 1;
 
 	do {
+		const sz_pipe_block_t *blk = NULL;
 		size_t n;
 		int e;
-		unsigned old = sz->blklen;
-		sz->blklen = sz_calculate_block_length (sz, total_sent);
-		total_sent += sz->blklen + OVERHEAD;
+		size_t old = sz->blklen;
+		if (sz->legacy_blklen) {
+			int len = sz_calculate_block_length (sz, sz->wire_sent);
+
+			sz->blklen = len < BLK_MIN ? BLK_MIN : (size_t) len;
+			if (sz->blklen > sz->blk_max)
+				sz->blklen = sz->blk_max;
+			sz->wire_sent += (long) sz->blklen + OVERHEAD;
+		} else
+			sz->blklen = sz_next_block_length (sz);
 		if (sz->blklen != old)
-			log_trace (_("blklen now %d\n"), sz->blklen);
-		if (sz->mm_addr) {
+			log_trace (_("blklen now %lu\n"), (unsigned long) sz->blklen);
+		if (sz->pipe) {
+			sz_pipe_set_blklen (sz->pipe, sz->blklen);
+			blk = sz_pipe_next (sz->pipe, zi->bytes_sent);
+			n = blk->len;
+			if (blk->eof)
+				zi->eof_seen = 1;
+		} else if (sz->mm_addr) {
 			if (zi->bytes_sent + sz->blklen < sz->mm_size)
 				n = sz->blklen;
 			else {
@@ -1402,11 +1914,11 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 			 * a response except in case of error." */
 			e = ZCRCE;
 			log_trace("e=ZCRCE/eof seen");
-		} else if (junkcount > 3) {
+		} else if (sz->junkcount > 3) {
 			/* Spec 8.2: "ZCRCW data subpackets expect a
 			 * response before the next frame is sent." */
 			e = ZCRCW;
-			log_trace("e=ZCRCW/junkcount > 3");
+			log_trace("e=ZCRCW/sz->junkcount > 3");
 		} else if (sz->bytcnt == sz->lastsync) {
 			/* Spec 8.2: "ZCRCW data subpackets expect a
 			 * response before the next frame is sent." */
@@ -1430,30 +1942,39 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 			e = ZCRCG;
 			log_trace("e=ZCRCG");
 		}
+		/* With ZXSACK every subpacket has a header, so that a
+		 * receiver can place the ones after a bad one. */
+		if (sz->sack_file && e == ZCRCG)
+			e = ZCRCE;
+		/* With ZTXOR the receiver holds back ZSACKs while the
+		 * parity may yet fill a gap, so only a resend may wait
+		 * for an answer. */
+		if (sz->fec_file && e == ZCRCW)
+			e = ZCRCE;
 		if ((sz->min_bps || sz->stop_time || sz->tick_cb)
-			&& (not_printed > (sz->min_bps ? 3 : 7)
-				|| zi->bytes_sent > last_bps / 2 + last_txpos)) {
+			&& (sz->not_printed > (sz->min_bps ? 3 : 7)
+				|| zi->bytes_sent > sz->last_bps / 2 + sz->last_txpos)) {
 			int minleft = 0;
 			int secleft = 0;
 			time_t now;
-			last_bps = (zi->bytes_sent / timing (0,&now));
-			if (last_bps > 0) {
-				minleft = (zi->bytes_total - zi->bytes_sent) / last_bps / 60;
-				secleft = ((zi->bytes_total - zi->bytes_sent) / last_bps) % 60;
+			sz->last_bps = (zi->bytes_sent / timing (&sz->timing_start,0,&now));
+			if (sz->last_bps > 0) {
+				minleft = (zi->bytes_total - zi->bytes_sent) / sz->last_bps / 60;
+				secleft = ((zi->bytes_total - zi->bytes_sent) / sz->last_bps) % 60;
 			}
 			if (sz->min_bps) {
-				if (low_bps) {
-					if (last_bps<sz->min_bps) {
-						if (now-low_bps>=sz->min_bps_time) {
+				if (sz->low_bps) {
+					if (sz->last_bps<sz->min_bps) {
+						if (now-sz->low_bps>=sz->min_bps_time) {
 							/* too bad */
 							log_info(_("sz_transmit_file_contents_by_zmodem: bps rate %ld below min %ld"),
-								 last_bps, sz->min_bps);
+								 sz->last_bps, sz->min_bps);
 							return ERROR;
 						}
 					} else
-						low_bps=0;
-				} else if (last_bps < sz->min_bps) {
-					low_bps=now;
+						sz->low_bps=0;
+				} else if (sz->last_bps < sz->min_bps) {
+					sz->low_bps=now;
 				}
 			}
 			if (sz->stop_time && now>=sz->stop_time) {
@@ -1464,20 +1985,40 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 
 			log_debug (_("Bytes Sent:%7ld/%7ld   BPS:%-8ld ETA %02d:%02d  "),
 				  (long) zi->bytes_sent, (long) zi->bytes_total,
-				  last_bps, minleft, secleft);
+				  sz->last_bps, minleft, secleft);
 			if (sz->tick_cb) {
 				bool more = sz->tick_cb(zi->fname, (long) zi->bytes_sent, (long) zi->bytes_total,
-							last_bps, minleft, secleft);
+							sz->last_bps, minleft, secleft);
 				if (!more) {
 					log_info(_("sz_transmit_file_contents_by_zmodem: tick callback returns FALSE"));
 					return ERROR;
 				}
 			}
-			last_txpos = zi->bytes_sent;
+			sz->last_txpos = zi->bytes_sent;
+		} else
+			sz->not_printed++;
+		if (sz->monitor && sz_monitor_paused (sz->monitor))
+			/* Wait a while for an XON */
+			sz_monitor_wait_resume (sz->monitor, 10000);
+		if (!inframe) {
+			zm_set_header_payload (sz->zm, zi->bytes_sent);
+			zm_send_binary_header (sz->zm, ZDATA);
+			inframe = 1;
+		}
+		if (blk) {
+			zm_send_encoded_data (sz->zm, blk->image, blk->image_len,
+					      blk->crc, e);
+			sz_pipe_release (sz->pipe);
 		} else
-			not_printed++;
-		ZM_SEND_DATA (DATAADR, n, e);
+			ZM_SEND_DATA (DATAADR, n, e);
+		if (sz->fec_file)
+			sz_fec_add (sz, zi->bytes_sent, DATAADR, n, zi->eof_seen);
+		if (sz->sack_file)
+			sz_sent_log (sz, zi->bytes_sent, n);
+		sz->blk_data += n;
 		sz->bytcnt = zi->bytes_sent += n;
+		if (e == ZCRCE)
+			inframe = 0;
 		if (e == ZCRCW)
 			/* Spec 8.2: "ZCRCW data subpackets expect a
 			 * response before the next frame is sent." */
@@ -1486,10 +2027,22 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 		 * If the reverse channel can be tested for data,
 		 *  this logic may be used to detect error packets
 		 *  sent by the receiver, in place of setjmp/longjmp
-		 *  rdchk(fdes) returns non 0 if a character is available
+		 *  zreadline_ready returns non 0 if a character is available
 		 */
-		fflush (stdout);
-		while (rdchk (sz->io_mode_fd)) {
+		while (sz->monitor && sz_monitor_pending (sz->monitor)) {
+			c = sz_getinsync (sz, zi, 1);
+			if (c == ZACK)
+				continue;
+			if (c == ZSACK) {
+				if (sz_resend_subpacket (sz, zi, ZCRCE) == ERROR)
+					return ERROR;
+				inframe = 0;
+				continue;
+			}
+			ZM_SEND_DATA (sz->txbuf, 0, ZCRCE);
+			goto gotack;
+		}
+		while (!sz->monitor && zreadline_ready (sz->zm->zr)) {
 			switch (zreadline_getc (sz->zm->zr, 1))
 			{
 			case CAN:
@@ -1497,6 +2050,12 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 				c = sz_getinsync (sz, zi, 1);
 				if (c == ZACK)
 					break;
+				if (c == ZSACK) {
+					if (sz_resend_subpacket (sz, zi, ZCRCE) == ERROR)
+						return ERROR;
+					inframe = 0;
+					break;
+				}
 				/* zcrce - dinna wanna starta ping-pong game */
 				ZM_SEND_DATA (sz->txbuf, 0, ZCRCE);
 				goto gotack;
@@ -1504,7 +2063,7 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 			case XOFF | 0200:
 				zreadline_getc (sz->zm->zr, 100);
 			default:
-				++junkcount;
+				++sz->junkcount;
 			}
 		}
 		if (sz->txwindow) {
@@ -1533,11 +2092,16 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 		/* Spec 8.2: [after sending a file] The sender sends a
 		 * ZEOF header with the file ending offset equal to
 		 * the number of characters in the file. */
+		sz->eof_pos = zi->bytes_sent;
 		zm_set_header_payload (sz->zm, zi->bytes_sent);
 		zm_send_binary_header (sz->zm, ZEOF);
 		switch (sz_getinsync (sz, zi, 0)) {
 		case ZACK:
 			continue;
+		case ZSACK:
+			if (sz_resend_subpacket (sz, zi, ZCRCE) == ERROR)
+				return ERROR;
+			continue;
 		case ZRPOS:
 			goto somemore;
 		case ZRINIT:
@@ -1556,60 +2120,128 @@ sz_transmit_file_contents_by_zmodem (sz_t *sz, struct zm_fileinfo *zi)
 	}
 }
 
+/* The square root of X, rounded down. */
+static uint64_t
+sz_isqrt(uint64_t x)
+{
+	uint64_t r = x, y = (x + 1) / 2;
+
+	while (y < r) {
+		r = y;
+		y = (r + x / r) / 2;
+	}
+	return r;
+}
+
+/* Count an error at POS for the subpacket length: the ZRPOS or ZSACK
+ * asking for data again.  The receiver asks more than once for the
+ * same data while what was sent after it drains, and once is enough.
+ * Only a RESTART, a ZRPOS, cuts the length at once: it throws away
+ * everything sent since POS, where a ZSACK costs the one subpacket. */
+static void
+sz_block_error(sz_t *sz, size_t pos, int restart)
+{
+	unsigned long wire = sz->zm->tx_bytes - sz->blk_mark;
+
+	if (pos == sz->blk_errpos)
+		return;
+	sz->blk_errpos = pos;
+	sz->blk_mark = sz->zm->tx_bytes;
+	sz->blk_bpe = sz->blk_bpe ? (3 * sz->blk_bpe + wire) / 4 : wire;
+	if (restart)
+		sz->blk_cut = 1;
+}
+
+/* The length of the next subpacket. */
+static size_t
+sz_next_block_length(sz_t *sz)
+{
+	size_t len = sz->blklen;
+	size_t best = sz->blk_max;
+
+	if (sz->blk_cut) {
+		len /= 2;
+		sz->blk_cut = 0;
+		sz->blk_clean = 0;
+	} else if (++sz->blk_clean >= BLK_ROUND) {
+		len += BLK_STEP;
+		sz->blk_clean = 0;
+	}
+	if (sz->blk_bpe && sz->blk_data) {
+		/* Sending E wire bytes per data byte, escapes and
+		 * headers included, with an error every BPE of them,
+		 * subpackets of L bytes cost about OVERHEAD / L per
+		 * byte in headers and L * E * E / BPE in resends.  That
+		 * is least at L = sqrt (OVERHEAD * BPE) / E. */
+		uint64_t e = (uint64_t) sz->zm->tx_bytes * 256 / sz->blk_data;
+		uint64_t l = sz_isqrt((uint64_t) OVERHEAD * sz->blk_bpe) * 256
+			/ (e ? e : 256);
+
+		if (l < best)
+			best = (size_t) l;
+	}
+	if (len > best)
+		len = best;
+	if (len < BLK_MIN)
+		len = BLK_MIN;
+	if (len > sz->blk_max)
+		len = sz->blk_max;
+	return len;
+}
+
+/* The length of the next subpacket as lsz worked it out before
+ * sz_next_block_length, for the legacy_blklen option: a search over
+ * powers of two up to max_blklen against the errors counted since the
+ * start, held at start_blklen while there are none. */
 static int
 sz_calculate_block_length(sz_t *sz, long total_sent)
 {
-	static long total_bytes=0;
-	static int calcs_done=0;
-	static long last_error_count=0;
-	static int last_blklen=0;
-	static long last_bytes_per_error=0;
 	unsigned long best_bytes=0;
 	long best_size=0;
 	long this_bytes_per_error;
 	long d;
 	unsigned int i;
-	if (total_bytes==0)
+	if (sz->total_bytes==0)
 	{
 		/* called from sz_countem */
-		total_bytes=total_sent;
+		sz->total_bytes=total_sent;
 		return 0;
 	}
 
 	/* it's not good to calc blklen too early */
-	if (calcs_done++ < 5) {
+	if (sz->calcs_done++ < 5) {
 		if (sz->error_count && sz->start_blklen >1024)
-			return last_blklen=1024;
+			return sz->last_blklen=1024;
 		else
-			last_blklen/=2;
-		return last_blklen=sz->start_blklen;
+			sz->last_blklen/=2;
+		return sz->last_blklen=(int) sz->start_blklen;
 	}
 
 	if (!sz->error_count) {
 		/* that's fine */
 		if (sz->start_blklen==sz->max_blklen)
-			return sz->start_blklen;
+			return (int) sz->start_blklen;
 		this_bytes_per_error=LONG_MAX;
 		goto calcit;
 	}
 
-	if (sz->error_count!=last_error_count) {
+	if (sz->error_count!=sz->last_error_count) {
 		/* the last block was bad. shorten blocks until one block is
 		 * ok. this is because very often many errors come in an
 		 * short period */
 		if (sz->error_count & 2)
 		{
-			last_blklen/=2;
-			if (last_blklen < 32)
-				last_blklen = 32;
-			else if (last_blklen > 512)
-				last_blklen=512;
+			sz->last_blklen/=2;
+			if (sz->last_blklen < 32)
+				sz->last_blklen = 32;
+			else if (sz->last_blklen > 512)
+				sz->last_blklen=512;
 			log_trace(_("sz_calculate_block_length: reduced to %d due to error\n"),
-				 last_blklen);
+				 sz->last_blklen);
 		}
-		last_error_count=sz->error_count;
-		last_bytes_per_error=0; /* force recalc */
-		return last_blklen;
+		sz->last_error_count=sz->error_count;
+		sz->last_bytes_per_error=0; /* force recalc */
+		return sz->last_blklen;
 	}
 
 	this_bytes_per_error=total_sent / sz->error_count;
@@ -1629,31 +2261,31 @@ sz_calculate_block_length(sz_t *sz, long total_sent)
 	/* be nice to the poor machine and do the complicated things not
 	 * too often
 	 */
-	if (last_bytes_per_error>this_bytes_per_error)
-		d=last_bytes_per_error-this_bytes_per_error;
+	if (sz->last_bytes_per_error>this_bytes_per_error)
+		d=sz->last_bytes_per_error-this_bytes_per_error;
 	else
-		d=this_bytes_per_error-last_bytes_per_error;
+		d=this_bytes_per_error-sz->last_bytes_per_error;
 	if (d<4)
 	{
 		log_trace(_("sz_calculate_block_length: returned old value %d due to low bpe diff\n"),
-			 last_blklen);
+			 sz->last_blklen);
 		log_trace(_("sz_calculate_block_length: old %ld, new %ld, d %ld\n"),
-			 last_bytes_per_error,this_bytes_per_error,d );
-		return last_blklen;
+			 sz->last_bytes_per_error,this_bytes_per_error,d );
+		return sz->last_blklen;
 	}
-	last_bytes_per_error=this_bytes_per_error;
+	sz->last_bytes_per_error=this_bytes_per_error;
 
 calcit:
-	log_trace(_("sz_calculate_block_length: calc total_bytes=%ld, bpe=%ld, ec=%ld\n"),
-		 total_bytes,this_bytes_per_error,(long) sz->error_count);
+	log_trace(_("sz_calculate_block_length: calc sz->total_bytes=%ld, bpe=%ld, ec=%ld\n"),
+		 sz->total_bytes,this_bytes_per_error,(long) sz->error_count);
 	for (i=32;i<=sz->max_blklen;i*=2) {
 		long ok; /* some many ok blocks do we need */
 		long failed; /* and that's the number of blocks not transmitted ok */
 		unsigned long transmitted;
-		ok=total_bytes / i + 1;
+		ok=sz->total_bytes / i + 1;
 		failed=((long) i + OVERHEAD) * ok / this_bytes_per_error;
-		transmitted=total_bytes + ok * OVERHEAD
-			+ failed * ((long) i+OVERHEAD+OVER_ERR);
+		transmitted=(unsigned long) (sz->total_bytes + ok * OVERHEAD
+			+ failed * ((long) i+OVERHEAD+OVER_ERR));
 		log_trace(_("sz_calculate_block_length: blklen %d, ok %ld, failed %ld -> %lu\n"),
 			  i,ok,failed,transmitted);
 		if (transmitted < best_bytes || !best_bytes)
@@ -1662,12 +2294,38 @@ calcit:
 			best_size=i;
 		}
 	}
-	if (best_size > 2*last_blklen)
-		best_size=2*last_blklen;
-	last_blklen=best_size;
+	if (best_size > 2*sz->last_blklen)
+		best_size=2*sz->last_blklen;
+	sz->last_blklen=(int) best_size;
 	log_trace(_("sz_calculate_block_length: returned %d as best\n"),
-		  last_blklen);
-	return last_blklen;
+		  sz->last_blklen);
+	return sz->last_blklen;
+}
+
+/* Read a header like zm_get_header, from the monitor thread if it
+ * runs. */
+static int
+sz_get_header(sz_t *sz, uint32_t *rxpos)
+{
+	zm_t *zm = sz->zm;
+
+	if (!sz->monitor)
+		return zm_get_header(zm, rxpos);
+	zm_flush(zm);
+	return sz_monitor_get(sz->monitor, rxpos, zm->Rxhdr,
+			      zm->zr->no_timeout ? -1 : zm->rxtimeout * 100);
+}
+
+/* Go on from RXPOS if the receiver already has everything before it. */
+static int
+sz_skip_to(sz_t *sz, struct zm_fileinfo *zi, size_t rxpos)
+{
+	if (rxpos <= zi->bytes_sent)
+		return OK;
+	if (sz_seek(sz, rxpos) == ERROR)
+		return ERROR;
+	sz->bytcnt = zi->bytes_sent = rxpos;
+	return OK;
 }
 
 /*
@@ -1680,7 +2338,7 @@ sz_getinsync(sz_t *sz, struct zm_fileinfo *zi, int flag)
 	uint32_t rxpos;
 
 	for (;;) {
-		c = zm_get_header(sz->zm, &rxpos);
+		c = sz_get_header(sz, &rxpos);
 		switch (c) {
 		case ZCAN:
 		case ZABORT:
@@ -1688,29 +2346,81 @@ sz_getinsync(sz_t *sz, struct zm_fileinfo *zi, int flag)
 		case TIMEOUT:
 			return ERROR;
 		case ZRPOS:
+		restart:
 			/* ************************************* */
 			/*  If sending to a buffered modem, you  */
 			/*   might send a break at this point to */
 			/*   dump the modem's buffer.		 */
 			if (sz->input_f)
 				clearerr(sz->input_f);	/* In case file EOF seen */
-			if (!sz->mm_addr)
-			if (fseek(sz->input_f, (long) rxpos, 0))
+			if (sz_seek(sz, rxpos) == ERROR)
 				return ERROR;
+			/* Output still queued for the writer thread is
+			 * stale now; dropping it spares the receiver
+			 * hunting through it.  An empty subpacket takes
+			 * up a ZDLE the cut may have left dangling, which
+			 * would swallow the ZPAD of the next header. */
+			if (sz->writer && sz_writer_discard(sz->writer))
+				ZM_SEND_DATA(sz->txbuf, 0, ZCRCE);
+			/* The receiver repeats a ZRPOS for each error
+			 * it meets while stale data drains.  The ones
+			 * queued already went out before this restart,
+			 * which answers them all; restarting for each
+			 * would only send it more to drain. */
+			if (sz->monitor)
+				sz_monitor_drop(sz->monitor, ZRPOS, rxpos);
 			zi->eof_seen = 0;
 			sz->bytcnt = sz->lrxpos = zi->bytes_sent = rxpos;
-			if (sz->lastsync == rxpos) {
+			if (sz->lastsync == rxpos)
 				sz->error_count++;
-			}
+			sz_block_error(sz, rxpos, 1);
 			sz->lastsync = rxpos;
 			return c;
 		case ZACK:
 			sz->lrxpos = rxpos;
+			if (sz->sack_file) {
+				/* A receiver that answers ZSACK has no
+				 * gap before RXPOS and knows of none
+				 * after it, so anything sent past it
+				 * was lost and is sent again as for a
+				 * ZRPOS, and anything it kept past an
+				 * error can be skipped. */
+				if (!flag && rxpos < zi->bytes_sent) {
+					c = ZRPOS;
+					goto restart;
+				}
+				if (sz_skip_to(sz, zi, rxpos) == ERROR)
+					return ERROR;
+			}
 			if (flag || zi->bytes_sent == rxpos)
 				return ZACK;
 			continue;
+		case ZSACK:
+			if (!sz->sack_file) {
+				if (flag)
+					return ZACK;
+				continue;
+			}
+			/* A gap at or past what was sent is filled by
+			 * going on. */
+			if (rxpos >= zi->bytes_sent) {
+				if (sz_skip_to(sz, zi, rxpos) == ERROR)
+					return ERROR;
+				return ZACK;
+			}
+			sz->sackpos = rxpos;
+			sz_block_error(sz, rxpos, 0);
+			if (sz->fec_file) {
+				sz->fec_clean = 0;
+				if (sz->fec_k > FEC_KMIN) {
+					sz->fec_k /= 2;
+					log_debug ("%u subpackets per ZFEC", sz->fec_k);
+				}
+			}
+			return c;
 		case ZRINIT:
 		case ZSKIP:
+			sz_stop_pipe(sz);
 			if (sz->input_f)
 				fclose(sz->input_f);
 			else if (sz->mm_addr) {
@@ -1750,7 +2460,6 @@ sz_countem (sz_t *sz, int argc, char **argv)
 	}
 	log_trace (_("sz_countem: Total %d %ld"),
 				 sz->filesleft, sz->totalleft);
-	sz_calculate_block_length (sz, sz->totalleft);
 }
 
 /* End of lsz.c */
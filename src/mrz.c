@@ -7,10 +7,13 @@
 #include <sys/stat.h>
 #include "zmodem.h"
 
+static bool quiet = false;
+
 static bool
 approver_cb(const char *filename, size_t size, time_t date)
 {
-  fprintf(stderr, "Sender requests to send %s: %zu bytes\n", filename, size);
+  if (!quiet)
+    fprintf(stderr, "Sender requests to send %s: %zu bytes\n", filename, size);
   return true;
 }
 
@@ -18,7 +21,7 @@ static
 bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left)
 {
   static long last_sec_left = 0;
-  if (last_sec_left != sec_left && sec_left != 0) {
+  if (!quiet && last_sec_left != sec_left && sec_left != 0) {
     fprintf(stderr, "%s: Bytes Received:%7ld/%7ld   BPS:%-8ld ETA %02d:%02d\n",
 	    fname, bytes_sent, bytes_total,
 	    last_bps, min_left, sec_left);
@@ -31,6 +34,8 @@ bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps
 
 void complete_cb(const char *filename, int result, size_t size, time_t date)
 {
+  if (quiet)
+    return;
   if (result == RZSZ_NO_ERROR)
     fprintf(stderr, "'%s': received\n", filename);
   else
@@ -42,9 +47,10 @@ main(int argc, char *argv[])
 {
   int c;
   bool bps_flag = false;
+  uint32_t flags = RZSZ_FLAGS_NONE;
   uint64_t bps = 0u;
 
-  while ((c = getopt(argc, argv, "b:q")) != -1)
+  while ((c = getopt(argc, argv, "b:fpqsu")) != -1)
     switch(c)
       {
       case 'b':
@@ -52,6 +58,21 @@ main(int argc, char *argv[])
 	if (bps > 0)
 	  bps_flag = true;
 	break;
+      case 'f':
+	flags |= RZSZ_FLAGS_FEC;
+	break;
+      case 'p':
+	flags |= RZSZ_FLAGS_PIPELINE;
+	break;
+      case 'q':
+	quiet = true;
+	break;
+      case 's':
+	flags |= RZSZ_FLAGS_SACK;
+	break;
+      case 'u':
+	flags |= RZSZ_FLAGS_URING;
+	break;
       case '?':
 	if (optopt == 'b')
 	  fprintf(stderr, "Option -b requires an integer argument.\n");
@@ -68,7 +89,7 @@ main(int argc, char *argv[])
 				tick_cb,
 				complete_cb,
 				bps_flag ? bps : 0,
-				RZSZ_FLAGS_NONE);
+				flags);
   fprintf(stderr, "Received %zu bytes.\n", bytes);
   return 0;
 }
@@ -0,0 +1,682 @@
+/* mrzd - receive ZMODEM uploads from many connections at once.
+
+   Connections arrive on Unix sockets, TCP sockets and ptys.  Each one
+   runs its own zmodem receive session, but sessions do not get a
+   process or a thread of their own.  Whenever a connection has input,
+   room for output or a timeout, moving bytes between it and its
+   session (see zm_session_t in zmodem.h) becomes a task for a small
+   pool of worker threads.  Idle workers steal new connections from
+   busy ones, so that links are spread over all the cores, but each
+   connection then stays on the worker that started its session,
+   whose stack it is suspended on (see pool.h).
+
+   Options apply to the listeners named after them, so
+
+     mrzd -d /var/log/a -m 1000000 -u /run/a.sock -d /var/log/b -t 9000
+
+   takes uploads of up to a megabyte into /var/log/a from /run/a.sock,
+   and uploads of any size into /var/log/b from TCP port 9000.  */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "zglobal.h"
+#include "zmodem.h"
+#include "pool.h"
+
+/* How often, in milliseconds, sessions are checked for timeouts.
+   Session timeouts are in tenths of seconds, so this is plenty. */
+#define SWEEP_MS 100
+
+#define READ_SIZE 65536
+
+/* Where uploads go and which ones are accepted.  Every connection
+   refers to the policy of the listener it came from. */
+typedef struct
+{
+  const char *directory;
+  size_t max_size;		/* 0 for no limit */
+  uint64_t min_bps;
+} policy_t;
+
+/* Why a connection's task is queued.  CONN_SCHEDULED is set from
+   when the task is submitted until it finds nothing more to do, so a
+   session is only ever run by one worker at a time, and its work is
+   done in the order it arrived. */
+#define CONN_SCHEDULED	1
+#define CONN_START	2	/* start a session */
+#define CONN_IO		4	/* the fd is ready */
+#define CONN_TIMEOUT	8	/* the session's deadline passed */
+
+typedef struct conn_
+{
+  pool_task_t task;		/* must be first */
+  int fd;
+  bool listening;		/* fd is a listening socket */
+  bool is_pty;			/* start a new session when one ends */
+  bool want_out;		/* wait for the fd to be writable */
+  int pending;			/* CONN_* bits */
+  long long deadline;		/* the session's, as of its last run */
+  const policy_t *policy;
+  char name[64];		/* peer, for messages */
+  zm_session_t *session;
+  struct conn_ *prev, *next;	/* on conns, or on zombies */
+} conn_t;
+
+static pool_t *pool;
+static int epfd;
+static int n_workers = 1;
+static unsigned long n_accepted;	/* names Unix socket peers */
+
+/* All connections, so that timeouts can be found. */
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static conn_t *conns;
+
+/* Closed connections.  A worker polling may still hold an event for
+   one, so they are only freed by the next poll. */
+static conn_t *zombies;
+
+/* The connection whose session is running on this thread.  The
+   callbacks take no context argument, and a session only ever runs
+   inside the zm_session_* call made for its connection. */
+static __thread conn_t *current;
+
+static bool
+approver_cb (const char *filename, size_t size,
+	     time_t date LRZSZ_ATTRIB_UNUSED)
+{
+  const policy_t *p = current->policy;
+
+  if (filename[0] == '/' || strstr (filename, "..") != NULL)
+    {
+      fprintf (stderr, "%s: refused '%s': outside of %s\n",
+	       current->name, filename, p->directory ? p->directory : ".");
+      return false;
+    }
+  if (p->max_size && size > p->max_size)
+    {
+      fprintf (stderr, "%s: refused '%s': %zu bytes is too large\n",
+	       current->name, filename, size);
+      return false;
+    }
+  return true;
+}
+
+static void
+complete_cb (const char *filename, int result, size_t size LRZSZ_ATTRIB_UNUSED,
+	     time_t date LRZSZ_ATTRIB_UNUSED)
+{
+  if (result == RZSZ_NO_ERROR)
+    fprintf (stderr, "%s: '%s': received\n", current->name, filename);
+  else
+    fprintf (stderr, "%s: '%s': failed to receive\n",
+	     current->name, filename);
+}
+
+static void
+conn_schedule (conn_t *c, int why)
+{
+  int old = __atomic_fetch_or (&c->pending, why | CONN_SCHEDULED,
+			       __ATOMIC_ACQ_REL);
+
+  if (!(old & CONN_SCHEDULED))
+    pool_submit (pool, &c->task);
+}
+
+/* Wait for the fd again.  EPOLLONESHOT keeps it from being reported
+   while the connection's task runs. */
+static void
+conn_arm (conn_t *c)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLONESHOT | (c->want_out ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl (epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static bool
+conn_start (conn_t *c)
+{
+  c->session = zm_session_receive (c->policy->directory, approver_cb,
+				   NULL, complete_cb, c->policy->min_bps,
+				   RZSZ_FLAGS_NONE, NULL);
+  if (!c->session)
+    fprintf (stderr, "%s: cannot start session: out of memory\n", c->name);
+  return c->session != NULL;
+}
+
+static void
+conn_report (conn_t *c)
+{
+  size_t bytes;
+
+  if (zm_session_done (c->session, &bytes))
+    fprintf (stderr, "%s: session done, %zu bytes received\n",
+	     c->name, bytes);
+  else
+    fprintf (stderr, "%s: connection lost\n", c->name);
+}
+
+/* Register a new connection and queue the start of its session. */
+static void
+conn_add (conn_t *c)
+{
+  struct epoll_event ev;
+
+  /* The task runs first; the fd is armed when it is done. */
+  ev.events = EPOLLONESHOT;
+  ev.data.ptr = c;
+  c->pending = CONN_SCHEDULED | CONN_START;
+  pthread_mutex_lock (&conns_lock);
+  c->next = conns;
+  if (c->next)
+    c->next->prev = c;
+  conns = c;
+  pthread_mutex_unlock (&conns_lock);
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+    {
+      perror ("epoll_ctl");
+      exit (1);
+    }
+  pool_submit (pool, &c->task);
+}
+
+/* Called by the connection's own task.  CONN_SCHEDULED stays set, so
+   nothing schedules it again. */
+static void
+conn_close (conn_t *c)
+{
+  if (c->session)
+    conn_report (c);
+  zm_session_free (c->session);
+  c->session = NULL;
+  epoll_ctl (epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close (c->fd);
+  pthread_mutex_lock (&conns_lock);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    conns = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  c->prev = NULL;
+  c->next = zombies;
+  zombies = c;
+  pthread_mutex_unlock (&conns_lock);
+}
+
+/* Write what the session has queued.  Return false if the connection
+   is finished with. */
+static bool
+conn_flush (conn_t *c)
+{
+  const void *out;
+  size_t len;
+  ssize_t n;
+
+  for (;;)
+    {
+      out = zm_session_poll_output (c->session, &len);
+      if (len == 0)
+	break;
+      n = write (c->fd, out, len);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+	  c->want_out = true;
+	  return true;
+	}
+      if (n == -1)
+	{
+	  zm_session_feed (c->session, NULL, 0);
+	  return false;
+	}
+      zm_session_consume_output (c->session, (size_t) n);
+    }
+  c->want_out = false;
+  if (!zm_session_done (c->session, NULL))
+    return true;
+  if (!c->is_pty)
+    return false;
+  conn_report (c);
+  zm_session_free (c->session);
+  return conn_start (c) && conn_flush (c);
+}
+
+/* Read and feed what has arrived, a few buffers at most, so that one
+   fast line does not hold on to its worker. */
+static bool
+conn_input (conn_t *c)
+{
+  static __thread char buf[READ_SIZE];
+  ssize_t n;
+
+  for (int i = 0; i < 4; i++)
+    {
+      n = read (c->fd, buf, sizeof (buf));
+      if (n > 0)
+	{
+	  if (zm_session_feed (c->session, buf, (size_t) n) == -1)
+	    return false;
+	  if (!conn_flush (c))
+	    return false;
+	  if ((size_t) n < sizeof (buf))
+	    return true;
+	  continue;
+	}
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return true;
+      /* end of file, or the line is gone */
+      zm_session_feed (c->session, NULL, 0);
+      conn_flush (c);
+      return false;
+    }
+  return true;
+}
+
+static bool
+conn_work (conn_t *c, int why)
+{
+  if ((why & CONN_START) && !conn_start (c))
+    return false;
+  if (why & CONN_TIMEOUT)
+    zm_session_timeout (c->session);
+  if ((why & CONN_IO) && !conn_input (c))
+    return false;
+  if (!conn_flush (c))
+    return false;
+  __atomic_store_n (&c->deadline, zm_session_next_deadline (c->session),
+		    __ATOMIC_RELAXED);
+  conn_arm (c);
+  return true;
+}
+
+/* A connection's task: do what it was scheduled for, and whatever
+   else comes up meanwhile. */
+static void
+conn_run (pool_task_t *task)
+{
+  conn_t *c = (conn_t *) task;
+  int why, expected;
+
+  current = c;
+  do
+    {
+      why = __atomic_exchange_n (&c->pending, CONN_SCHEDULED,
+				 __ATOMIC_ACQ_REL);
+      if (!conn_work (c, why))
+	{
+	  conn_close (c);
+	  return;
+	}
+      expected = CONN_SCHEDULED;
+    }
+  while (!__atomic_compare_exchange_n (&c->pending, &expected, 0, false,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static conn_t *
+conn_new (int fd, const policy_t *policy)
+{
+  conn_t *c = calloc (1, sizeof (conn_t));
+
+  if (!c)
+    return NULL;
+  c->task.run = conn_run;
+  c->fd = fd;
+  c->policy = policy;
+  c->deadline = -1;
+  return c;
+}
+
+static void
+conn_accept (conn_t *l)
+{
+  for (;;)
+    {
+      struct sockaddr_storage sa;
+      socklen_t salen = sizeof (sa);
+      char host[NI_MAXHOST], serv[NI_MAXSERV];
+      int fd = accept4 (l->fd, (struct sockaddr *) &sa, &salen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+      conn_t *c;
+
+      if (fd == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno != EAGAIN && errno != EWOULDBLOCK)
+	    perror ("accept");
+	  return;
+	}
+      c = conn_new (fd, l->policy);
+      if (!c)
+	{
+	  close (fd);
+	  continue;
+	}
+      if (sa.ss_family != AF_UNIX
+	  && getnameinfo ((struct sockaddr *) &sa, salen, host,
+			  sizeof (host), serv, sizeof (serv),
+			  NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+	snprintf (c->name, sizeof (c->name), "%.40s:%.20s", host, serv);
+      else
+	snprintf (c->name, sizeof (c->name), "%.40s#%lu", l->name,
+		  ++n_accepted);
+      conn_add (c);
+    }
+}
+
+static long long
+now_ms (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Schedule every session whose deadline has passed. */
+static void
+sweep (long long now)
+{
+  pthread_mutex_lock (&conns_lock);
+  for (conn_t *c = conns; c; c = c->next)
+    {
+      long long d = __atomic_load_n (&c->deadline, __ATOMIC_RELAXED);
+
+      if (d >= 0 && d <= now)
+	conn_schedule (c, CONN_TIMEOUT);
+    }
+  pthread_mutex_unlock (&conns_lock);
+}
+
+/* The pool's poll function: one worker at a time waits here for
+   connections to become ready and queues their tasks, which the
+   other workers steal. */
+static void
+poll_events (void *ctx LRZSZ_ATTRIB_UNUSED)
+{
+  static long long last_sweep;
+  struct epoll_event events[256];
+  conn_t *dead;
+  long long now;
+  int n;
+
+  /* Events from earlier polls have all been handled. */
+  pthread_mutex_lock (&conns_lock);
+  dead = zombies;
+  zombies = NULL;
+  pthread_mutex_unlock (&conns_lock);
+  while (dead)
+    {
+      conn_t *next = dead->next;
+
+      free (dead);
+      dead = next;
+    }
+
+  n = epoll_wait (epfd, events, 256, SWEEP_MS);
+  if (n == -1 && errno != EINTR)
+    {
+      perror ("epoll_wait");
+      exit (1);
+    }
+  for (int i = 0; i < n; i++)
+    {
+      conn_t *c = events[i].data.ptr;
+
+      if (c->listening)
+	conn_accept (c);
+      else
+	conn_schedule (c, CONN_IO);
+    }
+  now = now_ms ();
+  if (now - last_sweep >= SWEEP_MS)
+    {
+      sweep (now);
+      last_sweep = now;
+    }
+}
+
+static void
+add_listener (int fd, const policy_t *policy, const char *name)
+{
+  conn_t *c = conn_new (fd, policy);
+  struct epoll_event ev;
+
+  if (!c)
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+  c->listening = true;
+  snprintf (c->name, sizeof (c->name), "%s", name);
+  ev.events = EPOLLIN;
+  ev.data.ptr = c;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+      perror ("epoll_ctl");
+      exit (1);
+    }
+}
+
+static void
+listen_unix (const char *path, const policy_t *policy)
+{
+  struct sockaddr_un sun;
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+  if (strlen (path) >= sizeof (sun.sun_path))
+    {
+      fprintf (stderr, "%s: socket path too long\n", path);
+      exit (1);
+    }
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  unlink (path);
+  if (fd == -1 || bind (fd, (struct sockaddr *) &sun, sizeof (sun)) == -1
+      || listen (fd, SOMAXCONN) == -1)
+    {
+      perror (path);
+      exit (1);
+    }
+  add_listener (fd, policy, path);
+}
+
+/* SPEC is PORT or HOST:PORT. */
+static void
+listen_tcp (const char *spec, const policy_t *policy)
+{
+  struct addrinfo hints, *res;
+  char *host = strdup (spec);
+  char *port = strrchr (host, ':');
+  int fd, one = 1, r;
+
+  if (port)
+    *port++ = '\0';
+  else
+    {
+      port = host;
+      host = NULL;
+    }
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  r = getaddrinfo (host, port, &hints, &res);
+  if (r != 0)
+    {
+      fprintf (stderr, "%s: %s\n", spec, gai_strerror (r));
+      exit (1);
+    }
+  fd = socket (res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+	       res->ai_protocol);
+  if (fd == -1
+      || setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one)) == -1
+      || bind (fd, res->ai_addr, res->ai_addrlen) == -1
+      || listen (fd, SOMAXCONN) == -1)
+    {
+      perror (spec);
+      exit (1);
+    }
+  freeaddrinfo (res);
+  add_listener (fd, policy, spec);
+}
+
+/* Open a pty and serve sessions on it, one after another, for as
+   long as mrzd runs.  The slave side is kept open, so the master
+   does not see a hangup between senders, and its name is printed
+   for them to use. */
+static void
+listen_pty (const policy_t *policy, int n)
+{
+  int fd = posix_openpt (O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  const char *slave;
+  struct termios tio;
+  conn_t *c;
+
+  if (fd == -1 || grantpt (fd) == -1 || unlockpt (fd) == -1
+      || (slave = ptsname (fd)) == NULL || open (slave, O_RDWR | O_NOCTTY) == -1)
+    {
+      perror ("pty");
+      exit (1);
+    }
+  if (tcgetattr (fd, &tio) == 0)
+    {
+      cfmakeraw (&tio);
+      tcsetattr (fd, TCSANOW, &tio);
+    }
+  printf ("%s\n", slave);
+  fflush (stdout);
+  c = conn_new (fd, policy);
+  if (!c)
+    {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+  c->is_pty = true;
+  snprintf (c->name, sizeof (c->name), "pty%d", n);
+  conn_add (c);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: mrzd [-j threads] [[-d dir] [-m max_bytes] [-b min_bps]\n"
+	   "            (-u socket_path | -t [host:]port | -p n_ptys)]...\n");
+  exit (1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int c, n_listeners = 0, n_ptys = 0;
+  bool listening = false;
+  policy_t *policy;
+
+  signal (SIGPIPE, SIG_IGN);
+
+  /* The pool must exist before ptys queue their first tasks. */
+  if (argc > 2 && strcmp (argv[1], "-j") == 0)
+    {
+      n_workers = atoi (argv[2]);
+      if (n_workers < 1)
+	usage ();
+    }
+  pool = pool_new (n_workers, poll_events, NULL);
+  policy = calloc (1, sizeof (policy_t));
+  if (!pool || !policy)
+    {
+      fprintf (stderr, "out of memory\n");
+      return 1;
+    }
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1)
+    {
+      perror ("epoll_create1");
+      return 1;
+    }
+
+  while ((c = getopt (argc, argv, "j:d:m:b:u:t:p:")) != -1)
+    switch (c)
+      {
+      case 'j':
+	if (optind != 3)
+	  usage ();
+	break;
+      case 'd':
+      case 'm':
+      case 'b':
+	/* Listeners already made keep the policy they were given. */
+	if (n_listeners > 0)
+	  {
+	    policy_t *p = malloc (sizeof (policy_t));
+
+	    if (!p)
+	      {
+		fprintf (stderr, "out of memory\n");
+		return 1;
+	      }
+	    *p = *policy;
+	    policy = p;
+	    n_listeners = 0;
+	  }
+	if (c == 'd')
+	  policy->directory = optarg;
+	else if (c == 'm')
+	  policy->max_size = strtoul (optarg, NULL, 10);
+	else
+	  policy->min_bps = strtoul (optarg, NULL, 10);
+	break;
+      case 'u':
+	listen_unix (optarg, policy);
+	n_listeners++;
+	listening = true;
+	break;
+      case 't':
+	listen_tcp (optarg, policy);
+	n_listeners++;
+	listening = true;
+	break;
+      case 'p':
+	for (int i = atoi (optarg); i > 0; i--)
+	  listen_pty (policy, n_ptys++);
+	n_listeners++;
+	listening = true;
+	break;
+      case '?':
+	if (isprint (optopt))
+	  fprintf (stderr, "Unknown option '-%c'.\n", optopt);
+	usage ();
+	break;
+      default:
+	abort ();
+      }
+  if (optind != argc || !listening)
+    usage ();
+
+  pool_run (pool);
+  return 0;
+}
@@ -7,11 +7,13 @@
 #include <sys/stat.h>
 #include "zmodem.h"
 
+static bool quiet = false;
+
 static
 bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left)
 {
   static long last_sec_left = 0;
-  if (last_sec_left != sec_left && sec_left != 0) {
+  if (!quiet && last_sec_left != sec_left && sec_left != 0) {
     fprintf(stderr, "%s: Bytes Sent:%7ld/%7ld   BPS:%-8ld ETA %02d:%02d\n",
 	    fname, bytes_sent, bytes_total,
 	    last_bps, min_left, sec_left);
@@ -23,6 +25,8 @@ bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps
 
 void complete_cb(const char *filename, int result, size_t size, time_t date)
 {
+  if (quiet)
+    return;
   if (result == RZSZ_NO_ERROR)
     fprintf(stderr, "'%s (%zu bytes)': successful send\n", filename, size);
   else
@@ -35,11 +39,12 @@ main(int argc, char *argv[])
   int c;
   bool bps_flag = false;
   bool hold_flag = false;
+  uint32_t flags = RZSZ_FLAGS_NONE;
   uint64_t bps = 0u;
   int n_filenames = 0;
   const char **filenames = NULL;
 
-  while ((c = getopt(argc, argv, "b:hq:")) != -1)
+  while ((c = getopt(argc, argv, "b:fhmpqsu")) != -1)
     switch(c)
       {
       case 'b':
@@ -47,9 +52,27 @@ main(int argc, char *argv[])
 	if (bps > 0)
 	  bps_flag = true;
 	break;
+      case 'f':
+	flags |= RZSZ_FLAGS_FEC;
+	break;
       case 'h':
 	hold_flag = true;
 	break;
+      case 'm':
+	flags |= RZSZ_FLAGS_MONITOR;
+	break;
+      case 'p':
+	flags |= RZSZ_FLAGS_PIPELINE;
+	break;
+      case 'q':
+	quiet = true;
+	break;
+      case 's':
+	flags |= RZSZ_FLAGS_SACK;
+	break;
+      case 'u':
+	flags |= RZSZ_FLAGS_URING;
+	break;
       case '?':
 	if (optopt == 'b')
 	  fprintf(stderr, "Option -b requires an integer argument.\n");
@@ -68,7 +91,8 @@ main(int argc, char *argv[])
   memset(filenames, 0, argc * sizeof(char *));
   for (int i = optind; i < argc; i++)
     {
-      // These should be filenames of regular files
+      // These should be filenames of regular files, or of pipes
+      // as from msz <(tar c dir)
       ret = stat(argv[i], &st);
       if (ret == -1)
 	fprintf(stderr, "'%s' does not exist.\n", argv[i]);
@@ -76,8 +100,9 @@ main(int argc, char *argv[])
 	{
 	  if (S_ISDIR(st.st_mode))
 	    fprintf(stderr, "'%s' is a directory.\n", argv[i]);
-	  else if (!S_ISREG(st.st_mode))
-	    fprintf(stderr, "'%s' is not a regular file.\n", argv[i]);
+	  else if (!S_ISREG(st.st_mode) && !S_ISFIFO(st.st_mode))
+	    fprintf(stderr, "'%s' is neither a regular file nor a pipe.\n",
+		    argv[i]);
 	  else
 	    {
 	      filenames[n_filenames] = strdup(argv[i]);
@@ -103,7 +128,7 @@ main(int argc, char *argv[])
 			     tick_cb,
 			     complete_cb,
 			     bps_flag ? bps : 0,
-			     RZSZ_FLAGS_NONE);
+			     flags);
   fprintf(stderr, "Sent %zu bytes.\n", bytes);
   for (int i = 0; i < argc; i ++)
     free (filenames[i]);
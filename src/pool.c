@@ -0,0 +1,248 @@
+/* pool.c - a work-stealing pool of worker threads for mrzd.  See
+   pool.h.  */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "pool.h"
+
+/* A worker's queue: a ring of task pointers.  The owner pushes and
+   pops at the tail; thieves take from the head. */
+typedef struct
+{
+  struct pool_ *pool;
+  pthread_mutex_t lock;
+  pool_task_t **ring;
+  size_t head;
+  size_t count;			/* also read without LOCK by the owner */
+  size_t size;
+} worker_t;
+
+struct pool_
+{
+  int n_workers;
+  worker_t *workers;
+  void (*poll) (void *ctx);
+  void *ctx;
+  pthread_mutex_t poll_lock;	/* held by the worker that polls */
+
+  /* Idle workers sleep on WAKE.  QUEUED and SLEEPING are also read
+     without LOCK, so that submitting does not take it when nobody
+     is asleep. */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  long queued;			/* tasks any worker may take */
+  int sleeping;
+  unsigned int next;		/* where outside submissions go */
+};
+
+/* The worker this thread is, or NULL. */
+static __thread worker_t *self;
+
+pool_t *
+pool_new (int n_workers, void (*poll) (void *ctx), void *ctx)
+{
+  pool_t *pool = calloc (1, sizeof (pool_t));
+
+  if (!pool)
+    return NULL;
+  pool->workers = calloc ((size_t) n_workers, sizeof (worker_t));
+  if (!pool->workers)
+    {
+      free (pool);
+      return NULL;
+    }
+  pool->n_workers = n_workers;
+  pool->poll = poll;
+  pool->ctx = ctx;
+  pthread_mutex_init (&pool->poll_lock, NULL);
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->wake, NULL);
+  for (int i = 0; i < n_workers; i++)
+    {
+      pool->workers[i].pool = pool;
+      pthread_mutex_init (&pool->workers[i].lock, NULL);
+    }
+  return pool;
+}
+
+static void
+worker_push (worker_t *w, pool_task_t *task)
+{
+  pthread_mutex_lock (&w->lock);
+  if (w->count == w->size)
+    {
+      size_t size = w->size ? w->size * 2 : 64;
+      pool_task_t **ring = malloc (size * sizeof (pool_task_t *));
+
+      if (!ring)
+	{
+	  fprintf (stderr, "out of memory\n");
+	  abort ();
+	}
+      for (size_t i = 0; i < w->count; i++)
+	ring[i] = w->ring[(w->head + i) % w->size];
+      free (w->ring);
+      w->ring = ring;
+      w->head = 0;
+      w->size = size;
+    }
+  w->ring[(w->head + w->count) % w->size] = task;
+  __atomic_store_n (&w->count, w->count + 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&w->lock);
+}
+
+/* Take the newest task, which is likeliest to still be in cache. */
+static pool_task_t *
+worker_pop (worker_t *w)
+{
+  pool_task_t *task = NULL;
+
+  pthread_mutex_lock (&w->lock);
+  if (w->count > 0)
+    {
+      __atomic_store_n (&w->count, w->count - 1, __ATOMIC_RELAXED);
+      task = w->ring[(w->head + w->count) % w->size];
+    }
+  pthread_mutex_unlock (&w->lock);
+  return task;
+}
+
+/* Take the oldest task not yet bound to a worker, which has waited
+   longest.  The bound ones before it move up a place. */
+static pool_task_t *
+worker_steal (worker_t *w)
+{
+  pool_task_t *task = NULL;
+
+  pthread_mutex_lock (&w->lock);
+  for (size_t i = 0; i < w->count; i++)
+    {
+      task = w->ring[(w->head + i) % w->size];
+      if (__atomic_load_n (&task->worker, __ATOMIC_RELAXED) == 0)
+	{
+	  for (; i > 0; i--)
+	    w->ring[(w->head + i) % w->size]
+	      = w->ring[(w->head + i - 1) % w->size];
+	  w->head = (w->head + 1) % w->size;
+	  __atomic_store_n (&w->count, w->count - 1, __ATOMIC_RELAXED);
+	  break;
+	}
+      task = NULL;
+    }
+  pthread_mutex_unlock (&w->lock);
+  return task;
+}
+
+void
+pool_submit (pool_t *pool, pool_task_t *task)
+{
+  int bound = __atomic_load_n (&task->worker, __ATOMIC_RELAXED);
+  worker_t *w = self;
+
+  if (bound)
+    w = &pool->workers[bound - 1];
+  else if (!w)
+    w = &pool->workers[__atomic_fetch_add (&pool->next, 1, __ATOMIC_RELAXED)
+		       % (unsigned int) pool->n_workers];
+  worker_push (w, task);
+  if (!bound)
+    __atomic_add_fetch (&pool->queued, 1, __ATOMIC_SEQ_CST);
+  if ((!bound || w != self)
+      && __atomic_load_n (&pool->sleeping, __ATOMIC_SEQ_CST) > 0)
+    {
+      /* Any worker can take an unbound task, but a bound one needs
+	 its own, which may not be the one a signal wakes. */
+      pthread_mutex_lock (&pool->lock);
+      if (bound)
+	pthread_cond_broadcast (&pool->wake);
+      else
+	pthread_cond_signal (&pool->wake);
+      pthread_mutex_unlock (&pool->lock);
+    }
+}
+
+static pool_task_t *
+pool_take (pool_t *pool, worker_t *w)
+{
+  pool_task_t *task = worker_pop (w);
+  int me = (int) (w - pool->workers);
+
+  for (int i = 1; !task && i < pool->n_workers; i++)
+    task = worker_steal (&pool->workers[(me + i) % pool->n_workers]);
+  if (task && __atomic_load_n (&task->worker, __ATOMIC_RELAXED) == 0)
+    {
+      __atomic_sub_fetch (&pool->queued, 1, __ATOMIC_SEQ_CST);
+      __atomic_store_n (&task->worker, me + 1, __ATOMIC_RELAXED);
+    }
+  return task;
+}
+
+/* Sleep until a task is queued that W may take, or for a while if
+   none comes, so that some worker gets round to polling again. */
+static void
+pool_sleep (pool_t *pool, worker_t *w)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  ts.tv_nsec += 100 * 1000000;
+  if (ts.tv_nsec >= 1000000000)
+    {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  pthread_mutex_lock (&pool->lock);
+  __atomic_add_fetch (&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n (&pool->queued, __ATOMIC_SEQ_CST) == 0
+	 && __atomic_load_n (&w->count, __ATOMIC_SEQ_CST) == 0)
+    if (pthread_cond_timedwait (&pool->wake, &pool->lock, &ts) == ETIMEDOUT)
+      break;
+  __atomic_sub_fetch (&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+static void *
+worker_run (void *arg)
+{
+  worker_t *w = arg;
+  pool_t *pool = w->pool;
+  pool_task_t *task;
+
+  self = w;
+  for (;;)
+    {
+      task = pool_take (pool, w);
+      if (task)
+	{
+	  task->run (task);
+	  continue;
+	}
+      if (pthread_mutex_trylock (&pool->poll_lock) == 0)
+	{
+	  pool->poll (pool->ctx);
+	  pthread_mutex_unlock (&pool->poll_lock);
+	}
+      else
+	pool_sleep (pool, w);
+    }
+  return NULL;
+}
+
+/* Start the other workers and become worker 0.  Does not return. */
+void
+pool_run (pool_t *pool)
+{
+  pthread_t thread;
+
+  for (int i = 1; i < pool->n_workers; i++)
+    if (pthread_create (&thread, NULL, worker_run, &pool->workers[i]) != 0)
+      {
+	perror ("pthread_create");
+	exit (1);
+      }
+  worker_run (&pool->workers[0]);
+}
@@ -0,0 +1,34 @@
+#ifndef MRZD_POOL_H
+#define MRZD_POOL_H
+
+/* A work-stealing pool of worker threads.
+
+   Each worker keeps its own queue of tasks.  A worker takes the task
+   it queued last; a worker with nothing to do steals the oldest task
+   from another.  When no task is queued anywhere, one idle worker at
+   a time calls the POLL function given to pool_new, which is expected
+   to wait briefly for something to happen and submit tasks for it.
+
+   A task is run by one worker, once per submission.  Whoever submits
+   a task must not submit it again until it has started running.
+
+   Only a task that has never run is stolen.  From its first run on,
+   it goes to the queue of the worker that ran it, and only that
+   worker runs it, so a task may leave state on that thread, such as
+   a suspended ucontext, which must not resume on another. */
+
+typedef struct pool_task_ pool_task_t;
+typedef struct pool_ pool_t;
+
+struct pool_task_
+{
+  void (*run) (pool_task_t *task);
+  int worker;			/* 1 + the worker it is bound to, or 0;
+				   set by the pool */
+};
+
+pool_t *pool_new (int n_workers, void (*poll) (void *ctx), void *ctx);
+void pool_submit (pool_t *pool, pool_task_t *task);
+void pool_run (pool_t *pool);
+
+#endif
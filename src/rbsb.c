@@ -126,37 +126,40 @@ from_cu(void)
 int
 rdchk(int fd)
 {
-	static long lf;
+	long lf = 0;
 
 	ioctl(fd, FIONREAD, &lf);
 	return ((int) lf);
 }
 
 
-struct termios oldtty, tty;
-
 /*
  * mode(n)
  *  3: save old tty stat, set raw mode with flow control
  *  2: set XON/XOFF for sb/sz with ZMODEM
  *  1: save old tty stat, set raw mode
  *  0: restore original tty mode
+ * The original mode is saved in *st the first time it is changed.
+ * With a NULL st nothing is saved or restored.
  * Returns the output baudrate, or zero on failure
  */
 int
-io_mode(int fd, int n)
+io_mode(io_mode_t *st, int fd, int n)
 {
-	static int did0 = FALSE;
+	struct termios tty;
 	log_debug("mode:%d", n);
 
+	if (!st)
+		return 0;
+
 	switch(n) {
 
 	case 2:		/* Un-raw mode used by sz, sb when -g detected */
-		if(!did0) {
-			did0 = TRUE;
-			tcgetattr(fd,&oldtty);
+		if(!st->saved) {
+			st->saved = TRUE;
+			tcgetattr(fd,&st->oldtty);
 		}
-		tty = oldtty;
+		tty = st->oldtty;
 
 		tty.c_iflag = BRKINT|IXON;
 
@@ -183,11 +186,11 @@ io_mode(int fd, int n)
 		return getspeed(cfgetospeed(&tty));
 	case 1:
 	case 3:
-		if(!did0) {
-			did0 = TRUE;
-			tcgetattr(fd,&oldtty);
+		if(!st->saved) {
+			st->saved = TRUE;
+			tcgetattr(fd,&st->oldtty);
 		}
-		tty = oldtty;
+		tty = st->oldtty;
 
 		tty.c_iflag = IGNBRK;
 		if (n==3) /* with flow control */
@@ -206,14 +209,15 @@ io_mode(int fd, int n)
 		tcsetattr(fd,TCSADRAIN,&tty);
 		return getspeed(cfgetospeed(&tty));
 	case 0:
-		if(!did0)
+		if(!st->saved)
 			return 0;
 		tcdrain (fd); /* wait until everything is sent */
 		tcflush (fd,TCIOFLUSH); /* flush input queue */
-		tcsetattr (fd,TCSADRAIN,&oldtty);
+		tcsetattr (fd,TCSADRAIN,&st->oldtty);
 		tcflow (fd,TCOON); /* restart output */
+		st->saved = FALSE;
 
-		return getspeed(cfgetospeed(&tty));
+		return getspeed(cfgetospeed(&st->oldtty));
 	default:
 		return 0;
 	}
@@ -0,0 +1,426 @@
+/*
+  rzpipe.c - a pipeline of threads for the ZMODEM receiver
+  Copyright (C) 2018 Michael L. Gran
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+  02111-1307, USA.
+*/
+
+/*
+ * Unlike the sender's, these hand-offs move a block at a time or
+ * less every few kilobytes of line, so a plain mutex and condition
+ * variable per stage does.
+ */
+
+#include "zglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rzpipe.h"
+
+#define RZ_READER_RING (256 * 1024)	/* input read ahead */
+#define RZ_READER_POLL_MS 100		/* how often the reader looks at STOP */
+#define RZ_DISK_SLOTS 32		/* blocks queued for the disk */
+#define RZ_DISK_BLOCK 8192
+
+static long long
+rzpipe_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Initialize COND to time out against CLOCK_MONOTONIC. */
+static void
+rzpipe_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+struct rz_reader_ {
+	zmodem_transport_t tp;	/* what the protocol thread uses */
+	zmodem_transport_t *line;
+	char *ring;
+	size_t head;		/* bytes handed to the protocol thread */
+	size_t tail;		/* bytes read from the line */
+	int eof;		/* the line reached end of file */
+	int error;		/* errno of a failed read */
+	int stop;
+
+	/* LOCK guards all of the above but RING.  The thread reads into
+	 * the room between TAIL and HEAD without it; that room only
+	 * grows behind its back. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+static void *
+rz_reader_run(void *arg)
+{
+	rz_reader_t *r = arg;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		size_t at, room;
+		long long start;
+		ssize_t n;
+		int saved;
+
+		while (!r->stop && (r->eof || r->error
+				    || r->tail - r->head == RZ_READER_RING))
+			pthread_cond_wait(&r->cond, &r->lock);
+		if (r->stop)
+			break;
+		at = r->tail % RZ_READER_RING;
+		room = RZ_READER_RING - (r->tail - r->head);
+		if (room > RZ_READER_RING - at)
+			room = RZ_READER_RING - at;
+		pthread_mutex_unlock(&r->lock);
+
+		start = rzpipe_now_ms();
+		n = r->line->read(r->line->ctx, r->ring + at, room,
+				  RZ_READER_POLL_MS);
+		saved = errno;
+
+		pthread_mutex_lock(&r->lock);
+		if (n > 0)
+			r->tail += (size_t) n;
+		else if (n < 0 && saved != EINTR)
+			r->error = saved;
+		else if (n == 0
+			 && rzpipe_now_ms() - start < RZ_READER_POLL_MS / 2)
+			/* READ returns 0 on timeout and on end of file; only
+			 * the latter comes back early. */
+			r->eof = 1;
+		else
+			continue;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static ssize_t
+reader_read(void *ctx, void *buf, size_t len, int timeout_ms)
+{
+	rz_reader_t *r = ctx;
+	struct timespec deadline;
+	size_t n, at;
+
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+	pthread_mutex_lock(&r->lock);
+	while (r->head == r->tail && !r->eof && !r->error) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&r->cond, &r->lock);
+		else if (pthread_cond_timedwait(&r->cond, &r->lock,
+						&deadline) == ETIMEDOUT)
+			break;
+	}
+	if (r->head == r->tail) {
+		int error = r->error;
+
+		pthread_mutex_unlock(&r->lock);
+		if (error) {
+			errno = error;
+			return -1;
+		}
+		return 0;
+	}
+	n = r->tail - r->head;
+	if (n > len)
+		n = len;
+	at = r->head % RZ_READER_RING;
+	if (at + n > RZ_READER_RING) {
+		memcpy(buf, r->ring + at, RZ_READER_RING - at);
+		memcpy((char *) buf + (RZ_READER_RING - at), r->ring,
+		       n - (RZ_READER_RING - at));
+	} else
+		memcpy(buf, r->ring + at, n);
+	r->head += n;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return (ssize_t) n;
+}
+
+static ssize_t
+reader_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	rz_reader_t *r = ctx;
+
+	return r->line->writev(r->line->ctx, iov, iovcnt);
+}
+
+static int
+reader_flush(void *ctx)
+{
+	rz_reader_t *r = ctx;
+
+	if (r->line->flush)
+		return r->line->flush(r->line->ctx);
+	return 0;
+}
+
+static int
+reader_drain(void *ctx)
+{
+	rz_reader_t *r = ctx;
+
+	if (r->line->drain)
+		return r->line->drain(r->line->ctx);
+	return 0;
+}
+
+/* Input the thread is reading as this runs is kept, as if it had
+   arrived just after. */
+static void
+reader_purge(void *ctx)
+{
+	rz_reader_t *r = ctx;
+
+	rz_reader_discard(r);
+	if (r->line->purge)
+		r->line->purge(r->line->ctx);
+}
+
+void
+rz_reader_discard(rz_reader_t *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->head = r->tail;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void
+reader_send_break(void *ctx)
+{
+	rz_reader_t *r = ctx;
+
+	if (r->line->send_break)
+		r->line->send_break(r->line->ctx);
+}
+
+rz_reader_t *
+rz_reader_new(zmodem_transport_t *line)
+{
+	rz_reader_t *r = calloc(1, sizeof(rz_reader_t));
+
+	if (!r)
+		return NULL;
+	r->ring = malloc(RZ_READER_RING);
+	if (!r->ring) {
+		free(r);
+		return NULL;
+	}
+	r->line = line;
+	r->tp.read = reader_read;
+	r->tp.writev = reader_writev;
+	r->tp.flush = reader_flush;
+	r->tp.drain = reader_drain;
+	r->tp.purge = reader_purge;
+	r->tp.send_break = reader_send_break;
+	r->tp.ctx = r;
+	pthread_mutex_init(&r->lock, NULL);
+	rzpipe_cond_init(&r->cond);
+	if (pthread_create(&r->thread, NULL, rz_reader_run, r) != 0) {
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->lock);
+		free(r->ring);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+zmodem_transport_t *
+rz_reader_transport(rz_reader_t *r)
+{
+	return &r->tp;
+}
+
+void
+rz_reader_free(rz_reader_t *r)
+{
+	if (!r)
+		return;
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->ring);
+	free(r);
+}
+
+typedef struct {
+	FILE *fp;
+	size_t len;
+	char data[RZ_DISK_BLOCK];
+} rz_disk_slot_t;
+
+struct rz_disk_ {
+	rz_disk_slot_t slots[RZ_DISK_SLOTS];
+	size_t queued;		/* blocks queued: the protocol thread's */
+	size_t written;		/* blocks done: the disk thread's */
+	int error;		/* errno of the first failed write */
+	int stop;
+
+	/* LOCK guards all of the above but the slots between WRITTEN
+	 * and QUEUED, which belong to the disk thread, and the others,
+	 * which belong to the protocol thread. */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+static void *
+rz_disk_run(void *arg)
+{
+	rz_disk_t *d = arg;
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		rz_disk_slot_t *slot;
+		int error;
+
+		while (d->written == d->queued && !d->stop)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if (d->written == d->queued)
+			break;
+		slot = &d->slots[d->written % RZ_DISK_SLOTS];
+		error = d->error;
+		pthread_mutex_unlock(&d->lock);
+
+		/* after a failure, only count the rest off */
+		errno = 0;
+		if (!error && fwrite(slot->data, slot->len, 1, slot->fp) != 1)
+			error = errno ? errno : EIO;
+
+		pthread_mutex_lock(&d->lock);
+		if (!d->error)
+			d->error = error;
+		d->written++;
+		pthread_cond_broadcast(&d->cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+rz_disk_t *
+rz_disk_new(void)
+{
+	rz_disk_t *d = calloc(1, sizeof(rz_disk_t));
+
+	if (!d)
+		return NULL;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	if (pthread_create(&d->thread, NULL, rz_disk_run, d) != 0) {
+		pthread_cond_destroy(&d->cond);
+		pthread_mutex_destroy(&d->lock);
+		free(d);
+		return NULL;
+	}
+	return d;
+}
+
+int
+rz_disk_write(rz_disk_t *d, FILE *fp, const char *buf, size_t n)
+{
+	while (n > 0) {
+		rz_disk_slot_t *slot;
+		size_t len = n < RZ_DISK_BLOCK ? n : RZ_DISK_BLOCK;
+		int error;
+
+		pthread_mutex_lock(&d->lock);
+		while (d->queued - d->written == RZ_DISK_SLOTS)
+			pthread_cond_wait(&d->cond, &d->lock);
+		error = d->error;
+		pthread_mutex_unlock(&d->lock);
+		if (error) {
+			errno = error;
+			return -1;
+		}
+
+		slot = &d->slots[d->queued % RZ_DISK_SLOTS];
+		slot->fp = fp;
+		slot->len = len;
+		memcpy(slot->data, buf, len);
+
+		pthread_mutex_lock(&d->lock);
+		d->queued++;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		buf += len;
+		n -= len;
+	}
+	return 0;
+}
+
+int
+rz_disk_sync(rz_disk_t *d)
+{
+	int error;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->written != d->queued)
+		pthread_cond_wait(&d->cond, &d->lock);
+	error = d->error;
+	d->error = 0;
+	pthread_mutex_unlock(&d->lock);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+void
+rz_disk_free(rz_disk_t *d)
+{
+	if (!d)
+		return;
+	pthread_mutex_lock(&d->lock);
+	d->stop = 1;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+	pthread_join(d->thread, NULL);
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
@@ -0,0 +1,50 @@
+#ifndef LIBZMODEM_RZPIPE_H
+#define LIBZMODEM_RZPIPE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "zmodem.h"
+
+/* The receiver's pipeline, used with RZSZ_FLAGS_PIPELINE.
+
+   A reader thread behind a transport of its own keeps reading the
+   line into a ring while the protocol thread decodes, checks CRCs
+   and answers.  The protocol thread hands the payload of good
+   subpackets to a disk thread, which writes them behind it.  So a
+   slow disk holds up the line only once the disk's queue is full,
+   and a slow reply only once the ring is. */
+
+typedef struct rz_reader_ rz_reader_t;
+
+/* Start a reader thread for LINE.  Reads from the transport returned
+   by rz_reader_transport are served from what the thread has read;
+   output goes straight to LINE.  Returns NULL if out of memory or
+   threads. */
+rz_reader_t *rz_reader_new(zmodem_transport_t *line);
+zmodem_transport_t *rz_reader_transport(rz_reader_t *r);
+
+/* Drop the input read ahead so far. */
+void rz_reader_discard(rz_reader_t *r);
+
+/* Stop the thread and free R.  Input it read ahead is lost. */
+void rz_reader_free(rz_reader_t *r);
+
+typedef struct rz_disk_ rz_disk_t;
+
+/* Start a disk thread.  Returns NULL if out of memory or threads. */
+rz_disk_t *rz_disk_new(void);
+
+/* Queue the N bytes at BUF to be written to FP.  The caller must not
+   touch FP otherwise until rz_disk_sync.  Returns -1 with errno set
+   if an earlier write failed, else 0. */
+int rz_disk_write(rz_disk_t *d, FILE *fp, const char *buf, size_t n);
+
+/* Wait for the queued writes.  Returns -1 with errno set if any
+   failed since the last sync, else 0. */
+int rz_disk_sync(rz_disk_t *d);
+
+/* Wait for the queued writes, then stop the thread and free D. */
+void rz_disk_free(rz_disk_t *d);
+
+#endif
@@ -0,0 +1,478 @@
+/*
+  session.c - push-driven ZMODEM sessions for event loops
+  Copyright (C) 2018 Michael L. Gran
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+  02111-1307, USA.
+*/
+
+/*
+ * The protocol engine in lsz.c, lrz.c and zm.c is written as
+ * straight-line code that asks its transport for input whenever it
+ * needs some.  A zm_session_t runs that engine on a stack of its own
+ * and gives it a transport that, instead of blocking, switches back
+ * to whoever fed the session.  The caller sees a resumable state
+ * machine: input is pushed in with zm_session_feed, output is taken
+ * from zm_session_poll_output, and the engine only runs inside those
+ * calls.
+ */
+
+#include "zglobal.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "zmodem.h"
+
+#ifdef HAVE_UCONTEXT
+
+#include <ucontext.h>
+
+/* The engine keeps its large buffers in the session objects, so a
+   modest stack is enough: it has been seen to use about 20 KiB. */
+#define ZM_SESSION_STACK (64 * 1024)
+
+/* Once this much output is queued, the engine waits for the caller
+   to take it before producing more. */
+#define ZM_SESSION_OUTPUT_HIGH (64 * 1024)
+
+enum {
+	ZM_SESSION_IDLE,	/* not started, or between switches */
+	ZM_SESSION_WAIT_INPUT,	/* blocked in read */
+	ZM_SESSION_WAIT_OUTPUT,	/* blocked in writev: output queue full */
+	ZM_SESSION_DONE
+};
+
+struct zm_session_ {
+	ucontext_t caller;	/* where to go when the engine waits */
+	ucontext_t engine;
+	char *stack;
+	size_t stack_size;
+	int state;
+	int timed_out;		/* the read deadline passed */
+	long long deadline;	/* CLOCK_MONOTONIC ms, or -1 */
+	zmodem_transport_t tp;
+
+	/* input pushed by zm_session_feed, not yet read */
+	char *in;
+	size_t in_start;
+	size_t in_len;
+	size_t in_size;
+	int in_eof;
+
+	/* output queued by the engine, not yet taken */
+	char *out;
+	size_t out_start;
+	size_t out_len;
+	size_t out_size;
+
+	/* what to run */
+	int sending;
+	int file_count;
+	const char **file_list;
+	const char *directory;
+	bool (*send_tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left);
+	bool (*receive_tick)(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left);
+	bool (*approver)(const char *filename, size_t size, time_t date);
+	void (*complete)(const char *filename, int result, size_t size, time_t date);
+	uint64_t min_bps;
+	uint32_t flags;
+	zmodem_options_t options;
+	size_t bytes;
+};
+
+static long long
+session_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Leave the engine until the caller resumes it. */
+static void
+session_yield(zm_session_t *s, int state)
+{
+	s->state = state;
+	swapcontext(&s->engine, &s->caller);
+	s->state = ZM_SESSION_IDLE;
+}
+
+/* Run the engine until it waits again or finishes. */
+static void
+session_resume(zm_session_t *s)
+{
+	if (s->state == ZM_SESSION_DONE)
+		return;
+	swapcontext(&s->caller, &s->engine);
+}
+
+static ssize_t
+session_read(void *ctx, void *buf, size_t len, int timeout_ms)
+{
+	zm_session_t *s = ctx;
+	size_t n;
+
+	if (s->in_len == 0 && !s->in_eof && timeout_ms != 0) {
+		s->deadline = timeout_ms < 0 ? -1 : session_now_ms() + timeout_ms;
+		s->timed_out = 0;
+		while (s->in_len == 0 && !s->in_eof && !s->timed_out)
+			session_yield(s, ZM_SESSION_WAIT_INPUT);
+		s->deadline = -1;
+	}
+	n = s->in_len < len ? s->in_len : len;
+	memcpy(buf, s->in + s->in_start, n);
+	s->in_start += n;
+	s->in_len -= n;
+	return (ssize_t) n;
+}
+
+/* Make room for more bytes at the end of the queue *buf, which
+   holds *len bytes from *start.  Return the place to put them, or
+   NULL if out of memory. */
+static char *
+session_room(char **buf, size_t *start, size_t *len, size_t *size, size_t more)
+{
+	if (*start > 0) {
+		memmove(*buf, *buf + *start, *len);
+		*start = 0;
+	}
+	if (*len + more > *size) {
+		size_t n = *size ? *size : 4096;
+		char *p;
+
+		while (n < *len + more)
+			n *= 2;
+		p = realloc(*buf, n);
+		if (!p)
+			return NULL;
+		*buf = p;
+		*size = n;
+	}
+	return *buf + *len;
+}
+
+static ssize_t
+session_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	zm_session_t *s = ctx;
+	size_t total = 0;
+	char *p;
+
+	while (s->out_len >= ZM_SESSION_OUTPUT_HIGH)
+		session_yield(s, ZM_SESSION_WAIT_OUTPUT);
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	p = session_room(&s->out, &s->out_start, &s->out_len, &s->out_size,
+			 total);
+	if (!p) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	s->out_len += total;
+	return (ssize_t) total;
+}
+
+static void
+session_purge(void *ctx)
+{
+	zm_session_t *s = ctx;
+
+	s->in_len = 0;
+}
+
+/* The engine's stack starts here.  makecontext only passes ints, so
+   the session pointer comes in two halves. */
+static void
+session_main(unsigned int hi, unsigned int lo)
+{
+	zm_session_t *s = (zm_session_t *)
+		(((uintptr_t) hi << 16 << 16) | (uintptr_t) lo);
+
+	if (s->sending)
+		s->bytes = zmodem_send_ex(&s->tp, s->file_count, s->file_list,
+					  s->send_tick, s->complete,
+					  s->min_bps, s->flags, &s->options);
+	else
+		s->bytes = zmodem_receive_ex(&s->tp, s->directory,
+					     s->approver, s->receive_tick,
+					     s->complete, s->min_bps, s->flags,
+					     &s->options);
+	s->state = ZM_SESSION_DONE;
+	/* returning switches to uc_link, the last caller */
+}
+
+/* Set up the engine's context.  getcontext returns only once here,
+   since nothing switches back to this context. */
+static int
+session_make_engine(zm_session_t *s)
+{
+	uintptr_t p = (uintptr_t) s;
+
+	if (getcontext(&s->engine) == -1)
+		return -1;
+	s->engine.uc_stack.ss_sp = s->stack;
+	s->engine.uc_stack.ss_size = s->stack_size;
+	s->engine.uc_link = &s->caller;
+	makecontext(&s->engine, (void (*)(void)) session_main, 2,
+		    (unsigned int) (p >> 16 >> 16), (unsigned int) p);
+	return 0;
+}
+
+static zm_session_t *
+session_new(const zmodem_options_t *options)
+{
+	zm_session_t *s = calloc(1, sizeof(zm_session_t));
+
+	if (!s)
+		return NULL;
+	if (options)
+		s->options = *options;
+	s->stack_size = s->options.stack_size
+		? s->options.stack_size : ZM_SESSION_STACK;
+	s->stack = malloc(s->stack_size);
+	if (!s->stack || session_make_engine(s) == -1) {
+		free(s->stack);
+		free(s);
+		return NULL;
+	}
+	s->deadline = -1;
+	s->tp.read = session_read;
+	s->tp.writev = session_writev;
+	s->tp.purge = session_purge;
+	s->tp.ctx = s;
+	return s;
+}
+
+zm_session_t *
+zm_session_send(int file_count,
+		const char **file_list,
+		bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+		void (*complete)(const char *filename, int result, size_t size, time_t date),
+		uint64_t min_bps,
+		uint32_t flags,
+		const zmodem_options_t *options)
+{
+	zm_session_t *s = session_new(options);
+
+	if (!s)
+		return NULL;
+	s->sending = 1;
+	s->file_count = file_count;
+	s->file_list = file_list;
+	s->send_tick = tick;
+	s->complete = complete;
+	s->min_bps = min_bps;
+	/* The engine must only run inside the caller's calls, so no
+	 * threads of its own. */
+	s->flags = flags & ~(RZSZ_FLAGS_PIPELINE | RZSZ_FLAGS_MONITOR);
+	session_resume(s);
+	return s;
+}
+
+zm_session_t *
+zm_session_receive(const char *directory,
+		   bool (*approver)(const char *filename, size_t size, time_t date),
+		   bool tick(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+		   void (*complete)(const char *filename, int result, size_t size, time_t date),
+		   uint64_t min_bps,
+		   uint32_t flags,
+		   const zmodem_options_t *options)
+{
+	zm_session_t *s = session_new(options);
+
+	if (!s)
+		return NULL;
+	s->directory = directory;
+	s->approver = approver;
+	s->receive_tick = tick;
+	s->complete = complete;
+	s->min_bps = min_bps;
+	s->flags = flags & ~(RZSZ_FLAGS_PIPELINE | RZSZ_FLAGS_MONITOR);
+	session_resume(s);
+	return s;
+}
+
+int
+zm_session_feed(zm_session_t *s, const void *bytes, size_t len)
+{
+	char *p;
+
+	if (s->state == ZM_SESSION_DONE)
+		return 0;
+	if (len == 0)
+		s->in_eof = 1;
+	else {
+		p = session_room(&s->in, &s->in_start, &s->in_len,
+				 &s->in_size, len);
+		if (!p)
+			return -1;
+		memcpy(p, bytes, len);
+		s->in_len += len;
+	}
+	if (s->state == ZM_SESSION_WAIT_INPUT)
+		session_resume(s);
+	return 0;
+}
+
+const void *
+zm_session_poll_output(zm_session_t *s, size_t *len)
+{
+	*len = s->out_len;
+	return s->out + s->out_start;
+}
+
+void
+zm_session_consume_output(zm_session_t *s, size_t len)
+{
+	if (len > s->out_len)
+		len = s->out_len;
+	s->out_start += len;
+	s->out_len -= len;
+	if (s->out_len == 0)
+		s->out_start = 0;
+	if (s->state == ZM_SESSION_WAIT_OUTPUT
+	    && s->out_len < ZM_SESSION_OUTPUT_HIGH)
+		session_resume(s);
+}
+
+long long
+zm_session_next_deadline(zm_session_t *s)
+{
+	if (s->state != ZM_SESSION_WAIT_INPUT)
+		return -1;
+	return s->deadline;
+}
+
+void
+zm_session_timeout(zm_session_t *s)
+{
+	if (s->state != ZM_SESSION_WAIT_INPUT
+	    || s->deadline < 0 || session_now_ms() < s->deadline)
+		return;
+	s->timed_out = 1;
+	session_resume(s);
+}
+
+bool
+zm_session_done(zm_session_t *s, size_t *bytes)
+{
+	if (s->state != ZM_SESSION_DONE)
+		return false;
+	if (bytes)
+		*bytes = s->bytes;
+	return true;
+}
+
+void
+zm_session_free(zm_session_t *s)
+{
+	if (!s)
+		return;
+	/* An unfinished engine is run down against end of input, so
+	   that it closes its files and frees its session objects. */
+	s->in_eof = 1;
+	while (s->state != ZM_SESSION_DONE) {
+		s->out_len = 0;
+		session_resume(s);
+	}
+	free(s->stack);
+	free(s->in);
+	free(s->out);
+	free(s);
+}
+
+#else
+
+zm_session_t *
+zm_session_send(int file_count LRZSZ_ATTRIB_UNUSED,
+		const char **file_list LRZSZ_ATTRIB_UNUSED,
+		bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left) LRZSZ_ATTRIB_UNUSED,
+		void (*complete)(const char *filename, int result, size_t size, time_t date) LRZSZ_ATTRIB_UNUSED,
+		uint64_t min_bps LRZSZ_ATTRIB_UNUSED,
+		uint32_t flags LRZSZ_ATTRIB_UNUSED,
+		const zmodem_options_t *options LRZSZ_ATTRIB_UNUSED)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+zm_session_t *
+zm_session_receive(const char *directory LRZSZ_ATTRIB_UNUSED,
+		   bool (*approver)(const char *filename, size_t size, time_t date) LRZSZ_ATTRIB_UNUSED,
+		   bool tick(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left) LRZSZ_ATTRIB_UNUSED,
+		   void (*complete)(const char *filename, int result, size_t size, time_t date) LRZSZ_ATTRIB_UNUSED,
+		   uint64_t min_bps LRZSZ_ATTRIB_UNUSED,
+		   uint32_t flags LRZSZ_ATTRIB_UNUSED,
+		   const zmodem_options_t *options LRZSZ_ATTRIB_UNUSED)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+/* No session can have been made, so the rest are never reached. */
+int
+zm_session_feed(zm_session_t *s LRZSZ_ATTRIB_UNUSED,
+		const void *bytes LRZSZ_ATTRIB_UNUSED,
+		size_t len LRZSZ_ATTRIB_UNUSED)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+const void *
+zm_session_poll_output(zm_session_t *s LRZSZ_ATTRIB_UNUSED, size_t *len)
+{
+	*len = 0;
+	return NULL;
+}
+
+void
+zm_session_consume_output(zm_session_t *s LRZSZ_ATTRIB_UNUSED,
+			  size_t len LRZSZ_ATTRIB_UNUSED)
+{
+}
+
+long long
+zm_session_next_deadline(zm_session_t *s LRZSZ_ATTRIB_UNUSED)
+{
+	return -1;
+}
+
+void
+zm_session_timeout(zm_session_t *s LRZSZ_ATTRIB_UNUSED)
+{
+}
+
+bool
+zm_session_done(zm_session_t *s LRZSZ_ATTRIB_UNUSED,
+		size_t *bytes LRZSZ_ATTRIB_UNUSED)
+{
+	return true;
+}
+
+void
+zm_session_free(zm_session_t *s LRZSZ_ATTRIB_UNUSED)
+{
+}
+
+#endif /* HAVE_UCONTEXT */
@@ -0,0 +1,965 @@
+/*
+  szpipe.c - a pipeline of threads for the ZMODEM sender
+  Copyright (C) 2018 Michael L. Gran
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+  02111-1307, USA.
+*/
+
+/*
+ * Each hand-off in the pipeline has one producer and one consumer.
+ * The producer fills a slot and then publishes it by advancing its
+ * cursor; the consumer frees slots by advancing its own.  Neither
+ * takes a lock for that.  The lock is only there to sleep on when a
+ * thread finds nothing to do after spinning briefly, and a thread
+ * that advances a cursor only takes it when somebody sleeps.
+ */
+
+#include "zglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zm.h"
+#include "zescape.h"
+#include "szpipe.h"
+
+#define SZ_PIPE_SLOTS 16		/* blocks in flight */
+#define SZ_WRITER_RING (256 * 1024)	/* output queued for the writer */
+#define SZ_WRITER_CHUNK (16 * 1024)	/* most handed to the line at once */
+#define SZ_SPIN 1000			/* looks at a cursor before sleeping */
+#define SZ_MONITOR_EVENTS 16		/* headers queued by the monitor */
+#define SZ_MONITOR_POLL_MS 100		/* how often the monitor looks at STOP */
+#define SZ_MONITOR_READ 1024		/* bytes the monitor reads at once */
+
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+/* Where threads sleep.  SLEEPING is read without LOCK. */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int sleeping;
+} sz_waitq_t;
+
+static void
+waitq_init(sz_waitq_t *q)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	q->sleeping = 0;
+}
+
+static void
+waitq_destroy(sz_waitq_t *q)
+{
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+}
+
+/* Wait until READY(ARG) holds.  READY must read what other threads
+   change with LOAD, and they must STORE it before calling
+   waitq_wake. */
+static void
+waitq_wait(sz_waitq_t *q, int (*ready)(void *arg), void *arg)
+{
+	for (int i = 0; i < SZ_SPIN; i++)
+		if (ready(arg))
+			return;
+	pthread_mutex_lock(&q->lock);
+	__atomic_add_fetch(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+	while (!ready(arg))
+		pthread_cond_wait(&q->cond, &q->lock);
+	__atomic_sub_fetch(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Like waitq_wait, but give up after TIMEOUT_MS milliseconds.  Returns
+   what READY last returned. */
+static int
+waitq_timedwait(sz_waitq_t *q, int (*ready)(void *arg), void *arg,
+		int timeout_ms)
+{
+	struct timespec deadline;
+	int r;
+
+	if (ready(arg))
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&q->lock);
+	__atomic_add_fetch(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+	while (!(r = ready(arg)))
+		if (pthread_cond_timedwait(&q->cond, &q->lock, &deadline)
+		    == ETIMEDOUT) {
+			r = ready(arg);
+			break;
+		}
+	__atomic_sub_fetch(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->lock);
+	return r;
+}
+
+static void
+waitq_wake(sz_waitq_t *q)
+{
+	if (LOAD(&q->sleeping) > 0) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+typedef struct {
+	sz_pipe_block_t b;
+	char *image;		/* b.image, writable */
+	const char *data;	/* the payload, in the mapping */
+	unsigned int gen;	/* the generation it was fetched for */
+} sz_pipe_slot_t;
+
+struct sz_pipe_ {
+	const char *data;
+	size_t size;
+	char table[256];
+	int ctl;
+	int crc32;
+	sz_pipe_slot_t slots[SZ_PIPE_SLOTS];
+	char *images;
+
+	/* Blocks that went through each stage so far.  Each count is
+	 * written by one thread only. */
+	size_t fetched;		/* reader */
+	size_t encoded;		/* encoder */
+	size_t consumed;	/* protocol thread */
+
+	/* Set by the protocol thread.  A restart bumps GEN and sets
+	 * RESTART, both under wait.lock; blocks fetched for an older
+	 * generation are dropped. */
+	unsigned int gen;
+	size_t restart;		/* where generation GEN starts */
+	size_t next;		/* offset the next block should have */
+	size_t blklen;
+	int stop;
+
+	/* The reader's own. */
+	unsigned int rgen;
+	size_t roffset;
+	int reof;
+
+	sz_waitq_t wait;
+	pthread_t reader;
+	pthread_t encoder;
+};
+
+/* Fault in the pages of the LEN bytes at DATA, so that the encoder
+   does not wait for the disk. */
+static void
+sz_pipe_prefault(const char *data, size_t len, size_t page)
+{
+	const volatile char *v = data;
+
+	for (size_t i = 0; i < len; i += page)
+		(void) v[i];
+	if (len > 0)
+		(void) v[len - 1];
+}
+
+static int
+reader_ready(void *arg)
+{
+	sz_pipe_t *p = arg;
+
+	if (LOAD(&p->stop) || LOAD(&p->gen) != p->rgen)
+		return 1;
+	return !p->reof && p->fetched - LOAD(&p->consumed) < SZ_PIPE_SLOTS;
+}
+
+static void *
+sz_pipe_read(void *arg)
+{
+	sz_pipe_t *p = arg;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (page <= 0)
+		page = 4096;
+	for (;;) {
+		sz_pipe_slot_t *slot;
+		size_t blklen;
+		size_t n;
+		int eof;
+
+		waitq_wait(&p->wait, reader_ready, p);
+		if (LOAD(&p->stop))
+			break;
+		if (LOAD(&p->gen) != p->rgen) {
+			pthread_mutex_lock(&p->wait.lock);
+			p->rgen = LOAD(&p->gen);
+			p->roffset = p->restart;
+			pthread_mutex_unlock(&p->wait.lock);
+			p->reof = 0;
+			continue;
+		}
+		slot = &p->slots[p->fetched % SZ_PIPE_SLOTS];
+		blklen = LOAD(&p->blklen);
+		if (p->roffset < p->size && p->size - p->roffset > blklen) {
+			n = blklen;
+			eof = 0;
+		} else {
+			n = p->roffset < p->size ? p->size - p->roffset : 0;
+			eof = 1;
+		}
+		slot->b.offset = p->roffset;
+		slot->b.len = n;
+		slot->b.eof = eof;
+		slot->data = p->data + slot->b.offset;
+		slot->gen = p->rgen;
+		sz_pipe_prefault(slot->data, n, (size_t) page);
+		p->roffset += n;
+		p->reof = eof;
+		STORE(&p->fetched, p->fetched + 1);
+		waitq_wake(&p->wait);
+	}
+	return NULL;
+}
+
+static int
+encoder_ready(void *arg)
+{
+	sz_pipe_t *p = arg;
+
+	return LOAD(&p->stop) || p->encoded < LOAD(&p->fetched);
+}
+
+static void *
+sz_pipe_encode(void *arg)
+{
+	sz_pipe_t *p = arg;
+
+	for (;;) {
+		sz_pipe_slot_t *slot;
+
+		waitq_wait(&p->wait, encoder_ready, p);
+		if (LOAD(&p->stop))
+			break;
+		slot = &p->slots[p->encoded % SZ_PIPE_SLOTS];
+		/* a block of an older generation is only going to be
+		 * dropped */
+		if (slot->gen == LOAD(&p->gen))
+			slot->b.image_len = zm_encode_data(p->table, p->ctl,
+							   p->crc32, slot->image,
+							   slot->data,
+							   slot->b.len,
+							   &slot->b.crc);
+		STORE(&p->encoded, p->encoded + 1);
+		waitq_wake(&p->wait);
+	}
+	return NULL;
+}
+
+static size_t
+sz_pipe_clamp(size_t blklen)
+{
+	if (blklen == 0)
+		return 1024;
+	return blklen > SZ_PIPE_MAX_BLOCK ? SZ_PIPE_MAX_BLOCK : blklen;
+}
+
+sz_pipe_t *
+sz_pipe_new(const char *data, size_t size, size_t offset, size_t blklen,
+	    const char *table, int ctl, int crc32)
+{
+	sz_pipe_t *p = calloc(1, sizeof(sz_pipe_t));
+
+	if (!p)
+		return NULL;
+	p->images = malloc(SZ_PIPE_SLOTS * ZM_ESCAPE_MAX(SZ_PIPE_MAX_BLOCK));
+	if (!p->images) {
+		free(p);
+		return NULL;
+	}
+	for (int i = 0; i < SZ_PIPE_SLOTS; i++) {
+		p->slots[i].image = p->images
+			+ (size_t) i * ZM_ESCAPE_MAX(SZ_PIPE_MAX_BLOCK);
+		p->slots[i].b.image = p->slots[i].image;
+	}
+	p->data = data;
+	p->size = size;
+	memcpy(p->table, table, sizeof(p->table));
+	p->ctl = ctl;
+	p->crc32 = crc32;
+	p->restart = p->next = p->roffset = offset;
+	p->blklen = sz_pipe_clamp(blklen);
+	waitq_init(&p->wait);
+	if (pthread_create(&p->reader, NULL, sz_pipe_read, p) != 0)
+		goto fail;
+	if (pthread_create(&p->encoder, NULL, sz_pipe_encode, p) != 0) {
+		STORE(&p->stop, 1);
+		pthread_mutex_lock(&p->wait.lock);
+		pthread_cond_broadcast(&p->wait.cond);
+		pthread_mutex_unlock(&p->wait.lock);
+		pthread_join(p->reader, NULL);
+		goto fail;
+	}
+	return p;
+
+fail:
+	waitq_destroy(&p->wait);
+	free(p->images);
+	free(p);
+	return NULL;
+}
+
+static int
+protocol_ready(void *arg)
+{
+	sz_pipe_t *p = arg;
+
+	return p->consumed < LOAD(&p->encoded);
+}
+
+/* Drop what is in flight and fetch again from OFFSET. */
+static void
+sz_pipe_restart(sz_pipe_t *p, size_t offset)
+{
+	pthread_mutex_lock(&p->wait.lock);
+	p->restart = offset;
+	STORE(&p->gen, p->gen + 1);
+	pthread_mutex_unlock(&p->wait.lock);
+	p->next = offset;
+	waitq_wake(&p->wait);
+}
+
+static void
+sz_pipe_advance(sz_pipe_t *p)
+{
+	STORE(&p->consumed, p->consumed + 1);
+	waitq_wake(&p->wait);
+}
+
+const sz_pipe_block_t *
+sz_pipe_next(sz_pipe_t *p, size_t offset)
+{
+	if (offset != p->next)
+		sz_pipe_restart(p, offset);
+	for (;;) {
+		sz_pipe_slot_t *slot;
+
+		waitq_wait(&p->wait, protocol_ready, p);
+		slot = &p->slots[p->consumed % SZ_PIPE_SLOTS];
+		if (slot->gen == p->gen)
+			return &slot->b;
+		sz_pipe_advance(p);
+	}
+}
+
+void
+sz_pipe_release(sz_pipe_t *p)
+{
+	sz_pipe_slot_t *slot = &p->slots[p->consumed % SZ_PIPE_SLOTS];
+
+	/* nothing follows the end of the file, so asking for more means
+	 * starting over */
+	p->next = slot->b.eof ? (size_t) -1 : slot->b.offset + slot->b.len;
+	sz_pipe_advance(p);
+}
+
+void
+sz_pipe_set_blklen(sz_pipe_t *p, size_t blklen)
+{
+	STORE(&p->blklen, sz_pipe_clamp(blklen));
+}
+
+void
+sz_pipe_free(sz_pipe_t *p)
+{
+	if (!p)
+		return;
+	STORE(&p->stop, 1);
+	pthread_mutex_lock(&p->wait.lock);
+	pthread_cond_broadcast(&p->wait.cond);
+	pthread_mutex_unlock(&p->wait.lock);
+	pthread_join(p->reader, NULL);
+	pthread_join(p->encoder, NULL);
+	waitq_destroy(&p->wait);
+	free(p->images);
+	free(p);
+}
+
+struct sz_writer_ {
+	zmodem_transport_t tp;	/* what the protocol thread writes to */
+	zmodem_transport_t *line;
+	char *ring;
+
+	size_t head;		/* bytes written to LINE: the writer's */
+	size_t tail;		/* bytes queued: the protocol thread's */
+	size_t flush_at;	/* TAIL when FLUSH was last called */
+	size_t flushed;		/* the writer's: FLUSH_AT last seen */
+	size_t discard_at;	/* output up to here is not to be written */
+	int error;		/* errno of a failed write */
+	int stop;
+
+	sz_waitq_t wait;
+	pthread_t thread;
+};
+
+static int
+writer_ready(void *arg)
+{
+	sz_writer_t *w = arg;
+
+	return w->head != LOAD(&w->tail) || w->flushed != LOAD(&w->flush_at)
+		|| LOAD(&w->stop);
+}
+
+static void *
+sz_writer_run(void *arg)
+{
+	sz_writer_t *w = arg;
+
+	for (;;) {
+		struct iovec iov[2];
+		int iovcnt = 1;
+		size_t tail;
+		size_t at;
+		ssize_t n;
+
+		waitq_wait(&w->wait, writer_ready, w);
+		if (LOAD(&w->discard_at) > w->head) {
+			STORE(&w->head, LOAD(&w->discard_at));
+			waitq_wake(&w->wait);
+		}
+		tail = LOAD(&w->tail);
+		if (w->head == tail) {
+			size_t flush_at = LOAD(&w->flush_at);
+
+			if (w->flushed != flush_at) {
+				if (w->line->flush)
+					w->line->flush(w->line->ctx);
+				w->flushed = flush_at;
+			} else if (LOAD(&w->stop))
+				break;
+			continue;
+		}
+		/* A blocking write of everything queued would hold on
+		 * to output that sz_writer_discard could still drop. */
+		if (tail - w->head > SZ_WRITER_CHUNK)
+			tail = w->head + SZ_WRITER_CHUNK;
+		at = w->head % SZ_WRITER_RING;
+		iov[0].iov_base = w->ring + at;
+		iov[0].iov_len = tail - w->head;
+		if (at + iov[0].iov_len > SZ_WRITER_RING) {
+			iov[0].iov_len = SZ_WRITER_RING - at;
+			iov[1].iov_base = w->ring;
+			iov[1].iov_len = tail - w->head - iov[0].iov_len;
+			iovcnt = 2;
+		}
+		n = w->line->writev(w->line->ctx, iov, iovcnt);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			/* the line is gone: drop what is queued, and make
+			 * the protocol thread's writes fail from now on */
+			STORE(&w->error, n < 0 ? errno : EIO);
+			n = (ssize_t) (tail - w->head);
+		}
+		STORE(&w->head, w->head + (size_t) n);
+		waitq_wake(&w->wait);
+	}
+	return NULL;
+}
+
+static int
+writer_has_room(void *arg)
+{
+	sz_writer_t *w = arg;
+
+	return LOAD(&w->error)
+		|| w->tail - LOAD(&w->head) < SZ_WRITER_RING;
+}
+
+static int
+writer_empty(void *arg)
+{
+	sz_writer_t *w = arg;
+
+	return LOAD(&w->head) == w->tail;
+}
+
+static ssize_t
+writer_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	sz_writer_t *w = ctx;
+	size_t total = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const char *s = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len > 0) {
+			size_t at = w->tail % SZ_WRITER_RING;
+			size_t n;
+
+			waitq_wait(&w->wait, writer_has_room, w);
+			if (LOAD(&w->error))
+				break;
+			n = SZ_WRITER_RING - (w->tail - LOAD(&w->head));
+			if (n > SZ_WRITER_RING - at)
+				n = SZ_WRITER_RING - at;
+			if (n > len)
+				n = len;
+			memcpy(w->ring + at, s, n);
+			STORE(&w->tail, w->tail + n);
+			waitq_wake(&w->wait);
+			s += n;
+			len -= n;
+			total += n;
+		}
+	}
+	if (LOAD(&w->error)) {
+		errno = LOAD(&w->error);
+		return -1;
+	}
+	return (ssize_t) total;
+}
+
+static ssize_t
+writer_read(void *ctx, void *buf, size_t len, int timeout_ms)
+{
+	sz_writer_t *w = ctx;
+
+	return w->line->read(w->line->ctx, buf, len, timeout_ms);
+}
+
+static int
+writer_flush(void *ctx)
+{
+	sz_writer_t *w = ctx;
+
+	STORE(&w->flush_at, w->tail);
+	waitq_wake(&w->wait);
+	return 0;
+}
+
+static int
+writer_drain(void *ctx)
+{
+	sz_writer_t *w = ctx;
+
+	waitq_wait(&w->wait, writer_empty, w);
+	if (w->line->drain)
+		return w->line->drain(w->line->ctx);
+	return 0;
+}
+
+static void
+writer_purge(void *ctx)
+{
+	sz_writer_t *w = ctx;
+
+	if (w->line->purge)
+		w->line->purge(w->line->ctx);
+}
+
+static void
+writer_send_break(void *ctx)
+{
+	sz_writer_t *w = ctx;
+
+	waitq_wait(&w->wait, writer_empty, w);
+	if (w->line->send_break)
+		w->line->send_break(w->line->ctx);
+}
+
+sz_writer_t *
+sz_writer_new(zmodem_transport_t *line)
+{
+	sz_writer_t *w = calloc(1, sizeof(sz_writer_t));
+
+	if (!w)
+		return NULL;
+	w->ring = malloc(SZ_WRITER_RING);
+	if (!w->ring) {
+		free(w);
+		return NULL;
+	}
+	w->line = line;
+	w->tp.read = writer_read;
+	w->tp.writev = writer_writev;
+	w->tp.flush = writer_flush;
+	w->tp.drain = writer_drain;
+	w->tp.purge = writer_purge;
+	w->tp.send_break = writer_send_break;
+	w->tp.ctx = w;
+	waitq_init(&w->wait);
+	if (pthread_create(&w->thread, NULL, sz_writer_run, w) != 0) {
+		waitq_destroy(&w->wait);
+		free(w->ring);
+		free(w);
+		return NULL;
+	}
+	return w;
+}
+
+zmodem_transport_t *
+sz_writer_transport(sz_writer_t *w)
+{
+	return &w->tp;
+}
+
+int
+sz_writer_discard(sz_writer_t *w)
+{
+	if (LOAD(&w->head) == w->tail)
+		return 0;
+	STORE(&w->discard_at, w->tail);
+	waitq_wake(&w->wait);
+	return 1;
+}
+
+void
+sz_writer_free(sz_writer_t *w)
+{
+	if (!w)
+		return;
+	waitq_wait(&w->wait, writer_empty, w);
+	STORE(&w->stop, 1);
+	pthread_mutex_lock(&w->wait.lock);
+	pthread_cond_broadcast(&w->wait.cond);
+	pthread_mutex_unlock(&w->wait.lock);
+	pthread_join(w->thread, NULL);
+	waitq_destroy(&w->wait);
+	free(w->ring);
+	free(w);
+}
+
+typedef struct {
+	int type;
+	uint32_t rxpos;
+	char hdr[4];
+} sz_monitor_event_t;
+
+struct sz_monitor_ {
+	zmodem_transport_t tp;	/* the monitor's side of the line */
+	zmodem_transport_t *line;
+	zm_t *zm;		/* parses headers; never writes */
+	char *pending;		/* read, not yet parsed */
+	size_t pending_len;
+	int eof;		/* the line is gone: the monitor's */
+
+	sz_monitor_event_t events[SZ_MONITOR_EVENTS];
+	size_t posted;		/* the monitor's */
+	size_t taken;		/* the protocol thread's */
+	int paused;		/* XOFF seen, no XON since */
+	int stop;
+
+	sz_waitq_t wait;
+	pthread_t thread;
+};
+
+static long long
+monitor_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Read the line into BUF, waiting until DEADLINE, or forever if it is
+   negative, in slices so that STOP is seen.  Note XON and XOFF on the
+   way: those never occur unescaped in a header, so each one seen is
+   flow control.  Returns 0 on timeout, on STOP and once the line is
+   gone. */
+static ssize_t
+monitor_read_line(sz_monitor_t *m, void *buf, size_t len, long long deadline)
+{
+	ssize_t n;
+
+	for (;;) {
+		int slice = SZ_MONITOR_POLL_MS;
+		long long start;
+
+		if (m->eof || LOAD(&m->stop))
+			return 0;
+		if (deadline >= 0) {
+			long long left = deadline - monitor_now_ms();
+
+			if (left <= 0)
+				return 0;
+			if (left < slice)
+				slice = (int) left;
+		}
+		start = monitor_now_ms();
+		n = m->line->read(m->line->ctx, buf, len, slice);
+		if (n > 0)
+			break;
+		if (n < 0 && errno == EINTR)
+			continue;
+		/* READ returns 0 on timeout and on end of file; only the
+		 * latter comes back early. */
+		if (n < 0 || monitor_now_ms() - start < slice / 2) {
+			m->eof = 1;
+			return 0;
+		}
+	}
+	for (ssize_t i = 0; i < n; i++) {
+		int c = ((unsigned char *) buf)[i] & 0x7F;
+
+		if (c == XOFF)
+			STORE(&m->paused, 1);
+		else if (c == XON)
+			STORE(&m->paused, 0);
+	}
+	waitq_wake(&m->wait);
+	return n;
+}
+
+/* The reads of the monitor's zm: what the monitor read before it
+   parses, then the line. */
+static ssize_t
+monitor_read(void *ctx, void *buf, size_t len, int timeout_ms)
+{
+	sz_monitor_t *m = ctx;
+	size_t n;
+
+	if (m->pending_len == 0)
+		return monitor_read_line(m, buf, len, timeout_ms < 0 ? -1
+					 : monitor_now_ms() + timeout_ms);
+	n = len < m->pending_len ? len : m->pending_len;
+	memcpy(buf, m->pending, n);
+	memmove(m->pending, m->pending + n, m->pending_len - n);
+	m->pending_len -= n;
+	return (ssize_t) n;
+}
+
+static ssize_t
+monitor_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	sz_monitor_t *m = ctx;
+
+	return m->line->writev(m->line->ctx, iov, iovcnt);
+}
+
+static int
+monitor_has_room(void *arg)
+{
+	sz_monitor_t *m = arg;
+
+	return m->posted - LOAD(&m->taken) < SZ_MONITOR_EVENTS
+		|| LOAD(&m->stop);
+}
+
+static int
+monitor_stopped(void *arg)
+{
+	sz_monitor_t *m = arg;
+
+	return LOAD(&m->stop);
+}
+
+static void
+monitor_post(sz_monitor_t *m, int type, uint32_t rxpos)
+{
+	sz_monitor_event_t *ev;
+
+	waitq_wait(&m->wait, monitor_has_room, m);
+	if (LOAD(&m->stop))
+		return;
+	ev = &m->events[m->posted % SZ_MONITOR_EVENTS];
+	ev->type = type;
+	ev->rxpos = rxpos;
+	memcpy(ev->hdr, m->zm->Rxhdr, 4);
+	STORE(&m->posted, m->posted + 1);
+	waitq_wake(&m->wait);
+}
+
+static void *
+sz_monitor_run(void *arg)
+{
+	sz_monitor_t *m = arg;
+
+	while (!LOAD(&m->stop)) {
+		uint32_t rxpos = 0;
+		int c = TIMEOUT;
+
+		/* Wait for input outside zm_get_header, which would
+		 * complain of the wait ending at STOP or at a hangup,
+		 * both of which are normal between headers. */
+		if (m->pending_len == 0 && m->zm->zr->readline_left <= 0) {
+			ssize_t n = monitor_read_line(m, m->pending,
+						      SZ_MONITOR_READ, -1);
+
+			if (n > 0)
+				m->pending_len = (size_t) n;
+		}
+		if (m->pending_len > 0 || m->zm->zr->readline_left > 0)
+			c = zm_get_header(m->zm, &rxpos);
+		if (LOAD(&m->stop))
+			break;
+		if (c < 0 && m->eof) {
+			/* what zm_get_header would say on the protocol
+			 * thread from now on */
+			monitor_post(m, TIMEOUT, 0);
+			waitq_wait(&m->wait, monitor_stopped, m);
+			break;
+		}
+		if (c == TIMEOUT || c == RCDO)
+			continue;
+		monitor_post(m, c, rxpos);
+	}
+	return NULL;
+}
+
+sz_monitor_t *
+sz_monitor_new(zmodem_transport_t *line, const char *pending, size_t len)
+{
+	sz_monitor_t *m = calloc(1, sizeof(sz_monitor_t));
+
+	if (!m)
+		return NULL;
+	m->line = line;
+	m->tp.read = monitor_read;
+	m->tp.writev = monitor_writev;
+	m->tp.ctx = m;
+	/* Headers are short and the back channel quiet: small reads,
+	 * and no timeouts but those monitor_read makes up. */
+	m->zm = zm_init(&m->tp, 1024, 1024, 1, 100, 0, 0, 0, 0, 0);
+	m->pending = malloc(len > SZ_MONITOR_READ ? len : SZ_MONITOR_READ);
+	if (!m->zm || !m->pending) {
+		if (m->zm)
+			zm_free(m->zm);
+		free(m->pending);
+		free(m);
+		return NULL;
+	}
+	if (len > 0)
+		memcpy(m->pending, pending, len);
+	m->pending_len = len;
+	waitq_init(&m->wait);
+	if (pthread_create(&m->thread, NULL, sz_monitor_run, m) != 0) {
+		waitq_destroy(&m->wait);
+		zm_free(m->zm);
+		free(m->pending);
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+int
+sz_monitor_pending(sz_monitor_t *m)
+{
+	return LOAD(&m->posted) != m->taken;
+}
+
+static int
+monitor_pending(void *arg)
+{
+	return sz_monitor_pending(arg);
+}
+
+int
+sz_monitor_get(sz_monitor_t *m, uint32_t *rxpos, char *hdr, int timeout_ms)
+{
+	const sz_monitor_event_t *ev;
+	int type;
+
+	if (timeout_ms < 0)
+		waitq_wait(&m->wait, monitor_pending, m);
+	else if (!waitq_timedwait(&m->wait, monitor_pending, m, timeout_ms))
+		return TIMEOUT;
+	ev = &m->events[m->taken % SZ_MONITOR_EVENTS];
+	type = ev->type;
+	if (rxpos)
+		*rxpos = ev->rxpos;
+	if (hdr)
+		memcpy(hdr, ev->hdr, 4);
+	/* a TIMEOUT for a gone line stays, as it would on the line */
+	if (type != TIMEOUT) {
+		STORE(&m->taken, m->taken + 1);
+		waitq_wake(&m->wait);
+	}
+	return type;
+}
+
+void
+sz_monitor_drop(sz_monitor_t *m, int type, uint32_t rxpos)
+{
+	while (sz_monitor_pending(m)) {
+		const sz_monitor_event_t *ev =
+			&m->events[m->taken % SZ_MONITOR_EVENTS];
+
+		if (ev->type != type || ev->rxpos != rxpos)
+			break;
+		STORE(&m->taken, m->taken + 1);
+		waitq_wake(&m->wait);
+	}
+}
+
+int
+sz_monitor_wait(sz_monitor_t *m, int timeout_ms)
+{
+	return waitq_timedwait(&m->wait, monitor_pending, m, timeout_ms);
+}
+
+int
+sz_monitor_paused(sz_monitor_t *m)
+{
+	return LOAD(&m->paused);
+}
+
+static int
+monitor_resumed(void *arg)
+{
+	sz_monitor_t *m = arg;
+
+	return !LOAD(&m->paused) || sz_monitor_pending(m);
+}
+
+void
+sz_monitor_wait_resume(sz_monitor_t *m, int timeout_ms)
+{
+	waitq_timedwait(&m->wait, monitor_resumed, m, timeout_ms);
+}
+
+void
+sz_monitor_free(sz_monitor_t *m)
+{
+	if (!m)
+		return;
+	STORE(&m->stop, 1);
+	pthread_mutex_lock(&m->wait.lock);
+	pthread_cond_broadcast(&m->wait.cond);
+	pthread_mutex_unlock(&m->wait.lock);
+	pthread_join(m->thread, NULL);
+	waitq_destroy(&m->wait);
+	zm_free(m->zm);
+	free(m->pending);
+	free(m);
+}
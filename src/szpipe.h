@@ -0,0 +1,120 @@
+#ifndef LIBZMODEM_SZPIPE_H
+#define LIBZMODEM_SZPIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zmodem.h"
+
+/* The sender's pipeline, used with RZSZ_FLAGS_PIPELINE.
+
+   A reader thread walks an mmap'ed file ahead of the protocol, cutting
+   it into blocks and faulting their pages in.  An encoder thread runs
+   each block through the CRC and the ZDLE encoder.  The protocol
+   thread takes finished blocks in order, picks their frame ends and
+   sends them with zm_send_encoded_data.  The three hand blocks to each
+   other through a ring of slots, each stage advancing a cursor that
+   only it writes, and only sleep when the next stage is empty or
+   full.
+
+   A writer thread behind a transport of its own takes the encoded
+   output off the protocol thread.
+
+   A monitor thread, used with RZSZ_FLAGS_MONITOR, reads the back
+   channel instead of the protocol thread from the first data phase
+   on. */
+
+#define SZ_PIPE_MAX_BLOCK 8192
+
+typedef struct sz_pipe_ sz_pipe_t;
+
+typedef struct {
+	size_t offset;		/* where the block starts in the file */
+	size_t len;		/* payload bytes */
+	int eof;		/* the block ends the file */
+	const char *image;	/* the ZDLE-encoded payload */
+	size_t image_len;
+	uint32_t crc;		/* CRC register over the payload */
+} sz_pipe_block_t;
+
+/* Start a pipeline over the SIZE bytes of file at DATA, from OFFSET in
+   blocks of BLKLEN.  TABLE, CTL and CRC32 are the escape table, the
+   mode it was built for, and the CRC width of the data subpackets to
+   be sent.  Returns NULL if out of memory or threads. */
+sz_pipe_t *sz_pipe_new(const char *data, size_t size, size_t offset,
+		       size_t blklen, const char *table, int ctl, int crc32);
+
+/* Return the block starting at OFFSET, waiting for it to be encoded.
+   An offset that is not the next one in the ring restarts the
+   pipeline there, as needed after a ZRPOS. */
+const sz_pipe_block_t *sz_pipe_next(sz_pipe_t *pipe, size_t offset);
+
+/* Give back the block sz_pipe_next returned. */
+void sz_pipe_release(sz_pipe_t *pipe);
+
+/* Cut blocks fetched from now on BLKLEN bytes long. */
+void sz_pipe_set_blklen(sz_pipe_t *pipe, size_t blklen);
+
+/* Stop the threads and free PIPE.  The file may be unmapped after. */
+void sz_pipe_free(sz_pipe_t *pipe);
+
+typedef struct sz_writer_ sz_writer_t;
+
+/* Start a writer thread for LINE.  Output written to the transport
+   returned by sz_writer_transport is queued and written to LINE by
+   that thread; reads go straight to LINE.  Returns NULL if out of
+   memory or threads. */
+sz_writer_t *sz_writer_new(zmodem_transport_t *line);
+zmodem_transport_t *sz_writer_transport(sz_writer_t *w);
+
+/* Drop the output queued so far that the thread has not started
+   writing.  Returns nonzero if there was any: the cut can fall
+   anywhere, even between a ZDLE and the byte it escapes. */
+int sz_writer_discard(sz_writer_t *w);
+
+/* Wait for the queued output to be written, then stop the thread and
+   free W. */
+void sz_writer_free(sz_writer_t *w);
+
+typedef struct sz_monitor_ sz_monitor_t;
+
+/* Start a monitor thread that parses the headers the receiver sends
+   over LINE and queues them for the protocol thread, which must not
+   read LINE itself until sz_monitor_free.  The LEN bytes at PENDING,
+   read from LINE already, are parsed first.  Returns NULL if out of
+   memory or threads. */
+sz_monitor_t *sz_monitor_new(zmodem_transport_t *line,
+			     const char *pending, size_t len);
+
+/* Return nonzero if a header is queued.  This does not enter the
+   kernel. */
+int sz_monitor_pending(sz_monitor_t *m);
+
+/* Take the next header, waiting at most TIMEOUT_MS milliseconds for
+   it, or forever if TIMEOUT_MS is negative.  Returns its type or a
+   zm_get_header result such as ERROR or ZCAN, storing its position
+   in *RXPOS and its four bytes in HDR, or TIMEOUT.  Once the line is
+   gone it returns TIMEOUT right away. */
+int sz_monitor_get(sz_monitor_t *m, uint32_t *rxpos, char *hdr,
+		   int timeout_ms);
+
+/* Drop the headers of TYPE at RXPOS queued next, if any. */
+void sz_monitor_drop(sz_monitor_t *m, int type, uint32_t rxpos);
+
+/* Wait at most TIMEOUT_MS milliseconds for a header to be queued.
+   Returns nonzero if one is. */
+int sz_monitor_wait(sz_monitor_t *m, int timeout_ms);
+
+/* Return nonzero if the receiver sent XOFF and no XON since. */
+int sz_monitor_paused(sz_monitor_t *m);
+
+/* Wait at most TIMEOUT_MS milliseconds for an XON, or for a header,
+   which will need an answer. */
+void sz_monitor_wait_resume(sz_monitor_t *m, int timeout_ms);
+
+/* Stop the thread and free M.  Input it read but did not hand over
+   is dropped, so only do this once the receiver has nothing more to
+   say until spoken to. */
+void sz_monitor_free(sz_monitor_t *m);
+
+#endif
@@ -26,10 +26,11 @@
 #include "timing.h"
 #include <sys/time.h>
 
+/* Return the seconds since the last reset of *STARTTIME, or, if
+   RESET, reset it to now.  Each session keeps its own STARTTIME. */
 double 
-timing (int reset, time_t *nowp)
+timing (double *starttime, int reset, time_t *nowp)
 {
-  static double elaptime, starttime, stoptime;
   double yet;
   struct timeval tv;
   struct timezone tz;
@@ -45,14 +46,11 @@ timing (int reset, time_t *nowp)
   if (nowp)
     *nowp=(time_t) yet;
   if (reset) {
-    starttime = yet;
-    return starttime;
-  }
-  else {
-    stoptime = yet;
-    elaptime = stoptime - starttime;
-    return elaptime;
+    *starttime = yet;
+    return *starttime;
   }
+  else
+    return yet - *starttime;
 }
 
 /*#define TEST*/
@@ -60,11 +58,12 @@ timing (int reset, time_t *nowp)
 main()
 {
 	int i;
-	display("timing %g",timing(1));
-	display("timing %g",timing(0));
+	double start;
+	display("timing %g",timing(&start,1,NULL));
+	display("timing %g",timing(&start,0,NULL));
 	for(i=0;i<20;i++){
 		sleep(1);
-		display("timing %g",timing(0));
+		display("timing %g",timing(&start,0,NULL));
 	}
 }
 #endif
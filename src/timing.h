@@ -1 +1 @@
-double timing __P ((int reset,time_t *now));
+double timing __P ((double *starttime,int reset,time_t *now));
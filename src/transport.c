@@ -0,0 +1,683 @@
+/*
+  transport.c - byte stream transports for libzmodem sessions
+  Copyright (C) 2018 Michael L. Gran
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+  02111-1307, USA.
+*/
+
+#include "zglobal.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "zmodem.h"
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
+
+/* Milliseconds on the monotonic clock. */
+static long long
+transport_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Wait until FD is readable or the deadline (in transport_now_ms
+   time, or forever if negative) passes.  Return 1 if readable, 0
+   on timeout. */
+static int
+transport_wait(int fd, long long deadline)
+{
+	struct pollfd pfd;
+	int ms = -1, r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		if (deadline >= 0) {
+			long long left = deadline - transport_now_ms();
+			if (left < 0)
+				left = 0;
+			ms = (int) left;
+		}
+		r = poll(&pfd, 1, ms);
+		if (r > 0)
+			return 1;
+		if (r == 0)
+			return 0;
+		if (errno != EINTR) {
+			log_trace("Poll failure :%s\n", strerror(errno));
+			return 0;
+		}
+	}
+}
+
+static long long
+transport_deadline(int timeout_ms)
+{
+	if (timeout_ms < 0)
+		return -1;
+	return transport_now_ms() + timeout_ms;
+}
+
+
+/* File descriptors: terminals, pipes and files. */
+typedef struct {
+	zmodem_transport_t tp;
+	int in_fd;
+	int out_fd;
+	int nonblock;		/* in_fd was opened O_NONBLOCK */
+} fd_transport_t;
+
+/* Poll, then read.  On a non-blocking descriptor the read is tried
+   first, so finding data waiting costs a single system call. */
+static ssize_t
+fd_read(void *ctx, void *buf, size_t len, int timeout_ms)
+{
+	fd_transport_t *t = ctx;
+	long long deadline = transport_deadline(timeout_ms);
+	ssize_t n;
+
+	if (!t->nonblock && timeout_ms >= 0
+	    && !transport_wait(t->in_fd, deadline))
+		return 0;
+	for (;;) {
+		n = read(t->in_fd, buf, len);
+		if (n >= 0)
+			return n;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!transport_wait(t->in_fd, deadline))
+			return 0;
+	}
+}
+
+static ssize_t
+fd_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	fd_transport_t *t = ctx;
+
+	return writev(t->out_fd, iov, iovcnt);
+}
+
+static int
+fd_drain(void *ctx)
+{
+	fd_transport_t *t = ctx;
+
+	if (!isatty(t->out_fd))
+		return 0;
+	return tcdrain(t->out_fd);
+}
+
+static void
+fd_purge(void *ctx)
+{
+	fd_transport_t *t = ctx;
+
+	lseek(t->in_fd, 0, SEEK_END);
+}
+
+static void
+fd_send_break(void *ctx)
+{
+	fd_transport_t *t = ctx;
+
+	tcsendbreak(t->out_fd, 0);
+}
+
+static void
+transport_close(void *ctx)
+{
+	free(ctx);
+}
+
+zmodem_transport_t *
+zmodem_transport_fd(int in_fd, int out_fd)
+{
+	fd_transport_t *t = calloc(1, sizeof(fd_transport_t));
+
+	if (!t)
+		return NULL;
+	t->in_fd = in_fd;
+	t->out_fd = out_fd;
+	t->nonblock = (fcntl(in_fd, F_GETFL) & O_NONBLOCK) != 0;
+	t->tp.read = fd_read;
+	t->tp.writev = fd_writev;
+	t->tp.drain = fd_drain;
+	t->tp.purge = fd_purge;
+	t->tp.send_break = fd_send_break;
+	t->tp.close = transport_close;
+	t->tp.ctx = t;
+	return &t->tp;
+}
+
+
+/* Stream sockets.  MSG_DONTWAIT makes every read try-first, whatever
+   the socket's own blocking mode. */
+typedef struct {
+	zmodem_transport_t tp;
+	int sock;
+} socket_transport_t;
+
+static ssize_t
+socket_read(void *ctx, void *buf, size_t len, int timeout_ms)
+{
+	socket_transport_t *t = ctx;
+	long long deadline = transport_deadline(timeout_ms);
+	ssize_t n;
+
+	for (;;) {
+		n = recv(t->sock, buf, len, MSG_DONTWAIT);
+		if (n >= 0)
+			return n;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (!transport_wait(t->sock, deadline))
+			return 0;
+	}
+}
+
+static ssize_t
+socket_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	socket_transport_t *t = ctx;
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *) iov;
+	msg.msg_iovlen = (size_t) iovcnt;
+	return sendmsg(t->sock, &msg, MSG_NOSIGNAL);
+}
+
+static void
+socket_purge(void *ctx)
+{
+	socket_transport_t *t = ctx;
+	char junk[256];
+
+	while (recv(t->sock, junk, sizeof(junk), MSG_DONTWAIT) > 0)
+		;
+}
+
+zmodem_transport_t *
+zmodem_transport_socket(int sock)
+{
+	socket_transport_t *t = calloc(1, sizeof(socket_transport_t));
+
+	if (!t)
+		return NULL;
+	t->sock = sock;
+	t->tp.read = socket_read;
+	t->tp.writev = socket_writev;
+	t->tp.purge = socket_purge;
+	t->tp.close = transport_close;
+	t->tp.ctx = t;
+	return &t->tp;
+}
+
+
+/* io_uring, over the same kinds of descriptors as the fd transport.
+   A read and its timeout go in as one linked pair of SQEs, so a read
+   costs one system call whether or not input is waiting.  Output is
+   copied into one of two registered buffers, which goes out while
+   the caller fills the other; only FLUSH and DRAIN wait for it.
+   Reads and writes have a ring each, so a reader thread and a writer
+   thread need no lock between them. */
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 4
+#define URING_OUT_BLOCK (64 * 1024)
+
+enum { URING_READ = 1, URING_TIMEOUT, URING_WRITE };
+
+typedef struct {
+	zmodem_transport_t tp;
+	int in_fd;
+	int out_fd;
+	zm_uring_t *in;		/* the reading thread's */
+	zm_uring_t *out;	/* the writing thread's */
+	char *outbuf[2];
+	int fixed;		/* OUTBUF is registered */
+	int fill;		/* the buffer being filled */
+	size_t fill_len;
+	int busy;		/* the other buffer is being written */
+	size_t busy_off;
+	size_t busy_len;
+	int error;		/* errno of a failed write, for the next call */
+} uring_transport_t;
+
+/* Make room for NR SQEs in U, submitting what is queued if need be,
+   so that linked ones go in together.  Returns -1 with errno set if
+   there is none. */
+static int
+uring_reserve(zm_uring_t *u, unsigned nr)
+{
+	if (zm_uring_sq_space(u) < nr && zm_uring_submit(u, 0) < 0)
+		return -1;
+	if (zm_uring_sq_space(u) < nr) {
+		errno = EBUSY;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t
+uring_read(void *ctx, void *buf, size_t len, int timeout_ms)
+{
+	uring_transport_t *t = ctx;
+	long long deadline = transport_deadline(timeout_ms);
+
+	if (len > INT32_MAX)
+		len = INT32_MAX;
+	/* zreadline_ready looks for input this way after every
+	 * subpacket, and mostly finds none: a poll says so for less
+	 * than a read and a timer to cancel it with. */
+	if (timeout_ms == 0 && !transport_wait(t->in_fd, deadline))
+		return 0;
+	for (;;) {
+		struct __kernel_timespec ts;
+		struct io_uring_sqe *sqe;
+		unsigned wait_nr = deadline >= 0 ? 2 : 1;
+		int32_t res = 0, r;
+		uint64_t which;
+
+		if (uring_reserve(t->in, wait_nr) < 0)
+			return -1;
+		sqe = zm_uring_get_sqe(t->in);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = t->in_fd;
+		sqe->addr = (uintptr_t) buf;
+		sqe->len = (uint32_t) len;
+		sqe->off = (uint64_t) -1;	/* the file position, if any */
+		sqe->user_data = URING_READ;
+		if (deadline >= 0) {
+			long long left = deadline - transport_now_ms();
+
+			if (left < 0)
+				left = 0;
+			ts.tv_sec = left / 1000;
+			ts.tv_nsec = (left % 1000) * 1000000;
+			sqe->flags |= IOSQE_IO_LINK;
+			sqe = zm_uring_get_sqe(t->in);
+			sqe->opcode = IORING_OP_LINK_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = (uintptr_t) &ts;
+			sqe->len = 1;
+			sqe->user_data = URING_TIMEOUT;
+		}
+		if (zm_uring_submit(t->in, wait_nr) < 0)
+			return -1;
+		while (wait_nr > 0 && zm_uring_reap(t->in, &which, &r)) {
+			if (which == URING_READ)
+				res = r;
+			wait_nr--;
+		}
+		if (res >= 0)
+			return res;
+		if (res == -ECANCELED)
+			return 0;	/* the timeout went off */
+		if (res == -EINTR)
+			continue;
+		if (res != -EAGAIN) {
+			errno = -res;
+			return -1;
+		}
+		/* IN_FD is non-blocking, and the ring honours that. */
+		if (!transport_wait(t->in_fd, deadline))
+			return 0;
+	}
+}
+
+/* Queue the rest of the buffer being written. */
+static int
+uring_write_busy(uring_transport_t *t)
+{
+	struct io_uring_sqe *sqe;
+	int buf = !t->fill;
+
+	if (uring_reserve(t->out, 1) < 0)
+		return -1;
+	sqe = zm_uring_get_sqe(t->out);
+	sqe->opcode = t->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = t->out_fd;
+	sqe->addr = (uintptr_t) (t->outbuf[buf] + t->busy_off);
+	sqe->len = (uint32_t) t->busy_len;
+	sqe->off = (uint64_t) -1;
+	sqe->buf_index = (uint16_t) buf;
+	sqe->user_data = URING_WRITE;
+	return zm_uring_submit(t->out, 0);
+}
+
+/* Wait for the buffer being written, writing what a short write left
+   over.  Returns -1 with errno set if the write failed. */
+static int
+uring_wait_busy(uring_transport_t *t)
+{
+	while (t->busy) {
+		uint64_t which;
+		int32_t res;
+
+		if (zm_uring_submit(t->out, 1) < 0)
+			return -1;
+		zm_uring_reap(t->out, &which, &res);
+		if (res == -EAGAIN) {
+			struct pollfd pfd;
+
+			/* OUT_FD is non-blocking */
+			pfd.fd = t->out_fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+		} else if (res < 0 && res != -EINTR) {
+			t->busy = 0;
+			errno = -res;
+			return -1;
+		} else if (res == 0 && t->busy_len > 0) {
+			t->busy = 0;
+			errno = EIO;
+			return -1;
+		} else if (res > 0) {
+			t->busy_off += (size_t) res;
+			t->busy_len -= (size_t) res;
+			if (t->busy_len == 0) {
+				t->busy = 0;
+				break;
+			}
+		}
+		if (uring_write_busy(t) < 0) {
+			t->busy = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Hand the buffer being filled to the kernel and start on the other
+   one once that is free. */
+static int
+uring_send(uring_transport_t *t)
+{
+	if (uring_wait_busy(t) < 0)
+		return -1;
+	t->busy = 1;
+	t->busy_off = 0;
+	t->busy_len = t->fill_len;
+	t->fill = !t->fill;
+	t->fill_len = 0;
+	if (uring_write_busy(t) < 0) {
+		t->busy = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Everything is taken; a write that fails once it is is reported by
+   the next call. */
+static ssize_t
+uring_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	uring_transport_t *t = ctx;
+	size_t total = 0;
+
+	if (t->error) {
+		errno = t->error;
+		t->error = 0;
+		return -1;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		const char *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left > 0) {
+			size_t n = URING_OUT_BLOCK - t->fill_len;
+
+			if (n > left)
+				n = left;
+			memcpy(t->outbuf[t->fill] + t->fill_len, p, n);
+			t->fill_len += n;
+			p += n;
+			left -= n;
+			total += n;
+			if (t->fill_len == URING_OUT_BLOCK
+			    && uring_send(t) < 0)
+				return -1;
+		}
+	}
+	if (t->fill_len > 0 && uring_send(t) < 0)
+		return -1;
+	return (ssize_t) total;
+}
+
+static int
+uring_flush(void *ctx)
+{
+	uring_transport_t *t = ctx;
+
+	if (uring_wait_busy(t) < 0) {
+		t->error = errno;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+uring_drain(void *ctx)
+{
+	uring_transport_t *t = ctx;
+
+	if (uring_flush(t) < 0)
+		return -1;
+	if (!isatty(t->out_fd))
+		return 0;
+	return tcdrain(t->out_fd);
+}
+
+static void
+uring_purge(void *ctx)
+{
+	uring_transport_t *t = ctx;
+
+	lseek(t->in_fd, 0, SEEK_END);
+}
+
+static void
+uring_send_break(void *ctx)
+{
+	uring_transport_t *t = ctx;
+
+	tcsendbreak(t->out_fd, 0);
+}
+
+static void
+uring_close(void *ctx)
+{
+	uring_transport_t *t = ctx;
+
+	if (t->out)
+		uring_wait_busy(t);
+	zm_uring_free(t->in);
+	zm_uring_free(t->out);
+	free(t->outbuf[0]);
+	free(t->outbuf[1]);
+	free(t);
+}
+
+zmodem_transport_t *
+zmodem_transport_uring(int in_fd, int out_fd)
+{
+	uring_transport_t *t = calloc(1, sizeof(uring_transport_t));
+	struct iovec iov[2];
+	int saved;
+
+	if (!t)
+		return NULL;
+	t->in_fd = in_fd;
+	t->out_fd = out_fd;
+	t->in = zm_uring_new(URING_ENTRIES);
+	if (t->in)
+		t->out = zm_uring_new(URING_ENTRIES);
+	t->outbuf[0] = malloc(URING_OUT_BLOCK);
+	t->outbuf[1] = malloc(URING_OUT_BLOCK);
+	if (!t->out || !t->outbuf[0] || !t->outbuf[1]) {
+		saved = errno;
+		uring_close(t);
+		errno = saved;
+		return NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		iov[i].iov_base = t->outbuf[i];
+		iov[i].iov_len = URING_OUT_BLOCK;
+	}
+	/* Pinning the buffers may go over RLIMIT_MEMLOCK; plain writes
+	 * do without. */
+	t->fixed = zm_uring_register_buffers(t->out, iov, 2) == 0;
+	t->tp.read = uring_read;
+	t->tp.writev = uring_writev;
+	t->tp.flush = uring_flush;
+	t->tp.drain = uring_drain;
+	t->tp.purge = uring_purge;
+	t->tp.send_break = uring_send_break;
+	t->tp.close = uring_close;
+	t->tp.ctx = t;
+	return &t->tp;
+}
+
+#else
+
+zmodem_transport_t *
+zmodem_transport_uring(int in_fd LRZSZ_ATTRIB_UNUSED,
+		       int out_fd LRZSZ_ATTRIB_UNUSED)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+#endif /* HAVE_IO_URING */
+
+/* Memory: a fixed input image and a growing output buffer. */
+typedef struct {
+	zmodem_transport_t tp;
+	const char *in;
+	size_t in_len;
+	size_t in_pos;
+	char *out;
+	size_t out_len;
+	size_t out_size;
+} memory_transport_t;
+
+static ssize_t
+memory_read(void *ctx, void *buf, size_t len, int timeout_ms LRZSZ_ATTRIB_UNUSED)
+{
+	memory_transport_t *t = ctx;
+	size_t n = t->in_len - t->in_pos;
+
+	if (n > len)
+		n = len;
+	memcpy(buf, t->in + t->in_pos, n);
+	t->in_pos += n;
+	return (ssize_t) n;
+}
+
+static ssize_t
+memory_writev(void *ctx, const struct iovec *iov, int iovcnt)
+{
+	memory_transport_t *t = ctx;
+	size_t total = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (t->out_len + total > t->out_size) {
+		size_t size = t->out_size ? t->out_size : 4096;
+		char *out;
+
+		while (size < t->out_len + total)
+			size *= 2;
+		out = realloc(t->out, size);
+		if (!out) {
+			errno = ENOMEM;
+			return -1;
+		}
+		t->out = out;
+		t->out_size = size;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(t->out + t->out_len, iov[i].iov_base, iov[i].iov_len);
+		t->out_len += iov[i].iov_len;
+	}
+	return (ssize_t) total;
+}
+
+static void
+memory_purge(void *ctx)
+{
+	memory_transport_t *t = ctx;
+
+	t->in_pos = t->in_len;
+}
+
+static void
+memory_close(void *ctx)
+{
+	memory_transport_t *t = ctx;
+
+	free(t->out);
+	free(t);
+}
+
+zmodem_transport_t *
+zmodem_transport_memory(const void *in, size_t in_len)
+{
+	memory_transport_t *t = calloc(1, sizeof(memory_transport_t));
+
+	if (!t)
+		return NULL;
+	t->in = in;
+	t->in_len = in_len;
+	t->tp.read = memory_read;
+	t->tp.writev = memory_writev;
+	t->tp.purge = memory_purge;
+	t->tp.close = memory_close;
+	t->tp.ctx = t;
+	return &t->tp;
+}
+
+const void *
+zmodem_transport_memory_output(zmodem_transport_t *tp, size_t *len)
+{
+	memory_transport_t *t = tp->ctx;
+
+	*len = t->out_len;
+	return t->out;
+}
+
+
+void
+zmodem_transport_free(zmodem_transport_t *tp)
+{
+	if (tp && tp->close)
+		tp->close(tp->ctx);
+}
@@ -0,0 +1,229 @@
+/*
+  uring.c - a bare io_uring for the io_uring transport
+  Copyright (C) 2018 Michael L. Gran
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+  02111-1307, USA.
+*/
+
+/*
+ * The transport needs a handful of operations on two small rings,
+ * which is not worth a dependency on liburing.  This is the usual
+ * setup: map the two queues and the SQE array, publish SQEs by
+ * moving the SQ tail, consume CQEs by moving the CQ head.
+ */
+
+#include "zglobal.h"
+
+#ifdef HAVE_IO_URING
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct zm_uring_ {
+	int fd;
+
+	/* the submission queue */
+	unsigned *sq_head;	/* the kernel's */
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;	/* SQEs handed out */
+	unsigned sqe_head;	/* SQEs submitted */
+
+	/* the completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;	/* the kernel's */
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;		/* the same as SQ_RING with a single mmap */
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static void
+uring_unmap(zm_uring_t *u)
+{
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sq_ring && u->sq_ring != MAP_FAILED)
+		munmap(u->sq_ring, u->sq_ring_size);
+}
+
+zm_uring_t *
+zm_uring_new(unsigned entries)
+{
+	struct io_uring_params p;
+	zm_uring_t *u = calloc(1, sizeof(zm_uring_t));
+	char *sq, *cq;
+	int saved;
+
+	if (!u)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	u->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		free(u);
+		return NULL;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = u->sq_ring;
+	u->sq_head = (unsigned *) (sq + p.sq_off.head);
+	u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	u->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+	u->sq_entries = *(unsigned *) (sq + p.sq_off.ring_entries);
+	u->sq_array = (unsigned *) (sq + p.sq_off.array);
+	u->sqe_tail = u->sqe_head = *u->sq_tail;
+
+	cq = u->cq_ring;
+	u->cq_head = (unsigned *) (cq + p.cq_off.head);
+	u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return u;
+
+ fail:
+	saved = errno;
+	uring_unmap(u);
+	close(u->fd);
+	free(u);
+	errno = saved;
+	return NULL;
+}
+
+int
+zm_uring_register_buffers(zm_uring_t *u, const struct iovec *iov,
+			  unsigned nr)
+{
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+		    iov, nr) < 0)
+		return -1;
+	return 0;
+}
+
+unsigned
+zm_uring_sq_space(zm_uring_t *u)
+{
+	return u->sq_entries - (u->sqe_tail - LOAD_ACQUIRE(u->sq_head));
+}
+
+struct io_uring_sqe *
+zm_uring_get_sqe(zm_uring_t *u)
+{
+	struct io_uring_sqe *sqe;
+
+	if (zm_uring_sq_space(u) == 0)
+		return NULL;
+	sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqe_tail++;
+	return sqe;
+}
+
+int
+zm_uring_submit(zm_uring_t *u, unsigned wait_nr)
+{
+	unsigned to_submit = u->sqe_tail - u->sqe_head;
+
+	for (; u->sqe_head != u->sqe_tail; u->sqe_head++)
+		u->sq_array[u->sqe_head & u->sq_mask] =
+			u->sqe_head & u->sq_mask;
+	STORE_RELEASE(u->sq_tail, u->sqe_tail);
+
+	while (to_submit > 0
+	       || LOAD_ACQUIRE(u->cq_tail) - *u->cq_head < wait_nr) {
+		long n = syscall(__NR_io_uring_enter, u->fd, to_submit,
+				 wait_nr,
+				 wait_nr ? IORING_ENTER_GETEVENTS : 0,
+				 NULL, 0);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		to_submit -= (unsigned) n;
+	}
+	return 0;
+}
+
+int
+zm_uring_reap(zm_uring_t *u, uint64_t *user_data, int32_t *res)
+{
+	unsigned head = *u->cq_head;
+	const struct io_uring_cqe *cqe;
+
+	if (head == LOAD_ACQUIRE(u->cq_tail))
+		return 0;
+	cqe = &u->cqes[head & u->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	STORE_RELEASE(u->cq_head, head + 1);
+	return 1;
+}
+
+void
+zm_uring_free(zm_uring_t *u)
+{
+	if (!u)
+		return;
+	uring_unmap(u);
+	close(u->fd);
+	free(u);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,49 @@
+#ifndef LIBZMODEM_URING_H
+#define LIBZMODEM_URING_H
+
+/* A bare io_uring, driven through the system calls directly.
+
+   Only what the io_uring transport needs: one submitter at a time
+   queues SQEs with zm_uring_get_sqe, submits them with
+   zm_uring_submit, and takes their completions back with
+   zm_uring_reap.  The caller keeps track of which completion belongs
+   to which SQE through the SQE's user_data. */
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct zm_uring_ zm_uring_t;
+
+/* Set up a ring with room for ENTRIES SQEs.  Returns NULL with errno
+   set if the kernel refuses, as kernels without io_uring and
+   sandboxes that forbid it do. */
+zm_uring_t *zm_uring_new(unsigned entries);
+
+/* Register the NR buffers of IOV for IORING_OP_READ_FIXED and
+   IORING_OP_WRITE_FIXED, as buffer indexes 0 to NR - 1.  Returns -1
+   with errno set on failure, as when they would go over
+   RLIMIT_MEMLOCK. */
+int zm_uring_register_buffers(zm_uring_t *u, const struct iovec *iov,
+			      unsigned nr);
+
+/* Return a cleared SQE to fill in, or NULL if the queue is full. */
+struct io_uring_sqe *zm_uring_get_sqe(zm_uring_t *u);
+
+/* How many more SQEs zm_uring_get_sqe can hand out before a submit. */
+unsigned zm_uring_sq_space(zm_uring_t *u);
+
+/* Submit the SQEs queued so far and wait until at least WAIT_NR
+   completions can be reaped, in one system call.  Returns -1 with
+   errno set on failure. */
+int zm_uring_submit(zm_uring_t *u, unsigned wait_nr);
+
+/* Take the oldest completion, storing its user_data and result.
+   Returns 0 if there is none yet, else 1. */
+int zm_uring_reap(zm_uring_t *u, uint64_t *user_data, int32_t *res);
+
+/* Tear the ring down.  Requests still in flight are cancelled by the
+   kernel. */
+void zm_uring_free(zm_uring_t *u);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+  zescape.c - ZDLE escape encoding and decoding
+  Copyright (C) 2018 Michael L. Gran
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+  02111-1307, USA.
+*/
+
+/* Most data bytes go out unchanged, so the vector encoders only look
+ * for bytes that might need a ZDLE prefix and copy the clean runs
+ * between them in bulk.  The escape table has the final say on each
+ * candidate byte.  On receive, the same idea copies the clean run at
+ * the head of the input and leaves the rest to the scalar decoder. */
+
+#include "zglobal.h"
+
+#include <stdio.h>
+#include "zm.h"
+#include "zescape.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZESC_HAVE_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* The kernels below take the escape mode as a constant argument and
+ * are stamped out once per mode by ZESC_VARIANTS, so the mode test
+ * folds away and each session runs a loop without it. */
+#ifdef __GNUC__
+#define ZESC_INLINE static inline __attribute__((always_inline))
+#else
+#define ZESC_INLINE static inline
+#endif
+
+/* Store C, escaped as TABLE says, at DST.  Returns the bytes stored. */
+static inline size_t
+zesc_put(const char *table, char *lastsent, char *dst, unsigned char c)
+{
+	if (table[c] == ZM_ESCAPE_ALWAYS
+	    || (table[c] == ZM_ESCAPE_AFTER_AMPERSAND
+		&& (*lastsent & 0x7F) == '@')) {
+		/* Spec 7.2: The receiving program decodes any sequence
+		 * of ZDLE followed by a byte with bit 6 set and bit 5
+		 * reset to the equivalent control character by inverting
+		 * bit 6 */
+		dst[0] = ZDLE;
+		dst[1] = *lastsent = (char) (c ^ 0100);
+		return 2;
+	}
+	dst[0] = *lastsent = (char) c;
+	return 1;
+}
+
+/* The escape table alone decides, so the scalar encoder is the same
+ * for both modes. */
+static size_t
+zesc_encode_scalar(const char *table, char *lastsent,
+		   char *dst, const char *src, size_t count)
+{
+	char *o = dst;
+	const char *end = src + count;
+
+	while (src != end) {
+		const char *t = src;
+		while (t != end && !table[(unsigned char) *t])
+			t++;
+		if (t != src) {
+			memcpy(o, src, (size_t) (t - src));
+			o += t - src;
+			*lastsent = t[-1];
+			src = t;
+		}
+		if (src != end)
+			o += zesc_put(table, lastsent, o, (unsigned char) *src++);
+	}
+	return (size_t) (o - dst);
+}
+
+/* True if the receiver has to look at C rather than store it. */
+static inline int
+zesc_special(unsigned char c, int ctl)
+{
+	if (c & 0x60)
+		return 0;
+	if (ctl)
+		return 1;
+	return c == ZDLE || (c & 0x7f) == XON || (c & 0x7f) == XOFF;
+}
+
+ZESC_INLINE size_t
+zesc_unescape_scalar(char *dst, const char *src, size_t count, int ctl)
+{
+	size_t n = 0;
+
+	while (n < count && !zesc_special((unsigned char) src[n], ctl))
+		n++;
+	memcpy(dst, src, n);
+	return n;
+}
+
+/* Instantiate KERNEL for the minimal (_min) and the escape all
+ * control characters (_ctl) modes. */
+#define ZESC_VARIANTS(kernel, attr)					\
+	attr static size_t						\
+	kernel##_min(char *dst, const char *src, size_t count)		\
+	{ return kernel(dst, src, count, 0); }				\
+	attr static size_t						\
+	kernel##_ctl(char *dst, const char *src, size_t count)		\
+	{ return kernel(dst, src, count, 1); }
+#define ZESC_ENCODE_VARIANTS(kernel, attr)				\
+	attr static size_t						\
+	kernel##_min(const char *table, char *lastsent,			\
+		     char *dst, const char *src, size_t count)		\
+	{ return kernel(table, lastsent, dst, src, count, 0); }		\
+	attr static size_t						\
+	kernel##_ctl(const char *table, char *lastsent,			\
+		     char *dst, const char *src, size_t count)		\
+	{ return kernel(table, lastsent, dst, src, count, 1); }
+
+ZESC_VARIANTS(zesc_unescape_scalar, )
+
+#ifdef ZESC_HAVE_SIMD
+/* Emit a WIDTH byte block of SRC whose candidate bytes are the set
+ * bits of MASK. */
+static inline size_t
+zesc_emit_block(const char *table, char *lastsent, char *dst,
+		const char *src, unsigned width, uint32_t mask)
+{
+	char *o = dst;
+	unsigned pos = 0;
+
+	while (mask) {
+		unsigned n = (unsigned) __builtin_ctz(mask);
+		if (n > pos) {
+			memcpy(o, src + pos, n - pos);
+			o += n - pos;
+			*lastsent = src[n - 1];
+		}
+		o += zesc_put(table, lastsent, o, (unsigned char) src[n]);
+		pos = n + 1;
+		mask &= mask - 1;
+	}
+	if (width > pos) {
+		memcpy(o, src + pos, width - pos);
+		o += width - pos;
+		*lastsent = src[width - 1];
+	}
+	return (size_t) (o - dst);
+}
+
+/* Candidate bytes.  With control character escaping, every byte with
+ * bits 5 and 6 clear; otherwise ZDLE and, with either parity, DLE,
+ * XON, XOFF and CR. */
+__attribute__((target("sse2")))
+ZESC_INLINE uint32_t
+zesc_mask_sse2(__m128i v, int ctl)
+{
+	__m128i m;
+
+	if (ctl)
+		m = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(0x60)),
+				   _mm_setzero_si128());
+	else {
+		__m128i t = _mm_and_si128(v, _mm_set1_epi8(0x7f));
+		m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(t, _mm_set1_epi8(020)),
+				     _mm_cmpeq_epi8(t, _mm_set1_epi8(XON))),
+			_mm_or_si128(_mm_cmpeq_epi8(t, _mm_set1_epi8(XOFF)),
+				     _mm_cmpeq_epi8(t, _mm_set1_epi8(015))));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(ZDLE)));
+	}
+	return (uint32_t) _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+ZESC_INLINE size_t
+zesc_encode_sse2(const char *table, char *lastsent,
+		 char *dst, const char *src, size_t count, int ctl)
+{
+	char *o = dst;
+
+	while (count >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) src);
+		uint32_t mask = zesc_mask_sse2(v, ctl);
+		if (mask == 0) {
+			_mm_storeu_si128((__m128i *) o, v);
+			o += 16;
+			*lastsent = src[15];
+		} else
+			o += zesc_emit_block(table, lastsent, o, src, 16, mask);
+		src += 16;
+		count -= 16;
+	}
+	return (size_t) (o - dst)
+		+ zesc_encode_scalar(table, lastsent, o, src, count);
+}
+
+/* Bytes the receiver must not copy blindly. */
+__attribute__((target("sse2")))
+ZESC_INLINE uint32_t
+zesc_special_sse2(__m128i v, int ctl)
+{
+	__m128i m;
+
+	if (ctl)
+		m = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(0x60)),
+				   _mm_setzero_si128());
+	else {
+		__m128i t = _mm_and_si128(v, _mm_set1_epi8(0x7f));
+		m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(ZDLE)),
+				     _mm_cmpeq_epi8(t, _mm_set1_epi8(XON))),
+			_mm_cmpeq_epi8(t, _mm_set1_epi8(XOFF)));
+	}
+	return (uint32_t) _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+ZESC_INLINE size_t
+zesc_unescape_sse2(char *dst, const char *src, size_t count, int ctl)
+{
+	size_t n = 0;
+
+	while (count - n >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + n));
+		uint32_t mask = zesc_special_sse2(v, ctl);
+		if (mask) {
+			unsigned k = (unsigned) __builtin_ctz(mask);
+			memcpy(dst + n, src + n, k);
+			return n + k;
+		}
+		_mm_storeu_si128((__m128i *) (dst + n), v);
+		n += 16;
+	}
+	return n + zesc_unescape_scalar(dst + n, src + n, count - n, ctl);
+}
+
+__attribute__((target("avx2")))
+ZESC_INLINE uint32_t
+zesc_mask_avx2(__m256i v, int ctl)
+{
+	__m256i m;
+
+	if (ctl)
+		m = _mm256_cmpeq_epi8(_mm256_and_si256(v, _mm256_set1_epi8(0x60)),
+				      _mm256_setzero_si256());
+	else {
+		__m256i t = _mm256_and_si256(v, _mm256_set1_epi8(0x7f));
+		m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(t, _mm256_set1_epi8(020)),
+					_mm256_cmpeq_epi8(t, _mm256_set1_epi8(XON))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(t, _mm256_set1_epi8(XOFF)),
+					_mm256_cmpeq_epi8(t, _mm256_set1_epi8(015))));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(ZDLE)));
+	}
+	return (uint32_t) _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+ZESC_INLINE size_t
+zesc_encode_avx2(const char *table, char *lastsent,
+		 char *dst, const char *src, size_t count, int ctl)
+{
+	char *o = dst;
+
+	while (count >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) src);
+		uint32_t mask = zesc_mask_avx2(v, ctl);
+		if (mask == 0) {
+			_mm256_storeu_si256((__m256i *) o, v);
+			o += 32;
+			*lastsent = src[31];
+		} else
+			o += zesc_emit_block(table, lastsent, o, src, 32, mask);
+		src += 32;
+		count -= 32;
+	}
+	return (size_t) (o - dst)
+		+ zesc_encode_sse2(table, lastsent, o, src, count, ctl);
+}
+
+__attribute__((target("avx2")))
+ZESC_INLINE uint32_t
+zesc_special_avx2(__m256i v, int ctl)
+{
+	__m256i m;
+
+	if (ctl)
+		m = _mm256_cmpeq_epi8(_mm256_and_si256(v, _mm256_set1_epi8(0x60)),
+				      _mm256_setzero_si256());
+	else {
+		__m256i t = _mm256_and_si256(v, _mm256_set1_epi8(0x7f));
+		m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ZDLE)),
+					_mm256_cmpeq_epi8(t, _mm256_set1_epi8(XON))),
+			_mm256_cmpeq_epi8(t, _mm256_set1_epi8(XOFF)));
+	}
+	return (uint32_t) _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+ZESC_INLINE size_t
+zesc_unescape_avx2(char *dst, const char *src, size_t count, int ctl)
+{
+	size_t n = 0;
+
+	while (count - n >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + n));
+		uint32_t mask = zesc_special_avx2(v, ctl);
+		if (mask) {
+			unsigned k = (unsigned) __builtin_ctz(mask);
+			memcpy(dst + n, src + n, k);
+			return n + k;
+		}
+		_mm256_storeu_si256((__m256i *) (dst + n), v);
+		n += 32;
+	}
+	return n + zesc_unescape_sse2(dst + n, src + n, count - n, ctl);
+}
+
+ZESC_ENCODE_VARIANTS(zesc_encode_sse2, __attribute__((target("sse2"))))
+ZESC_ENCODE_VARIANTS(zesc_encode_avx2, __attribute__((target("avx2"))))
+ZESC_VARIANTS(zesc_unescape_sse2, __attribute__((target("sse2"))))
+ZESC_VARIANTS(zesc_unescape_avx2, __attribute__((target("avx2"))))
+#endif
+
+/* Indexed by escape mode: 0 minimal, 1 all control characters.  The
+ * scalar kernels are always correct; zesc_init upgrades them to the
+ * best the CPU supports. */
+static size_t (*zesc_encode_impl[2])(const char *, char *, char *, const char *, size_t) = {
+	zesc_encode_scalar, zesc_encode_scalar
+};
+static size_t (*zesc_unescape_impl[2])(char *, const char *, size_t) = {
+	zesc_unescape_scalar_min, zesc_unescape_scalar_ctl
+};
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void
+zesc_init(void)
+{
+#ifdef ZESC_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		zesc_encode_impl[0] = zesc_encode_avx2_min;
+		zesc_encode_impl[1] = zesc_encode_avx2_ctl;
+		zesc_unescape_impl[0] = zesc_unescape_avx2_min;
+		zesc_unescape_impl[1] = zesc_unescape_avx2_ctl;
+	} else if (__builtin_cpu_supports("sse2")) {
+		zesc_encode_impl[0] = zesc_encode_sse2_min;
+		zesc_encode_impl[1] = zesc_encode_sse2_ctl;
+		zesc_unescape_impl[0] = zesc_unescape_sse2_min;
+		zesc_unescape_impl[1] = zesc_unescape_sse2_ctl;
+	}
+#endif
+}
+
+size_t
+zm_escape_encode(const char *table, int zctlesc, char *lastsent,
+		 char *dst, const char *src, size_t count)
+{
+	return zesc_encode_impl[zctlesc != 0](table, lastsent, dst, src, count);
+}
+
+size_t
+zm_unescape_span(char *dst, const char *src, size_t count, int zctlesc)
+{
+	return zesc_unescape_impl[zctlesc != 0](dst, src, count);
+}
+
+/* End of zescape.c */
@@ -0,0 +1,24 @@
+#ifndef LIBZMODEM_ZESCAPE_H
+#define LIBZMODEM_ZESCAPE_H
+
+#include <stddef.h>
+
+/* Worst case output size for COUNT input bytes: every byte escaped. */
+#define ZM_ESCAPE_MAX(count) (2 * (count))
+
+/* ZDLE-encode COUNT bytes of SRC into DST, which must hold at least
+   ZM_ESCAPE_MAX(COUNT) bytes, and return the number of bytes stored.
+   TABLE is a zm_t escape_sequence_table and ZCTLESC the mode it was
+   built for.  *LASTSENT is the previous byte put on the wire, for the
+   '@'-CR rule; it is updated to the last byte stored, so consecutive
+   calls encode as one stream. */
+size_t zm_escape_encode(const char *table, int zctlesc, char *lastsent,
+			char *dst, const char *src, size_t count);
+
+/* Copy bytes from SRC to DST, at most COUNT, up to the first one that
+   the receiver cannot take literally: ZDLE, XON or XOFF in either
+   parity, or with ZCTLESC any control character.  Returns the number
+   of bytes copied; DST must hold COUNT bytes. */
+size_t zm_unescape_span(char *dst, const char *src, size_t count, int zctlesc);
+
+#endif
@@ -162,9 +162,14 @@ extern int Fromcu;
 extern int iofd;
 
 /* rbsb.c */
+typedef struct {
+	int saved;		/* oldtty holds the mode to restore */
+	struct termios oldtty;
+} io_mode_t;
+
 int from_cu (void) LRZSZ_ATTRIB_SECTION(lrzsz_rare);
 int rdchk (int fd);
-int io_mode (int fd, int n) LRZSZ_ATTRIB_SECTION(lrzsz_rare);
+int io_mode (io_mode_t *st, int fd, int n) LRZSZ_ATTRIB_SECTION(lrzsz_rare);
 void sendbrk (int fd);
 
 
@@ -37,9 +37,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include "log.h"
 #include "crctab.h"
 #include "zm.h"
+#include "zescape.h"
 
 /* Globals used by ZMODEM functions */
 long Txpos;		/* Transmitted file position */
@@ -49,6 +52,14 @@ int bytes_per_error=0;
 
 #define ISPRINT(x) ((unsigned)(x) & 0x60u)
 
+/* For the data subpacket loops, which are instantiated once per CRC
+ * width and escape mode with those passed as constants. */
+#ifdef __GNUC__
+#define ZM_INLINE static inline __attribute__((always_inline))
+#else
+#define ZM_INLINE static inline
+#endif
+
 static const char *frametypes[] = {
 	"Carrier Lost",		/* -3 */
 	"TIMEOUT",		/* -2 */
@@ -74,6 +85,8 @@ static const char *frametypes[] = {
 	"ZFREECNT",
 	"ZCOMMAND",
 	"ZSTDERR",
+	"ZSACK",
+	"ZFEC",
 	"xxxxx"
 #define FRTYPES 22	/* Total number of frame types in this array */
 			/*  not including psuedo negative entries */
@@ -83,36 +96,198 @@ static const char *frametypes[] = {
 /* static char *badcrc = "Bad CRC"; */
 static int zm_get_ascii_char (zm_t *zm);
 static int zm_get_escaped_char (zm_t *zm);
-static int zm_get_escaped_char_internal (zm_t *zm, int);
+static int zm_get_escaped_char_internal (zm_t *zm, int, int ctl);
 static int zm_get_hex_encoded_byte (zm_t *zm);
 static void zputhex (int c, char *pos);
 static int zm_read_binary_header (zm_t *zm);
 static int zm_read_binary_header32 (zm_t *zm);
 static int zm_read_hex_header (zm_t *zm);
-static int zm_read_data32 (zm_t *zm, char *buf, int length, size_t *);
 static void zm_send_binary_header32 (zm_t *zm, int type);
 static void zm_escape_sequence_init (zm_t *zm);
-static void zm_put_escaped_string(zm_t *zm, const char *str, size_t len);
 
 
-/* Return a newly allocated state machine for zm primitives. */
+/*
+ * Receive framing state machines.  Each is a transition table indexed
+ * by state and byte class, with one table per zctlesc mode, all built
+ * at compile time.  A transition is the next state in the high nibble
+ * and an action in the low nibble.
+ */
+#define ZT(state, action) ((unsigned char) (((state) << 4) | (action)))
+#define ZT_STATE(t) ((t) >> 4)
+#define ZT_ACTION(t) ((t) & 0xF)
+
+/* Escape decoder byte classes. */
+enum {
+	ZC_LIT,			/* printable, not valid after ZDLE */
+	ZC_UPPER,		/* bit 6 set, bit 5 reset: ZDLE escapable */
+	ZC_FRAMEEND,		/* ZCRCE, ZCRCG, ZCRCQ, ZCRCW */
+	ZC_RUB0,
+	ZC_RUB1,
+	ZC_ZDLE,		/* ZDLE, which is also CAN */
+	ZC_FLOW,		/* XON, XOFF, either parity */
+	ZC_CTRL,		/* any other control character */
+	ZC_NCLASS
+};
+#define ZC_CLASS(b) \
+	((b) == ZDLE ? ZC_ZDLE \
+	 : ((b) & 0x7f) == XON || ((b) & 0x7f) == XOFF ? ZC_FLOW \
+	 : ((b) & 0x60) == 0 ? ZC_CTRL \
+	 : (b) >= ZCRCE && (b) <= ZCRCW ? ZC_FRAMEEND \
+	 : (b) == ZRUB0 ? ZC_RUB0 \
+	 : (b) == ZRUB1 ? ZC_RUB1 \
+	 : ((b) & 0x60) == 0x40 ? ZC_UPPER : ZC_LIT)
+#define ZC_CLASS4(b) ZC_CLASS(b), ZC_CLASS(b+1), ZC_CLASS(b+2), ZC_CLASS(b+3)
+#define ZC_CLASS16(b) ZC_CLASS4(b), ZC_CLASS4(b+4), ZC_CLASS4(b+8), ZC_CLASS4(b+12)
+#define ZC_CLASS64(b) ZC_CLASS16(b), ZC_CLASS16(b+16), ZC_CLASS16(b+32), ZC_CLASS16(b+48)
+static const unsigned char zm_escape_class[256] = {
+	ZC_CLASS64(0), ZC_CLASS64(64), ZC_CLASS64(128), ZC_CLASS64(192)
+};
+
+/* Escape decoder states: plain data, after ZDLE, and after ZDLE
+ * followed by 1 to 3 CANs. */
+enum { ZS_DATA, ZS_ESC, ZS_CAN1, ZS_CAN2, ZS_CAN3, ZS_NSTATE };
+enum {
+	ZA_SKIP,		/* read the next byte */
+	ZA_EMIT,		/* return the byte */
+	ZA_EMIT_XOR,		/* return the byte with bit 6 inverted */
+	ZA_FRAMEEND,		/* return GOTCRCx */
+	ZA_RUB0,		/* return 0177 */
+	ZA_RUB1,		/* return 0377 */
+	ZA_GOTCAN,		/* five CANs: return GOTCAN */
+	ZA_ERROR		/* bad escape sequence */
+};
+/* Spec 7.2: The receiver ignores XON and XOFF in the data stream, and
+ * any control character when control characters are escaped.  ZDLE
+ * followed by a byte with bit 6 set and bit 5 reset decodes to that
+ * byte with bit 6 inverted.  Five CANs (the ZDLE counting as the
+ * first) abort the session. */
+#define ZS_ESC_ROW(ctl, on_zdle) { \
+	ZT(ZS_DATA, ZA_ERROR), ZT(ZS_DATA, ZA_EMIT_XOR), \
+	ZT(ZS_DATA, ZA_FRAMEEND), ZT(ZS_DATA, ZA_RUB0), ZT(ZS_DATA, ZA_RUB1), \
+	on_zdle, ZT(ZS_ESC, ZA_SKIP), \
+	(ctl) ? ZT(ZS_ESC, ZA_SKIP) : ZT(ZS_DATA, ZA_ERROR) }
+#define ZS_DFA(ctl) { \
+	{ ZT(ZS_DATA, ZA_EMIT), ZT(ZS_DATA, ZA_EMIT), ZT(ZS_DATA, ZA_EMIT), \
+	  ZT(ZS_DATA, ZA_EMIT), ZT(ZS_DATA, ZA_EMIT), ZT(ZS_ESC, ZA_SKIP), \
+	  ZT(ZS_DATA, ZA_SKIP), \
+	  (ctl) ? ZT(ZS_DATA, ZA_SKIP) : ZT(ZS_DATA, ZA_EMIT) }, \
+	ZS_ESC_ROW(ctl, ZT(ZS_CAN1, ZA_SKIP)), \
+	ZS_ESC_ROW(ctl, ZT(ZS_CAN2, ZA_SKIP)), \
+	ZS_ESC_ROW(ctl, ZT(ZS_CAN3, ZA_SKIP)), \
+	ZS_ESC_ROW(ctl, ZT(ZS_DATA, ZA_GOTCAN)) }
+static const unsigned char zm_escape_dfa[2][ZS_NSTATE][ZC_NCLASS] = {
+	ZS_DFA(0), ZS_DFA(1)
+};
+
+/* Header preamble byte classes. */
+enum {
+	HC_OTHER,
+	HC_ZPAD,		/* ZPAD, either parity */
+	HC_CAN,			/* CAN, which is also ZDLE */
+	HC_ZBIN,
+	HC_ZBIN32,
+	HC_ZHEX,
+	HC_ZCRCW,
+	HC_FLOW,		/* XON, XOFF, either parity */
+	HC_CRLF,		/* CR, LF */
+	HC_CTRL,		/* any other control character */
+	HC_NCLASS
+};
+#define HC_CLASS(b) \
+	((b) == ZPAD || (b) == (ZPAD|0x80) ? HC_ZPAD \
+	 : (b) == CAN ? HC_CAN \
+	 : (b) == ZBIN ? HC_ZBIN \
+	 : (b) == ZBIN32 ? HC_ZBIN32 \
+	 : (b) == ZHEX ? HC_ZHEX \
+	 : (b) == ZCRCW ? HC_ZCRCW \
+	 : ((b) & 0x7f) == XON || ((b) & 0x7f) == XOFF ? HC_FLOW \
+	 : (b) == '\r' || (b) == '\n' ? HC_CRLF \
+	 : ((b) & 0x60) == 0 ? HC_CTRL : HC_OTHER)
+#define HC_CLASS4(b) HC_CLASS(b), HC_CLASS(b+1), HC_CLASS(b+2), HC_CLASS(b+3)
+#define HC_CLASS16(b) HC_CLASS4(b), HC_CLASS4(b+4), HC_CLASS4(b+8), HC_CLASS4(b+12)
+#define HC_CLASS64(b) HC_CLASS16(b), HC_CLASS16(b+16), HC_CLASS16(b+32), HC_CLASS16(b+48)
+static const unsigned char zm_header_class[256] = {
+	HC_CLASS64(0), HC_CLASS64(64), HC_CLASS64(128), HC_CLASS64(192)
+};
+
+/* Header preamble states: hunting for ZPAD, after ZPAD, after ZPAD
+ * ZDLE, and after a CAN.  HS_PAD and HS_DLE look at bytes with the
+ * parity bit stripped, as zm_get_ascii_char does. */
+enum { HS_START, HS_PAD, HS_DLE, HS_CANWAIT, HS_NSTATE };
+enum {
+	HA_INTRO,		/* not a header: keep the byte, start over */
+	HA_SKIP,		/* read the next byte */
+	HA_PAD,			/* got the first ZPAD */
+	HA_CAN,			/* count a CAN */
+	HA_ERROR,		/* CAN ZCRCW: return ERROR */
+	HA_ZBIN,
+	HA_ZBIN32,
+	HA_ZHEX
+};
+/* Spec 7.3: A binary header begins with ZPAD, ZDLE, ZBIN, a 32 bit
+ * CRC binary header with ZPAD, ZDLE, ZBIN32 and a hex header with
+ * ZPAD, ZPAD, ZDLE, ZHEX.  Entries left out are zero, which is
+ * ZT(HS_START, HA_INTRO). */
+#define HS_DFA(ctl) { \
+	{ [HC_ZPAD] = ZT(HS_PAD, HA_PAD), \
+	  [HC_CAN] = ZT(HS_CANWAIT, HA_CAN) }, \
+	{ [HC_ZPAD] = ZT(HS_PAD, HA_SKIP), \
+	  [HC_CAN] = ZT(HS_DLE, HA_SKIP), \
+	  [HC_FLOW] = ZT(HS_PAD, HA_SKIP), \
+	  [HC_CTRL] = (ctl) ? ZT(HS_PAD, HA_SKIP) : ZT(HS_START, HA_INTRO) }, \
+	{ [HC_CAN] = ZT(HS_CANWAIT, HA_CAN), \
+	  [HC_ZBIN] = ZT(HS_START, HA_ZBIN), \
+	  [HC_ZBIN32] = ZT(HS_START, HA_ZBIN32), \
+	  [HC_ZHEX] = ZT(HS_START, HA_ZHEX), \
+	  [HC_FLOW] = ZT(HS_DLE, HA_SKIP), \
+	  [HC_CTRL] = (ctl) ? ZT(HS_DLE, HA_SKIP) : ZT(HS_START, HA_INTRO) }, \
+	{ [HC_CAN] = ZT(HS_START, HA_CAN), \
+	  [HC_ZCRCW] = ZT(HS_START, HA_ERROR) } }
+static const unsigned char zm_header_dfa[2][HS_NSTATE][HC_NCLASS] = {
+	HS_DFA(0), HS_DFA(1)
+};
+
+/* Size of the per-session wire output buffer.  It holds at least one
+   encoded send block, so a subpacket can be encoded in place. */
+#define ZM_OUTBUF_SIZE 16384
+
+/* Return a newly allocated state machine for zm primitives, or NULL
+   if out of memory. */
 zm_t *
-zm_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
+zm_init(zmodem_transport_t *tp, size_t readnum, size_t bufsize, int no_timeout,
 	int rxtimeout, int znulls, int eflag, int baudrate, int zctlesc, int zrwindow)
 {
-	zm_t *zm = (zm_t *) malloc (sizeof (zm_t));
-	memset(zm, 0, sizeof(zm_t));
-	zm->zr = zreadline_init(fd, readnum, bufsize, no_timeout);
+	zm_t *zm = (zm_t *) calloc (1, sizeof (zm_t));
+	if (!zm)
+		return NULL;
+	zm->tp = tp;
+	zm->zr = zreadline_init(tp, readnum, bufsize, no_timeout);
 	zm->rxtimeout = rxtimeout;
 	zm->znulls = znulls;
 	zm->eflag = eflag;
 	zm->baudrate = baudrate;
 	zm->zctlesc = zctlesc;
 	zm->zrwindow = zrwindow;
+	zm->outsize = ZM_OUTBUF_SIZE;
+	zm->outbuf = (char *) malloc (zm->outsize);
+	if (!zm->zr || !zm->outbuf) {
+		zm_free(zm);
+		return NULL;
+	}
 	zm_escape_sequence_init(zm);
 	return zm;
 }
 
+/* Release the state machine.  The transport belongs to the caller. */
+void
+zm_free(zm_t *zm)
+{
+	if (zm->zr)
+		zreadline_free(zm->zr);
+	free(zm->outbuf);
+	free(zm);
+}
+
 int
 zm_get_zctlesc(zm_t *zm)
 {
@@ -123,6 +298,7 @@ void
 zm_set_zctlesc(zm_t *zm, int x)
 {
 	zm->zctlesc = x;
+	zm_select_data_loops(zm);
 }
 
 void
@@ -130,6 +306,111 @@ zm_escape_sequence_update(zm_t *zm)
 {
 	zm_escape_sequence_init(zm);
 }
+
+/*
+ * Wire output.  Everything the ZMODEM layer sends goes into
+ * zm->outbuf and reaches the transport only when zm_flush is
+ * called or the buffer fills.  Headers the peer has to answer and
+ * ZCRCQ/ZCRCW subpackets flush, so a streamed ZCRCG run goes out
+ * in a few large writes instead of one stdio call per byte.
+ */
+
+/* Write iovcnt buffers to the wire, retrying partial writes and
+   interrupted calls. */
+static void
+zm_writev(zm_t *zm, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n = zm->tp->writev(zm->tp->ctx, iov, iovcnt);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_error("zm_writev: %s", strerror(errno));
+			return;
+		}
+		zm->tx_writes++;
+		zm->tx_bytes += (unsigned long) n;
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= (ssize_t) iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= (size_t) n;
+		}
+	}
+}
+
+/* Send everything buffered so far. */
+void
+zm_flush(zm_t *zm)
+{
+	struct iovec iov;
+
+	if (zm->outlen == 0)
+		return;
+	iov.iov_base = zm->outbuf;
+	iov.iov_len = zm->outlen;
+	zm->outlen = 0;
+	zm_writev(zm, &iov, 1);
+	if (zm->tp->flush)
+		zm->tp->flush(zm->tp->ctx);
+}
+
+/* Send the cancel string to get the other end to shut up, throwing
+   away whatever it has sent us. */
+void
+zm_canit(zm_t *zm)
+{
+	static const char canistr[] = {
+		24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8
+	};
+
+	zreadline_flushline(zm->zr);
+	zm_put(zm, canistr, sizeof(canistr));
+	zm_flush(zm);
+}
+
+/* Queue one raw byte and send it with everything before it. */
+void
+zm_send_byte(zm_t *zm, int c)
+{
+	char b = (char) c;
+
+	zm_put(zm, &b, 1);
+	zm_flush(zm);
+}
+
+/* Queue len raw bytes of s.  An image too large for the free space
+   goes out together with what is already buffered in one writev. */
+void
+zm_put(zm_t *zm, const char *s, size_t len)
+{
+	struct iovec iov[2];
+
+	if (len <= zm->outsize - zm->outlen) {
+		memcpy(zm->outbuf + zm->outlen, s, len);
+		zm->outlen += len;
+		return;
+	}
+	iov[0].iov_base = zm->outbuf;
+	iov[0].iov_len = zm->outlen;
+	iov[1].iov_base = (void *) s;
+	iov[1].iov_len = len;
+	zm->outlen = 0;
+	zm_writev(zm, iov, 2);
+}
+
+/* Queue one raw byte. */
+ZM_INLINE void
+zm_putc(zm_t *zm, int c)
+{
+	if (zm->outlen == zm->outsize)
+		zm_flush(zm);
+	zm->outbuf[zm->outlen++] = (char) c;
+}
 /*
  * Read a character from the modem line with timeout.
  *  Eat parity, XON and XOFF characters.
@@ -184,99 +465,93 @@ zm_get_hex_encoded_byte(zm_t *zm)
 
 /*
  * Read a byte, checking for ZMODEM escape encoding
- *  including CAN*5 which represents a quick abort
+ *  including CAN*5 which represents a quick abort.
+ *  CTL is the receive escape mode, a constant in the data loops.
  */
-static inline int
-zm_get_escaped_char(zm_t *zm)
+ZM_INLINE int
+zm_get_escaped_char_mode(zm_t *zm, int ctl)
 {
-	int c = zreadline_getc(zm->zr, zm->rxtimeout);
+	zreadline_t *zr = zm->zr;
+	int c;
+
+	if (zr->readline_left > 0) {
+		zr->readline_left--;
+		c = (unsigned char) *zr->readline_ptr++;
+	} else
+		c = zreadline_getc(zr, zm->rxtimeout);
 
 	/* Quick check for non control characters */
 	if (ISPRINT(c))
 		return c;
-	return zm_get_escaped_char_internal(zm, c);
+	return zm_get_escaped_char_internal(zm, c, ctl);
 }
 
-static int
-zm_get_escaped_char_internal(zm_t *zm, int c)
+/*
+ * Read a byte, checking for ZMODEM escape encoding
+ *  including CAN*5 which represents a quick abort
+ */
+static inline int
+zm_get_escaped_char(zm_t *zm)
 {
-	goto jump_over; /* bad style */
+	return zm_get_escaped_char_mode(zm, zm->zctlesc != 0);
+}
 
-again:
-	/* Quick check for non control characters */
-	c = zreadline_getc(zm->zr, zm->rxtimeout);
-	if (ISPRINT(c))
-		return c;
-jump_over:
-	switch (c) {
-	  /* Spec 7.2: ZDLE represents a control sequence of some
-	     sort. */
-	case ZDLE:
-		break;
+/*
+ * Copy the bytes already buffered by zreadline that need no decoding
+ * straight to buf, at most max of them, stopping at the first byte
+ * that has to go through zm_get_escaped_char.  Returns the number of
+ * bytes copied.
+ */
+ZM_INLINE size_t
+zm_get_clean_span(zm_t *zm, char *buf, size_t max, int ctl)
+{
+	zreadline_t *zr = zm->zr;
+	size_t n;
 
-	/* Spec 7.2: The receiver ignores 021 (ASCII XON), 0221, 023
-	 * (ASCII XOFF), and 0223 characters in the data stream. */
-	case XON:
-	case (XON|0x80):
-	case XOFF:
-	case (XOFF|0x80):
-		goto again;
-	default:
-		if (zm->zctlesc && !ISPRINT(c)) {
-			goto again;
-		}
-		return c;
-	}
-again2:
-	/* We only end up here if the previous char was ZDLE.
-	 * We are in a control sequence. */
-	
-	if ((c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
-		return c;
+	if (zr->readline_left <= 0)
+		return 0;
+	n = (size_t) zr->readline_left < max ? (size_t) zr->readline_left : max;
+	n = zm_unescape_span(buf, zr->readline_ptr, n, ctl);
+	zr->readline_ptr += n;
+	zr->readline_left -= (int) n;
+	return n;
+}
 
-	/* Spec 7.2: Receipt of five successive CAN characters will
-	 * abort a ZMODEM session. [Note that ZDLE is also CAN, so the
-	 * ZDLE counts as the 1st CAN character, so we only need 4
-	 * CAN's.] */
-	if (c == CAN && (c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
-		return c;
-	if (c == CAN && (c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
-		return c;
-	if (c == CAN && (c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
-		return c;
-	switch (c) {
-	case CAN:
-		return GOTCAN;
-	case ZCRCE:
-	case ZCRCG:
-	case ZCRCQ:
-	case ZCRCW:
-		return (c | GOTOR);
-	case ZRUB0:
-		return 0x7F;
-	case ZRUB1:
-		return 0xFF;
-	/* Spec 7.2: The receiver ignores 021 (ASCII XON), 0221, 023
-	 * (ASCII XOFF), and 0223 characters in the data stream. */
-	case XON:
-	case (XON|0x80):
-	case XOFF:
-	case (XOFF|0x80):
-		goto again2;
-	default:
-		if (zm->zctlesc && ! ISPRINT(c)) {
-			goto again2;
+static int
+zm_get_escaped_char_internal(zm_t *zm, int c, int ctl)
+{
+	const unsigned char (*dfa)[ZC_NCLASS] = zm_escape_dfa[ctl];
+	zreadline_t *zr = zm->zr;
+	unsigned int state = ZS_DATA;
+
+	for (;;) {
+		unsigned int t = dfa[state][zm_escape_class[c]];
+
+		switch (ZT_ACTION(t)) {
+		case ZA_EMIT:
+			return c;
+		case ZA_EMIT_XOR:
+			return c ^ 0100;
+		case ZA_FRAMEEND:
+			return c | GOTOR;
+		case ZA_RUB0:
+			return 0x7F;
+		case ZA_RUB1:
+			return 0xFF;
+		case ZA_GOTCAN:
+			return GOTCAN;
+		case ZA_ERROR:
+			log_debug(_("Bad escape sequence %x"), c);
+			return ERROR;
 		}
-		/* Spec 7.2: The receiving program decodes any sequence
-		 * of ZDLE followed by a byte with bit 6 set and bit 5 reset
-		 * (uppercase letter, either parity) to the equivalent control
-		 * character by inverting bit 6 */
-		if ((c & 0b01100000) ==  0b01000000)
-			return (c ^ 0b01000000);
-		break;
+		state = ZT_STATE(t);
+		/* The byte after a ZDLE is nearly always buffered. */
+		if (zr->readline_left > 0) {
+			zr->readline_left--;
+			c = (unsigned char) *zr->readline_ptr++;
+		} else if ((c = zreadline_getc(zr, zm->rxtimeout)) < 0)
+			return c;
 	}
-	log_debug(_("Bad escape sequence %x"), c);
-	return ERROR;
 }
 
 
@@ -292,75 +567,68 @@ zm_put_escaped_char(zm_t *zm, int c)
 	switch(zm->escape_sequence_table[(unsigned) (c&=0xFF)])
 	{
 	case ZM_ESCAPE_NEVER:
-		putchar(zm->lastsent = c);
+		zm_putc(zm, zm->lastsent = c);
 		break;
 	case ZM_ESCAPE_ALWAYS:
-		putchar(ZDLE);
+		zm_putc(zm, ZDLE);
 		/* Spec 7.2: The receiving program decodes any sequence
 		 * of ZDLE followed by a byte with bit 6 set and bit 5 reset
 		 * (uppercase letter, either parity) to the equivalent control
 		 * character by inverting bit 6 */
 		c ^= 0100;
-		putchar(zm->lastsent = c);
+		zm_putc(zm, zm->lastsent = c);
 		break;
 	case ZM_ESCAPE_AFTER_AMPERSAND:
 		if ((zm->lastsent & 0x7F) != '@') {
-			putchar(zm->lastsent = c);
+			zm_putc(zm, zm->lastsent = c);
 		} else {
-			putchar(ZDLE);
+			zm_putc(zm, ZDLE);
 		/* Spec 7.2: The receiving program decodes any sequence
 		 * of ZDLE followed by a byte with bit 6 set and bit 5 reset
 		 * (uppercase letter, either parity) to the equivalent control
 		 * character by inverting bit 6 */
 			c ^= 0100;
-			putchar(zm->lastsent = c);
+			zm_putc(zm, zm->lastsent = c);
 		}
 		break;
 	}
 }
 
-static void
-zm_put_escaped_string (zm_t *zm, const char *s, size_t count)
+/* Run len bytes of buf through a CRC-32 or CRC-16 register. */
+ZM_INLINE uint32_t
+zm_crc_update(uint32_t crc, const void *buf, size_t len, int crc32)
 {
-	const char *end=s+count;
-	while(s!=end) {
-		int last_esc=0;
-		const char *t=s;
-		while (t!=end) {
-			last_esc = zm->escape_sequence_table[(unsigned) ((*t) & 0xFF)];
-			if (last_esc)
-				break;
-			t++;
-		}
-		if (t!=s) {
-			fwrite(s,(size_t)(t-s),1,stdout);
-			zm->lastsent=t[-1];
-			s=t;
-		}
-		if (last_esc) {
-			int c=*s;
-			switch(last_esc) {
-			case 0:
-				putchar(zm->lastsent = c);
-				break;
-			case 1:
-				putchar(ZDLE);
-				c ^= 0100;
-				putchar(zm->lastsent = c);
-				break;
-			case 2:
-				if ((zm->lastsent & 0x7F) != '@') {
-					putchar(zm->lastsent = c);
-				} else {
-					putchar(ZDLE);
-					c ^= 0100;
-					putchar(zm->lastsent = c);
-				}
-				break;
-			}
-			s++;
-		}
+	if (crc32)
+		return crc32_update(crc, buf, len);
+	return crc16_update((uint16_t) crc, buf, len);
+}
+
+/*
+ * Send count bytes of s ZDLE-encoded, running them through the data
+ * subpacket CRC (CRC-32 if crc32, else CRC-16) in the same pass.
+ * The data is taken in blocks that stay in cache between the CRC and
+ * the encoder, so a large buffer such as an mmap'ed file is only
+ * pulled from memory once.  Each block is encoded straight into the
+ * output buffer.  Returns the updated CRC register.
+ */
+#define ZM_SEND_BLOCK 1024
+ZM_INLINE uint32_t
+zm_put_escaped_string_crc (zm_t *zm, const char *s, size_t count,
+			   uint32_t crc, int crc32, int ctl)
+{
+	while (count > 0) {
+		size_t n = count < ZM_SEND_BLOCK ? count : ZM_SEND_BLOCK;
+
+		if (zm->outsize - zm->outlen < ZM_ESCAPE_MAX(n))
+			zm_flush(zm);
+		crc = zm_crc_update(crc, s, n, crc32);
+		zm->outlen += zm_escape_encode(zm->escape_sequence_table, ctl,
+					       &zm->lastsent,
+					       zm->outbuf + zm->outlen, s, n);
+		s += n;
+		count -= n;
 	}
+	return crc;
 }
 
 
@@ -369,39 +637,41 @@ void
 zm_send_binary_header(zm_t *zm, int type)
 {
 	register unsigned short crc;
+	unsigned char hdr[5];
 
 	log_trace("zm_send_binary_header: %s %lx", frametypes[type+FTOFFSET], zm_reclaim_send_header(zm));
 	if (type == ZDATA)
 		for (int n = 0; n < zm->znulls; n ++)
-			putchar(0);
+			zm_putc(zm, 0);
 
-	putchar(ZPAD);
-	putchar(ZDLE);
+	zm_putc(zm, ZPAD);
+	zm_putc(zm, ZDLE);
 
 	zm->crc32t = zm->txfcs32;
+	zm_select_data_loops(zm);
 	if (zm->crc32t)
 		zm_send_binary_header32(zm, type);
 	else {
 		/* Spec 7.3.1. A binary header begins with the sequence
 		   ZPAD, ZDLE, ZBIN. */
-		putchar(ZBIN);
+		zm_putc(zm, ZBIN);
 		/* .. The frame type byte is ZDLE encoded. */
 		zm_put_escaped_char(zm, type);
-		crc = updcrc(type, 0);
+		hdr[0] = type;
 
 		/* Then, the 4-byte flags or file position value. */
 		for (int n = 0; n < 4; n ++) {
 			zm_put_escaped_char(zm, zm->Txhdr[n]);
-			crc = updcrc((0xFF & zm->Txhdr[n]), crc);
+			hdr[n + 1] = zm->Txhdr[n];
 		}
-		crc = updcrc(0,updcrc(0,crc));
+		crc = crc16_update(0, hdr, 5);
 		
 		/* Then two bytes of CRC. */
 		zm_put_escaped_char(zm, crc>>8);
 		zm_put_escaped_char(zm, crc);
 	}
 	if (type != ZDATA)
-		fflush(stdout);
+		zm_flush(zm);
 }
 
 
@@ -409,25 +679,24 @@ zm_send_binary_header(zm_t *zm, int type)
 static void
 zm_send_binary_header32(zm_t *zm, int type)
 {
-	 unsigned long crc;
+	 uint32_t crc;
+	 unsigned char hdr[5];
 
 	 /* Spec 7.3.2. A "32 bit CRC" binary header is similar to
 	  * a binary header, except the ZBIN character is replaced by a ZBIN32
 	  * character. */
-	putchar(ZBIN32);
+	zm_putc(zm, ZBIN32);
 
 	/* Put the type. */
 	zm_put_escaped_char(zm, type);
 
-	crc = 0xFFFFFFFFL;
-	crc = UPDC32(type, crc);
-
 	/* Then, four bytes of flags or file position */
+	hdr[0] = type;
 	for (int n = 0; n < 4; n++) {
-		crc = UPDC32((0xFF & zm->Txhdr[n]), crc);
+		hdr[n + 1] = zm->Txhdr[n];
 		zm_put_escaped_char(zm, zm->Txhdr[n]);
 	}
-	crc = ~crc;
+	crc = ~crc32_update(0xFFFFFFFFL, hdr, 5);
 
 	/* Then, four bytes of CRC. */
 	for (int n = 0; n < 4; n++) {
@@ -441,6 +710,7 @@ void
 zm_send_hex_header(zm_t *zm, int type)
 {
 	register unsigned short crc;
+	unsigned char hdr[5];
 	char s[30];
 	size_t len;
 
@@ -455,17 +725,18 @@ zm_send_hex_header(zm_t *zm, int type)
 	zputhex(type & 0x7f ,s+4);
 	len=6;
 	zm->crc32t = 0;
+	zm_select_data_loops(zm);
 
 	/* Spec 7.3.3.  The type byte, the four position/flag bytes,
 	 * and the 16-bit CRC thereof are sent in hex using 
 	 * lower-case hex. */
-	crc = updcrc((type & 0x7f), 0);
+	hdr[0] = type & 0x7f;
 	for (int n = 0; n < 4; n++) {
 		zputhex(zm->Txhdr[n], s+len);
 		len += 2;
-		crc = updcrc((0xFF & zm->Txhdr[n]), crc);
+		hdr[n + 1] = zm->Txhdr[n];
 	}
-	crc = updcrc(0,updcrc(0,crc));
+	crc = crc16_update(0, hdr, 5);
 	zputhex(crc>>8,s+len);
 	zputhex(crc,s+len+2);
 	len+=4;
@@ -485,69 +756,107 @@ zm_send_hex_header(zm_t *zm, int type)
 	{
 		s[len++]=021;
 	}
-	fflush(stdout);
-	write(1,s,len);
+	zm_put(zm, s, len);
+	zm_flush(zm);
+}
+
+static const char *Zendnames[] = { "ZCRCE", "ZCRCG", "ZCRCQ", "ZCRCW"};
+
+/* End a data subpacket whose payload has been sent: the ZDLE
+ * frameend sequence, and the CRC, which crc holds so far. */
+ZM_INLINE void
+zm_send_data_trailer(zm_t *zm, uint32_t crc, int frameend, int crc32)
+{
+	unsigned char fe = frameend;
+
+	zm_putc(zm, ZDLE);
+	zm_putc(zm, frameend);
+	crc = zm_crc_update(crc, &fe, 1, crc32);
+	if (crc32) {
+		crc = ~crc;
+		for (int i = 0; i < 4; i ++) {
+			int c = (int) crc;
+			if (c & 0140)
+				zm_putc(zm, zm->lastsent = c);
+			else
+				zm_put_escaped_char(zm, c);
+			crc >>= 8;
+		}
+	} else {
+		zm_put_escaped_char(zm, (int) (crc >> 8));
+		zm_put_escaped_char(zm, (int) crc);
+	}
+	/* Only a ZCRCG subpacket is followed by more data: anything else
+	 * ends the frame or asks for a ZACK, so push it out. */
+	if (frameend == ZCRCW)
+		zm_putc(zm, XON);
+	if (frameend != ZCRCG)
+		zm_flush(zm);
 }
 
 /*
- * Send binary array buf of length length, with ending ZDLE sequence frameend
+ * Send binary array buf of length length, with ending ZDLE sequence
+ * frameend and a 32 bit CRC if crc32, else a 16 bit one.  ctl is the
+ * mode the escape table was built for.
  */
-static const char *Zendnames[] = { "ZCRCE", "ZCRCG", "ZCRCQ", "ZCRCW"};
-void
-zm_send_data(zm_t *zm, const char *buf, size_t length, int frameend)
+ZM_INLINE void
+zm_send_data_mode(zm_t *zm, const char *buf, size_t length, int frameend,
+		  int crc32, int ctl)
 {
-	register unsigned short crc;
+	uint32_t crc;
 
-	log_trace("zm_send_data: %lu %s", (unsigned long) length,
-		Zendnames[(frameend-ZCRCE)&3]);
-	crc = 0;
-	for (size_t i = 0; i < length; i++) {
-		zm_put_escaped_char(zm, buf[i]);
-		crc = updcrc((0xFF & buf[i]), crc);
-	}
-	putchar(ZDLE);
-	putchar(frameend);
-	crc = updcrc(frameend, crc);
-
-	crc = updcrc(0,updcrc(0,crc));
-	zm_put_escaped_char(zm, crc>>8);
-	zm_put_escaped_char(zm, crc);
-	if (frameend == ZCRCW) {
-		putchar(XON);
-		fflush(stdout);
+	log_trace("zm_send_data%s: %zu %s", crc32 ? "32" : "", length,
+		  Zendnames[(frameend-ZCRCE)&3]);
+	crc = zm_put_escaped_string_crc(zm, buf, length,
+					crc32 ? 0xFFFFFFFFL : 0, crc32, ctl);
+	zm_send_data_trailer(zm, crc, frameend, crc32);
+}
+
+/*
+ * Encode the count bytes of src as a data subpacket payload into dst,
+ * which must hold ZM_ESCAPE_MAX(count) bytes, for a sender that
+ * prepares subpackets ahead of time.  table and ctl are a snapshot of
+ * the escape table and the mode it was built for.  The byte sent
+ * before the payload is not known yet, so a leading CR is escaped as
+ * if it followed '@'.  The CRC register over the payload is stored in
+ * *crc; the encoded length is returned.
+ */
+size_t
+zm_encode_data(const char *table, int ctl, int crc32, char *dst,
+	       const char *src, size_t count, uint32_t *crc)
+{
+	uint32_t c = crc32 ? 0xFFFFFFFFL : 0;
+	char lastsent = '@';
+	size_t len = 0;
+
+	while (count > 0) {
+		size_t n = count < ZM_SEND_BLOCK ? count : ZM_SEND_BLOCK;
+
+		c = zm_crc_update(c, src, n, crc32);
+		len += zm_escape_encode(table, ctl, &lastsent, dst + len,
+					src, n);
+		src += n;
+		count -= n;
 	}
+	*crc = c;
+	return len;
 }
 
+/*
+ * Send a data subpacket whose payload zm_encode_data prepared: the
+ * len bytes of image, with crc the register it returned.  The CRC
+ * width must be the one of the last binary header sent.
+ */
 void
-zm_send_data32(zm_t *zm, const char *buf, size_t length, int frameend)
+zm_send_encoded_data(zm_t *zm, const char *image, size_t len, uint32_t crc,
+		     int frameend)
 {
-	int c;
-	unsigned long crc;
-	log_trace("zsdat32: %zu %s", length, Zendnames[(frameend-ZCRCE)&3]);
-
-	crc = 0xFFFFFFFFL;
-	zm_put_escaped_string(zm, buf, length);
-	for (size_t i = 0; i < length; i++) {
-		c = buf[i] & 0xFF;
-		crc = UPDC32(c, crc);
-	}
-	putchar(ZDLE);
-	putchar(frameend);
-	crc = UPDC32(frameend, crc);
-
-	crc = ~crc;
-	for (int i = 0; i < 4; i ++) {
-		c=(int) crc;
-		if (c & 0140)
-			putchar(zm->lastsent = c);
-		else
-			zm_put_escaped_char(zm, c);
-		crc >>= 8;
-	}
-	if (frameend == ZCRCW) {
-		putchar(XON);
-		fflush(stdout);
-	}
+	log_trace("zm_send_encoded_data%s: %zu %s", zm->crc32t ? "32" : "",
+		  len, Zendnames[(frameend-ZCRCE)&3]);
+	zm_put(zm, image, len);
+	if (len > 0)
+		zm->lastsent = image[len - 1];
+	zm_send_data_trailer(zm, crc, frameend, zm->crc32t);
 }
 
 #if __GNUC__ < 2 || (__GNUC__ == 2 && __GNUC_MINOR__ <= 4)
@@ -589,107 +898,59 @@ count_blk(int size)
 #endif
 
 /*
- * Receive array buf of max length with ending ZDLE sequence
- *  and CRC.  Returns the ending character or error code.
- *  NB: On errors may store length+1 bytes!
+ * The receive kernel behind zm_receive_data.  Clean runs are copied
+ * straight out of the input buffer, and the CRC (CRC-32 if crc32,
+ * else CRC-16) is folded over the decoded bytes in cache-sized blocks
+ * as they arrive, then finished over the frame end and CRC bytes.
+ * ctl is the receive escape mode.
  */
-int
-zm_receive_data(zm_t *zm, char *buf, int length, size_t *bytes_received)
+#define ZM_RECV_BLOCK 1024
+ZM_INLINE int
+zm_receive_data_mode(zm_t *zm, char *buf, int length, size_t *bytes_received,
+		     int crc32, int ctl)
 {
 	register int c;
-	register unsigned short crc;
 	register int d;
+	uint32_t crc = crc32 ? 0xFFFFFFFFL : 0;
+	int done = 0;		/* bytes of buf already in crc */
+	int ntrailer = crc32 ? 5 : 3;
+	unsigned char trailer[5];
 
-	*bytes_received=0;
-	if (zm->rxframeind == ZBIN32)
-		return zm_read_data32(zm, buf, length, bytes_received);
-
-	crc = 0;
 	for (int i = 0; i < length + 1; i ++) {
-		if ((c = zm_get_escaped_char(zm)) & ~0xFF) {
-crcfoo:
-			switch (c) {
-			case GOTCRCE:
-			case GOTCRCG:
-			case GOTCRCQ:
-			case GOTCRCW:
-				{
-					d = c;
-					c &= 0xFF;
-					crc = updcrc(c, crc);
-					if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-						goto crcfoo;
-					crc = updcrc(c, crc);
-					if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-						goto crcfoo;
-					crc = updcrc(c, crc);
-					if (crc & 0xFFFF) {
-						log_error(badcrc);
-						return ERROR;
-					}
-					*bytes_received = i;
-					COUNT_BLK(*bytes_received);
-					log_trace("zm_receive_data: %lu  %s", (unsigned long) (*bytes_received),
-							Zendnames[(d-GOTCRCE)&3]);
-					return d;
-				}
-			case GOTCAN:
-				log_error(_("Sender Canceled"));
-				return ZCAN;
-			case TIMEOUT:
-				log_error(_("TIMEOUT"));
-				return c;
-			default:
-				log_error(_("Bad data subpacket"));
-				return c;
-			}
+		i += (int) zm_get_clean_span(zm, buf + i, (size_t) (length + 1 - i), ctl);
+		if (i - done >= ZM_RECV_BLOCK) {
+			crc = zm_crc_update(crc, buf + done, (size_t) (i - done), crc32);
+			done = i;
 		}
-		buf[i] = c;
-		crc = updcrc(c, crc);
-	}
-	log_error(_("Data subpacket too long"));
-	return ERROR;
-}
-
-static int
-zm_read_data32(zm_t *zm, char *buf, int length, size_t *bytes_received)
-{
-	register int c;
-	register unsigned long crc;
-	register int d;
-
-	crc = 0xFFFFFFFFL;
-	for (int i = 0; i < length + 1; i ++) {
-		if ((c = zm_get_escaped_char(zm)) & ~0xFF) {
+		if (i == length + 1)
+			break;
+		if ((c = zm_get_escaped_char_mode(zm, ctl)) & ~0xFF) {
 crcfoo:
 			switch (c) {
 			case GOTCRCE:
 			case GOTCRCG:
 			case GOTCRCQ:
 			case GOTCRCW:
+				/* The frame end and the two or four
+				 * CRC bytes follow the data. */
 				d = c;
-				c &= 0xFF;
-				crc = UPDC32(c, crc);
-				if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-					goto crcfoo;
-				crc = UPDC32(c, crc);
-				if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-					goto crcfoo;
-				crc = UPDC32(c, crc);
-				if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-					goto crcfoo;
-				crc = UPDC32(c, crc);
-				if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-					goto crcfoo;
-				crc = UPDC32(c, crc);
-				if (crc != 0xDEBB20E3) {
+				trailer[0] = c & 0xFF;
+				for (int n = 1; n < ntrailer; n++) {
+					if ((c = zm_get_escaped_char_mode(zm, ctl)) & ~0xFF)
+						goto crcfoo;
+					trailer[n] = c;
+				}
+				crc = zm_crc_update(crc, buf + done, (size_t) (i - done), crc32);
+				crc = zm_crc_update(crc, trailer, (size_t) ntrailer, crc32);
+				if (crc32 ? crc != 0xDEBB20E3 : (crc & 0xFFFF) != 0) {
 					log_error(badcrc);
 					return ERROR;
 				}
 				*bytes_received = i;
 				COUNT_BLK(*bytes_received);
-				log_trace("zm_read_data32: %lu %s", (unsigned long) *bytes_received,
-					Zendnames[(d-GOTCRCE)&3]);
+				log_trace("zm_receive_data%s: %lu %s", crc32 ? "32" : "",
+					  (unsigned long) *bytes_received,
+					  Zendnames[(d-GOTCRCE)&3]);
 				return d;
 			case GOTCAN:
 				log_error(_("Sender Canceled"));
@@ -703,12 +964,103 @@ crcfoo:
 			}
 		}
 		buf[i] = c;
-		crc = UPDC32(c, crc);
 	}
 	log_error(_("Data subpacket too long"));
 	return ERROR;
 }
 
+/* One send and one receive loop per CRC width and escape mode. */
+#define ZM_DATA_LOOPS(suffix, crc32, ctl)				\
+static void								\
+zm_send_data_##suffix(zm_t *zm, const char *buf, size_t length,	\
+		      int frameend)					\
+{									\
+	zm_send_data_mode(zm, buf, length, frameend, crc32, ctl);	\
+}									\
+static int								\
+zm_receive_data_##suffix(zm_t *zm, char *buf, int length,		\
+			 size_t *bytes_received)			\
+{									\
+	return zm_receive_data_mode(zm, buf, length, bytes_received,	\
+				    crc32, ctl);			\
+}
+ZM_DATA_LOOPS(16, 0, 0)
+ZM_DATA_LOOPS(16_ctl, 0, 1)
+ZM_DATA_LOOPS(32, 1, 0)
+ZM_DATA_LOOPS(32_ctl, 1, 1)
+
+/* Indexed by [32 bit CRC][escape all control characters]. */
+static void (*const zm_send_loops[2][2])(zm_t *, const char *, size_t, int) = {
+	{ zm_send_data_16, zm_send_data_16_ctl },
+	{ zm_send_data_32, zm_send_data_32_ctl }
+};
+static int (*const zm_receive_loops[2][2])(zm_t *, char *, int, size_t *) = {
+	{ zm_receive_data_16, zm_receive_data_16_ctl },
+	{ zm_receive_data_32, zm_receive_data_32_ctl }
+};
+
+/*
+ * Point the session at the data subpacket loops for its current CRC
+ * width and escape modes, so those are not tested per subpacket or
+ * per byte.  Called when the session parameters are settled or
+ * change, and whenever a header fixes the CRC width of the data that
+ * follows it.
+ */
+void
+zm_select_data_loops(zm_t *zm)
+{
+	zm->send_data = zm_send_loops[zm->crc32t != 0][zm->txctlesc != 0];
+	zm->receive_data = zm_receive_loops[zm->rxframeind == ZBIN32][zm->zctlesc != 0];
+}
+
+void
+zm_send_data(zm_t *zm, const char *buf, size_t length, int frameend)
+{
+	zm_send_loops[0][zm->txctlesc != 0](zm, buf, length, frameend);
+}
+
+void
+zm_send_data32(zm_t *zm, const char *buf, size_t length, int frameend)
+{
+	zm_send_loops[1][zm->txctlesc != 0](zm, buf, length, frameend);
+}
+
+/*
+ * Receive array buf of max length with ending ZDLE sequence
+ *  and CRC.  Returns the ending character or error code.
+ *  NB: On errors may store length+1 bytes!
+ */
+int
+zm_receive_data(zm_t *zm, char *buf, int length, size_t *bytes_received)
+{
+	*bytes_received=0;
+	return zm->receive_data(zm, buf, length, bytes_received);
+}
+
+/*
+ * Drop the bytes already buffered by zreadline that cannot begin a
+ * header, stopping at the first ZPAD or CAN.  Returns the number
+ * dropped.
+ */
+ZM_INLINE size_t
+zm_skip_intro(zm_t *zm)
+{
+	zreadline_t *zr = zm->zr;
+	const unsigned char *p = (const unsigned char *) zr->readline_ptr;
+	const unsigned char *end = p;
+	size_t n;
+
+	if (zr->readline_left > 0)
+		end += zr->readline_left;
+	while (p < end && zm_header_dfa[0][HS_START][zm_header_class[*p]]
+	       == ZT(HS_START, HA_INTRO))
+		p++;
+	n = (size_t) (p - (const unsigned char *) zr->readline_ptr);
+	zr->readline_ptr += n;
+	zr->readline_left -= (int) n;
+	return n;
+}
+
 /*
  * Read a ZMODEM header to hdr, either binary or hex.
  *  eflag controls loggin non-ZMODEM characters:
@@ -725,122 +1077,103 @@ zm_get_header(zm_t *zm, uint32_t *payload)
 	int c, cancount;
 	unsigned int intro_msg_len, max_intro_msg_len;
 	size_t rxpos=0;
-	char *intro_msg;
+	const unsigned char (*dfa)[HC_NCLASS] = zm_header_dfa[zm->zctlesc != 0];
+	unsigned int state, t;
 
-	/* Max bytes before start of frame */
+	/* Max bytes before start of frame.  Only the first
+	 * ZM_INTRO_MAX of them are kept for display. */
 	max_intro_msg_len = zm->zrwindow + zm->baudrate;
-	intro_msg = (char *) calloc (max_intro_msg_len + 1, sizeof(char));
 	intro_msg_len = 0;
 
 	zm->rxframeind = zm->rxtype = 0;
+	zm_select_data_loops(zm);
 
-startover:
+	/* Whatever the peer is to answer must be on the wire first. */
+	zm_flush(zm);
+
+	state = HS_START;
 	cancount = 5;
-again:
-	/* Return immediate ERROR if ZCRCW sequence seen */
-	c = zreadline_getc(zm->zr, zm->rxtimeout);
-	switch (c) {
-	case RCDO:
-	case TIMEOUT:
-		goto fifi;
-		break;
-	case CAN:
-gotcan:
-		if (--cancount <= 0) {
-			c = ZCAN;
+	for (;;) {
+		/* With no intro message to keep, line noise goes a
+		 * buffer at a time rather than through the table. */
+		if (state == HS_START && zm->eflag == 0 && zm_skip_intro(zm))
+			cancount = 5;
+		/* A CAN is only followed up with a short wait. */
+		c = zreadline_getc(zm->zr, state == HS_CANWAIT ? 1 : zm->rxtimeout);
+		if (c < 0) {
+			if (state == HS_CANWAIT && c == TIMEOUT) {
+				state = HS_START;
+				continue;
+			}
 			goto fifi;
 		}
-		switch (c = zreadline_getc(zm->zr, 1)) {
-		case TIMEOUT:
-			goto again;
-			break;
-		case ZCRCW:
-			c = ERROR;
-			/* **** FALL THRU TO **** */
-		case RCDO:
-			goto fifi;
-			break;
-		default:
-			break;
-		case CAN:
+		if (state == HS_PAD || state == HS_DLE)
+			c &= 0x7F;
+		t = dfa[state][zm_header_class[c]];
+		state = ZT_STATE(t);
+		switch (ZT_ACTION(t)) {
+		case HA_SKIP:
+			continue;
+		case HA_PAD:
+			/* Received 1st byte of a packet header. */
+			cancount = 5;
+			continue;
+		case HA_CAN:
 			if (--cancount <= 0) {
 				c = ZCAN;
 				goto fifi;
 			}
-			goto again;
-		}
-		/* **** FALL THRU TO **** */
-	default:
-agn2:
-		if (intro_msg_len > max_intro_msg_len) {
-			log_error(_("Intro message length exceeded"));
-			return(ERROR);
+			continue;
+		case HA_ERROR:
+			/* Return immediate ERROR if ZCRCW sequence seen */
+			c = ERROR;
+			goto fifi;
+		case HA_INTRO:
+			if (intro_msg_len > max_intro_msg_len) {
+				log_error(_("Intro message length exceeded"));
+				return(ERROR);
+			}
+			if ((zm->eflag == 1 && isprint(c)) || zm->eflag == 2) {
+				if (intro_msg_len < ZM_INTRO_MAX)
+					zm->intro_msg[intro_msg_len] = (char) c;
+				intro_msg_len++;
+			}
+			cancount = 5;
+			continue;
+		case HA_ZBIN:
+			/* If the 3rd byte of a header is ZBIN, we're
+			 * receiving a binary packet with at 16-bit CRC. */
+			zm->rxframeind = ZBIN;
+			zm->crc32 = FALSE;
+			c =  zm_read_binary_header(zm);
+			break;
+		case HA_ZBIN32:
+			/* If the 3rd byte of a header is ZBIN32, we're
+			 * receiving a binary packet with at 32-bit CRC. */
+			zm->crc32 = zm->rxframeind = ZBIN32;
+			c =  zm_read_binary_header32(zm);
+			break;
+		case HA_ZHEX:
+			/* If the 3rd byte of a header is ZHEX, we're
+			 * receiving a hex-encoded packet with at 16-bit
+			 * CRC. */
+			zm->rxframeind = ZHEX;
+			zm->crc32 = FALSE;
+			c =  zm_read_hex_header(zm);
+			break;
 		}
-		if (zm->eflag == 1 && isprint(c))
-			intro_msg[intro_msg_len++] = c;
-		else if (zm->eflag == 2)
-			intro_msg[intro_msg_len++] = c;
-		goto startover;
-		break;
-
-	/* Spec 7.3.1.  A binary header begins with the sequence ZPAD, ZDLE, ZBIN */
-        /* Spec 7.3.2.  A 32 bit CRC binary header begins with ZPAD, ZDLE, ZBIN32 */
-	/* Spec 7.3.3.  A hex header begins with the sequence ZPAD, ZPAD, ZDLE, ZHEX. */
-	case ZPAD|0x80:	
-	case ZPAD:
-		/* Received 1st byte of a packet header. */
-		break;
-	}
-	cancount = 5;
-multiplezpad:
-	switch (c = zm_get_ascii_char(zm)) {
-	case ZPAD:
-		/* Multiple consecutive ZPADs can be treated as a single ZPAD. */
-		goto multiplezpad;
-	case RCDO:
-	case TIMEOUT:
-		goto fifi;
-	default:
-		goto agn2;
-	case ZDLE:
-		/* Received 2nd byte of a packet header. */
 		break;
 	}
-
-	switch (c = zm_get_ascii_char(zm)) {
-	case RCDO:
-	case TIMEOUT:
-		goto fifi;
-	case ZBIN:
-		/* If the 3rd byte of a header is ZBIN, we're receiving a
-		 * binary packet with at 16-bit CRC. */
-		zm->rxframeind = ZBIN;
-		zm->crc32 = FALSE;
-		c =  zm_read_binary_header(zm);
-		break;
-	case ZBIN32:
-		/* If the 3rd byte of a header is ZBIN32, we're receiving a
-		 * binary packet with at 32-bit CRC. */
-		zm->crc32 = zm->rxframeind = ZBIN32;
-		c =  zm_read_binary_header32(zm);
-		break;
-	case ZHEX:
-		/* If the 3rd byte of a header is ZHEX, we're receiving a
-		 * hex-encoded packet with at 16-bit CRC. */
-		zm->rxframeind = ZHEX;
-		zm->crc32 = FALSE;
-		c =  zm_read_hex_header(zm);
-		break;
-	case CAN:
-		goto gotcan;
-	default:
-		goto agn2;
-	}
 	rxpos = zm->Rxhdr[ZP3] & 0xFF;
 	rxpos = (rxpos<<8) + (zm->Rxhdr[ZP2] & 0xFF);
 	rxpos = (rxpos<<8) + (zm->Rxhdr[ZP1] & 0xFF);
 	rxpos = (rxpos<<8) + (zm->Rxhdr[ZP0] & 0xFF);
 fifi:
+	zm_select_data_loops(zm);
+	/* A subpacket end in a header means stale data looked like
+	 * one: garbage, like a bad CRC. */
+	if (c >= 0 && (c & GOTOR) && c != GOTCAN)
+		c = ERROR;
 	/* 'c' should contain the TYPE byte from the packet header. */
 	switch (c) {
 	case GOTCAN:
@@ -864,11 +1197,13 @@ fifi:
 	
 	/* If we got an intro message, log it. */
 	if (intro_msg_len > 0) {
+		if (intro_msg_len > ZM_INTRO_MAX)
+			intro_msg_len = ZM_INTRO_MAX;
+		zm->intro_msg[intro_msg_len] = '\0';
 		log_info("zm_get_header: received intro msg from sender...");
-		log_info(intro_msg);
+		log_info("%s", zm->intro_msg);
 	}
-	free(intro_msg);
-	
+
 	return c;
 }
 
@@ -878,24 +1213,25 @@ zm_read_binary_header(zm_t *zm)
 {
 	register int c;
 	register unsigned short crc;
+	unsigned char hdr[7];	/* type, 4 bytes of payload, 2 bytes of CRC */
 
 	if ((c = zm_get_escaped_char(zm)) & ~0xFF)
 		return c;
 	zm->rxtype = c;
-	crc = updcrc(c, 0);
+	hdr[0] = c;
 
 	for (int n = 0; n < 4; n++) {
 		if ((c = zm_get_escaped_char(zm)) & ~0xFF)
 			return c;
-		crc = updcrc(c, crc);
+		hdr[n + 1] = c;
 		zm->Rxhdr[n] = c;
 	}
-	if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-		return c;
-	crc = updcrc(c, crc);
-	if ((c = zm_get_escaped_char(zm)) & ~0xFF)
-		return c;
-	crc = updcrc(c, crc);
+	for (int n = 0; n < 2; n++) {
+		if ((c = zm_get_escaped_char(zm)) & ~0xFF)
+			return c;
+		hdr[n + 5] = c;
+	}
+	crc = crc16_update(0, hdr, 7);
 	if (crc & 0xFFFF) {
 		log_error(badcrc);
 		return ERROR;
@@ -909,34 +1245,29 @@ static int
 zm_read_binary_header32(zm_t *zm)
 {
 	register int c;
-	register unsigned long crc;
+	uint32_t crc;
+	unsigned char hdr[9];	/* type, 4 bytes of payload, 4 bytes of CRC */
 
 	if ((c = zm_get_escaped_char(zm)) & ~0xFF)
 		return c;
 	zm->rxtype = c;
-	crc = 0xFFFFFFFFL;
-	crc = UPDC32(c, crc);
-#ifdef DEBUGZ
-	log_trace("zm_read_binary_header32 c=%X  crc=%lX", c, crc);
-#endif
+	hdr[0] = c;
 
 	for (int n = 0; n < 4; n++) {
 		if ((c = zm_get_escaped_char(zm)) & ~0xFF)
 			return c;
-		crc = UPDC32(c, crc);
+		hdr[n + 1] = c;
 		zm->Rxhdr[n] = c;
-#ifdef DEBUGZ
-		log_trace("zm_read_binary_header32 c=%X  crc=%lX", c, crc);
-#endif
 	}
 	for (int n = 0; n < 4; n ++) {
 		if ((c = zm_get_escaped_char(zm)) & ~0xFF)
 			return c;
-		crc = UPDC32(c, crc);
+		hdr[n + 5] = c;
+	}
+	crc = crc32_update(0xFFFFFFFFL, hdr, 9);
 #ifdef DEBUGZ
-		log_trace("zm_read_binary_header32 c=%X  crc=%lX", c, crc);
+	log_trace("zm_read_binary_header32 crc=%X", crc);
 #endif
-	}
 	if (crc != 0xDEBB20E3) {
 		log_error(badcrc);
 		return ERROR;
@@ -952,24 +1283,25 @@ zm_read_hex_header(zm_t *zm)
 {
 	register int c;
 	register unsigned short crc;
+	unsigned char hdr[7];	/* type, 4 bytes of payload, 2 bytes of CRC */
 
 	if ((c = zm_get_hex_encoded_byte(zm)) < 0)
 		return c;
 	zm->rxtype = c;
-	crc = updcrc(c, 0);
+	hdr[0] = c;
 
 	for (int n = 0; n < 4; n ++) {
 		if ((c = zm_get_hex_encoded_byte(zm)) < 0)
 			return c;
-		crc = updcrc(c, crc);
+		hdr[n + 1] = c;
 		zm->Rxhdr[n] = c;
 	}
-	if ((c = zm_get_hex_encoded_byte(zm)) < 0)
-		return c;
-	crc = updcrc(c, crc);
-	if ((c = zm_get_hex_encoded_byte(zm)) < 0)
-		return c;
-	crc = updcrc(c, crc);
+	for (int n = 0; n < 2; n++) {
+		if ((c = zm_get_hex_encoded_byte(zm)) < 0)
+			return c;
+		hdr[n + 5] = c;
+	}
+	crc = crc16_update(0, hdr, 7);
 	if (crc & 0xFFFF) {
 		log_error(badcrc); return ERROR;
 	}
@@ -1035,6 +1367,8 @@ zm_escape_sequence_init(zm_t *zm)
 			}
 		}
 	}
+	zm->txctlesc = zm->zctlesc;
+	zm_select_data_loops(zm);
 }
 
 
@@ -1132,9 +1466,8 @@ zm_saybibi(zm_t *zm)
                          * characters, "OO" (Over and Out) and exits
                          * to the operating system or application that
                          * invoked it." */
-			putchar('O');
-			putchar('O');
-			fflush(stdout);
+			zm_put(zm, "OO", 2);
+			zm_flush(zm);
 		case ZCAN:
 		case TIMEOUT:
 			return;
@@ -1142,6 +1475,26 @@ zm_saybibi(zm_t *zm)
 	}
 }
 
+/*
+ * Compute the ZCRC value (complemented 32 bit CRC) of at most COUNT
+ * bytes of F, starting at its current position.
+ */
+uint32_t
+zm_file_crc32(FILE *f, size_t count)
+{
+	char buf[8192];
+	uint32_t crc = 0xFFFFFFFFL;
+
+	while (count > 0) {
+		size_t n = fread(buf, 1, count < sizeof(buf) ? count : sizeof(buf), f);
+		if (n == 0)
+			break;
+		crc = crc32_update(crc, buf, n);
+		count -= n;
+	}
+	return ~crc;
+}
+
 /*
  * do ZCRC-Check for open file f.
  * check at most check_bytes bytes (crash recovery). if 0 -> whole file.
@@ -1162,13 +1515,10 @@ zm_do_crc_check(zm_t *zm, FILE *f, size_t remote_bytes, size_t check_bytes)
 	if (check_bytes==0 && ((size_t) st.st_size)!=remote_bytes)
 		return ZCRC_DIFFERS; /* shortcut */
 
-	crc=0xFFFFFFFFL;
 	n=check_bytes;
 	if (n==0)
 		n=st.st_size;
-	while (n-- && ((c = getc(f)) != EOF))
-		crc = UPDC32(c, crc);
-	crc = ~crc;
+	crc = zm_file_crc32(f, n);
 	clearerr(f);  /* Clear EOF */
 	fseek(f, 0L, 0);
 
@@ -14,9 +14,13 @@
 #define ZM_ESCAPE_ALWAYS ((char) 1)
 #define ZM_ESCAPE_AFTER_AMPERSAND ((char) 2)
 
+/* Non ZMODEM characters kept for display, see eflag */
+#define ZM_INTRO_MAX 256
+
 extern int bytes_per_error;  /* generate one error around every x bytes */
 
 struct zm_ {
+	zmodem_transport_t *tp;	/* The line: where input comes from and output goes */
 	zreadline_t *zr;	/* Buffered, interruptable input. */
 	char Rxhdr[4];		/* Received header */
 	char Txhdr[4];		/* Transmitted header */
@@ -39,20 +43,44 @@ struct zm_ {
 	int crc32;              /* State: display flag indicating 32 bit CRC being received */
 	int rxframeind;	        /* State: ZBIN, ZBIN32, or ZHEX type of frame received */
 	int zmodem_requested;
+	int txctlesc;		/* State: zctlesc that escape_sequence_table was built for */
+
+	/* State: data subpacket loops for the current CRC width and
+	 * escape mode, see zm_select_data_loops */
+	void (*send_data)(struct zm_ *zm, const char *buf, size_t length, int frameend);
+	int (*receive_data)(struct zm_ *zm, char *buf, int length, size_t *received);
+
+	char *outbuf;		/* State: wire output waiting for zm_flush */
+	size_t outlen;		/* State: bytes used in outbuf */
+	size_t outsize;		/* Constant: size of outbuf */
+	unsigned long tx_bytes;	/* Statistic: bytes written to the wire */
+	unsigned long tx_writes; /* Statistic: write system calls made */
+
+	char intro_msg[ZM_INTRO_MAX + 1]; /* State: start of the non ZMODEM characters before a header, for eflag */
 };
 
 typedef struct zm_ zm_t;
 
-zm_t *zm_init(int fd, size_t readnum, size_t bufsize, int no_timeout,
+zm_t *zm_init(zmodem_transport_t *tp, size_t readnum, size_t bufsize, int no_timeout,
 	      int rxtimeout, int znulls, int eflag, int baudrate, int zctlesc, int zrwindow);
+void zm_free(zm_t *zm);
 int zm_get_zctlesc(zm_t *zm);
 void zm_set_zctlesc(zm_t *zm, int zctlesc);
 void zm_escape_sequence_update(zm_t *zm);
+void zm_put(zm_t *zm, const char *s, size_t len);
+void zm_flush(zm_t *zm);
+void zm_send_byte(zm_t *zm, int c);
+void zm_canit(zm_t *zm);
 void zm_put_escaped_char (zm_t *zm, int c);
 void zm_send_binary_header (zm_t *zm, int type);
 void zm_send_hex_header (zm_t *zm, int type);
 void zm_send_data (zm_t *zm, const char *buf, size_t length, int frameend);
 void zm_send_data32 (zm_t *zm, const char *buf, size_t length, int frameend);
+size_t zm_encode_data (const char *table, int ctl, int crc32, char *dst,
+		       const char *src, size_t count, uint32_t *crc);
+void zm_send_encoded_data (zm_t *zm, const char *image, size_t len,
+			   uint32_t crc, int frameend);
+void zm_select_data_loops (zm_t *zm);
 void zm_set_header_payload (zm_t *zm, uint32_t val);
 void zm_set_header_payload_bytes(zm_t *zm, uint8_t x0, uint8_t x1, uint8_t x2, uint8_t x3);
 
@@ -63,5 +91,6 @@ int zm_get_header (zm_t *zm, uint32_t *payload);
 void zm_ackbibi (zm_t *zm);
 void zm_saybibi(zm_t *zm);
 int zm_do_crc_check(zm_t *zm, FILE *f, size_t remote_bytes, size_t check_bytes);
+uint32_t zm_file_crc32(FILE *f, size_t count);
 
 #endif
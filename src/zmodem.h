@@ -3,6 +3,9 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,7 +16,157 @@ extern "C" {
 #define RZSZ_ERROR (1)
 
 /* Flags */
-#define RZSZ_FLAGS_NONE (0x0000)
+#define RZSZ_FLAGS_NONE (0x0000u)
+
+/* Move work off the protocol thread onto a pipeline of threads.  A
+   sender has one read the file ahead, one encode data subpackets,
+   and one write to the transport, so that the protocol thread is
+   left with framing and flow control.  A receiver has one read the
+   transport ahead and one write received data to disk behind it.
+   Either way, the transport's READ and its WRITEV and FLUSH are then
+   called from different threads, so they must be safe to use at the
+   same time, as they are for the fd and socket transports.
+   zm_session_send and zm_session_receive ignore this flag. */
+#define RZSZ_FLAGS_PIPELINE (0x0001u)
+
+/* Have a sender read the back channel on a thread of its own while it
+   sends file data, if the receiver can do full duplex.  Instead of
+   looking for input after every data subpacket, the protocol thread
+   then only checks for headers that thread has already parsed, so it
+   sees a ZRPOS after the subpacket in flight.  The transport must
+   allow READ at the same time as WRITEV and FLUSH, as for
+   RZSZ_FLAGS_PIPELINE.  Receivers, zm_session_send and
+   zm_session_receive ignore this flag. */
+#define RZSZ_FLAGS_MONITOR (0x0002u)
+
+/* Have zmodem_send and zmodem_receive reach standard input and
+   output through zmodem_transport_uring, or through
+   zmodem_transport_fd as usual where that returns NULL.  The other
+   entry points take a transport from the caller, who can pass them
+   one from zmodem_transport_uring instead, and ignore this flag. */
+#define RZSZ_FLAGS_URING (0x0004u)
+
+/* Offer, or take up, selective retransmission.  A receiver keeps the
+   data subpackets that follow a bad one and asks for just the missing
+   ones with ZSACK, instead of having everything after the error sent
+   again.  It offers this with a ZRINIT flag, and a sender that was
+   given this flag too accepts in its ZFILE; with a peer that does not,
+   errors are answered with ZRPOS as usual. */
+#define RZSZ_FLAGS_SACK (0x0008u)
+
+/* Offer, or take up, forward error correction on top of selective
+   retransmission, which it implies.  The sender follows every few
+   data subpackets with a ZFEC frame holding their XOR, from which the
+   receiver rebuilds one that went bad without a round trip.  The
+   sender sends parity more often as the receiver asks for more data
+   again, and less often while it does not.  It is asked for with ZF2
+   of ZFILE, and ignored unless both ends were given this flag. */
+#define RZSZ_FLAGS_FEC (0x0010u)
+
+/* A transport carries the ZMODEM byte stream of one session.
+
+   READ stores at most LEN bytes into BUF.  It waits at most
+   TIMEOUT_MS milliseconds for the first byte, or forever if
+   TIMEOUT_MS is negative.  It returns the number of bytes stored, 0
+   on timeout or end of file, or -1 with errno set on error.
+
+   WRITEV writes the IOVCNT buffers of IOV like writev(2) and returns
+   the number of bytes written, or -1 with errno set.  Short writes
+   are retried by the caller.
+
+   FLUSH is called after each burst of output that the peer is
+   expected to answer.  DRAIN waits until all output has left the
+   machine.  PURGE throws away input that has not been read yet.
+   SEND_BREAK sends a line break.  Any of these four may be NULL.
+
+   CLOSE releases CTX.  It is called by zmodem_transport_free, and
+   may be NULL.
+
+   CTX is passed as the first argument to every function. */
+typedef struct zmodem_transport_ {
+	ssize_t (*read)(void *ctx, void *buf, size_t len, int timeout_ms);
+	ssize_t (*writev)(void *ctx, const struct iovec *iov, int iovcnt);
+	int (*flush)(void *ctx);
+	int (*drain)(void *ctx);
+	void (*purge)(void *ctx);
+	void (*send_break)(void *ctx);
+	void (*close)(void *ctx);
+	void *ctx;
+} zmodem_transport_t;
+
+/* Return a transport that reads IN_FD and writes OUT_FD, which may
+   be terminals, pipes or files.  The descriptors are not closed by
+   zmodem_transport_free, and terminal modes are left alone. */
+zmodem_transport_t *zmodem_transport_fd(int in_fd, int out_fd);
+
+/* Return a transport like zmodem_transport_fd that does its I/O
+   through io_uring.  A read and its timeout go to the kernel as one
+   linked request.  Output is copied into registered buffers and
+   written behind the caller, who only waits for it at FLUSH and
+   DRAIN; a write that fails by then is reported by the next WRITEV.
+   Returns NULL with errno set to ENOSYS if libzmodem was built
+   without io_uring, or as the kernel left it if it will not set up
+   a ring. */
+zmodem_transport_t *zmodem_transport_uring(int in_fd, int out_fd);
+
+/* Return a transport over the connected stream socket SOCK.  The
+   socket is not closed by zmodem_transport_free. */
+zmodem_transport_t *zmodem_transport_socket(int sock);
+
+/* Return a transport that reads the IN_LEN bytes at IN and collects
+   everything written in memory.  IN must stay valid as long as the
+   transport.  Reads past the end time out at once. */
+zmodem_transport_t *zmodem_transport_memory(const void *in, size_t in_len);
+
+/* Return the bytes written so far to the in-memory transport TP and
+   store their count in LEN. */
+const void *zmodem_transport_memory_output(zmodem_transport_t *tp, size_t *len);
+
+/* Release a transport returned by one of the functions above, or
+   call the CLOSE function of one built by the caller. */
+void zmodem_transport_free(zmodem_transport_t *tp);
+
+/* Tuning for zmodem_receive_ex and zmodem_send_ex.  A member left
+   zero takes its default, so callers should clear the whole struct
+   before setting the members they want; a NULL pointer takes every
+   default.
+
+   OOSB_BUDGET is how many bytes a receiver may spend keeping data
+   subpackets that arrive after a bad one, so that the sender need
+   not send them again.  The default is 128 KiB, or 2 MiB when
+   RZSZ_FLAGS_SACK or RZSZ_FLAGS_FEC is given.  It is taken in 8 KiB
+   slots the first time one is needed; less than one slot keeps
+   none.
+
+   RING_SIZE is how many of the bytes last sent a sender keeps when
+   it reads a file it cannot seek in, such as a pipe, to go back to
+   when the receiver asks for them again.  The default is 1 MiB.  A
+   request for bytes older than that ends the transfer.
+
+   STACK_SIZE is the size of the stack a zm_session runs on.  The
+   default is 64 KiB, about three times what the engine has been seen
+   to use.  zmodem_receive_ex and zmodem_send_ex run on the caller's
+   stack and ignore it.
+
+   TIMEOUT is how long, in tenths of a second, a receiver waits for
+   the sender before asking it again.  A sender waits six times as
+   long before it gives up, as zmodem_send does, to leave the
+   receiver time to ask.  The default waits forever, which suits a
+   line that does not lose bytes; on one that does, a lost end of
+   frame would leave both ends waiting for each other.
+
+   LEGACY_BLKLEN, if nonzero, has a sender size its data subpackets
+   as lsz did before they followed the recent error rate: 1024 bytes
+   until a ZRPOS repeats, then powers of two worked out from the
+   errors since the start.  It is there to compare the two on the
+   same line, as zmbench replay does. */
+typedef struct zmodem_options_ {
+	size_t oosb_budget;
+	size_t ring_size;
+	size_t stack_size;
+	int timeout;
+	int legacy_blklen;
+} zmodem_options_t;
 
 /* This runs a zmodem receiver.
 
@@ -65,6 +218,19 @@ size_t zmodem_receive(const char *directory,
 		      uint64_t min_bps,
 		      uint32_t flags);
 
+/* Like zmodem_receive, but talk to the sender over TRANSPORT instead
+   of standard input and output, and return to the caller when the
+   session ends.  No terminal modes are changed.  OPTIONS may be
+   NULL. */
+size_t zmodem_receive_ex(zmodem_transport_t *transport,
+			 const char *directory,
+			 bool (*approver)(const char *filename, size_t size, time_t date),
+			 bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+			 void (*complete)(const char *filename, int result, size_t size, time_t date),
+			 uint64_t min_bps,
+			 uint32_t flags,
+			 const zmodem_options_t *options);
+
 /* This runs a zmodem receiver.
 
    DIRECTORY is the root directory from which files will be downloaded,
@@ -111,6 +277,84 @@ size_t zmodem_send(int file_count,
 		   uint64_t min_bps,
 		   uint32_t flags);
 
+/* Like zmodem_send, but talk to the receiver over TRANSPORT instead
+   of standard input and output, and return to the caller when the
+   session ends.  No terminal modes are changed.  OPTIONS may be
+   NULL. */
+size_t zmodem_send_ex(zmodem_transport_t *transport,
+		      int file_count,
+		      const char **file_list,
+		      bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+		      void (*complete)(const char *filename, int result, size_t size, time_t date),
+		      uint64_t min_bps,
+		      uint32_t flags,
+		      const zmodem_options_t *options);
+
+/* A zmodem session that never blocks, for programs with their own
+   event loop.  Nothing is read or written by the library: the caller
+   moves bytes between the session and the line.
+
+   zm_session_send and zm_session_receive take the same arguments as
+   zmodem_send_ex and zmodem_receive_ex, less the transport, and
+   return NULL with errno set if out of memory, or to ENOSYS if
+   libzmodem was built without sessions.  They need getcontext,
+   makecontext and swapcontext, which some C libraries, such as musl,
+   do not have.  The callbacks are called from inside zm_session_feed,
+   zm_session_consume_output and zm_session_timeout.
+
+   Each session runs the protocol engine on a stack of its own, of
+   the STACK_SIZE in OPTIONS.  On top of that it takes the engine's
+   state, about 60 KiB for a sender or a receiver with a file open, up
+   to 64 KiB of output waiting for the caller, whatever input has been
+   fed but not read, and, for a receiver, its OOSB_BUDGET and 64 KiB
+   of ZFEC history once they are needed.  Each call that runs the
+   engine switches to it and back with swapcontext, which in glibc
+   makes a sigprocmask system call each way.
+
+   Bytes that arrive from the line are given to zm_session_feed, which
+   copies them and runs the session until it wants more.  A LEN of
+   zero tells the session that the line has closed.  It returns 0, or
+   -1 if out of memory.
+
+   zm_session_poll_output returns the bytes waiting to go to the line
+   and sets *LEN to their number.  Once some have been written, pass
+   that count to zm_session_consume_output.  A session stops making
+   progress while too much output is waiting.
+
+   zm_session_next_deadline returns the CLOCK_MONOTONIC time, in
+   milliseconds, at which the session gives up waiting for input, or
+   -1 if there is none.  Call zm_session_timeout when it passes.
+
+   zm_session_done returns true once the session has finished, and
+   sets *BYTES to what zmodem_send or zmodem_receive would have
+   returned.
+
+   zm_session_free may be called at any time.  An unfinished session
+   is ended as if the line had closed. */
+typedef struct zm_session_ zm_session_t;
+
+zm_session_t *zm_session_send(int file_count,
+			      const char **file_list,
+			      bool (*tick)(long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+			      void (*complete)(const char *filename, int result, size_t size, time_t date),
+			      uint64_t min_bps,
+			      uint32_t flags,
+			      const zmodem_options_t *options);
+zm_session_t *zm_session_receive(const char *directory,
+				 bool (*approver)(const char *filename, size_t size, time_t date),
+				 bool tick_cb(const char *fname, long bytes_sent, long bytes_total, long last_bps, int min_left, int sec_left),
+				 void (*complete)(const char *filename, int result, size_t size, time_t date),
+				 uint64_t min_bps,
+				 uint32_t flags,
+				 const zmodem_options_t *options);
+int zm_session_feed(zm_session_t *session, const void *bytes, size_t len);
+const void *zm_session_poll_output(zm_session_t *session, size_t *len);
+void zm_session_consume_output(zm_session_t *session, size_t len);
+long long zm_session_next_deadline(zm_session_t *session);
+void zm_session_timeout(zm_session_t *session);
+bool zm_session_done(zm_session_t *session, size_t *bytes);
+void zm_session_free(zm_session_t *session);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,7 +28,6 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <signal.h>
 #include <ctype.h>
 #include <errno.h>
 
@@ -41,21 +40,33 @@ static int
 readline_internal(zreadline_t *zr, unsigned int timeout);
 
 zreadline_t *
-zreadline_init(int fd, size_t readnum, size_t bufsize, int no_timeout)
+zreadline_init(zmodem_transport_t *tp, size_t readnum, size_t bufsize, int no_timeout)
 {
-	zreadline_t *zr = (zreadline_t *) malloc (sizeof(zreadline_t));
-	memset (zr, 0, sizeof(zreadline_t));
-	zr->readline_fd = fd;
+	zreadline_t *zr = (zreadline_t *) calloc (1, sizeof(zreadline_t));
+	if (!zr) {
+		log_fatal(_("out of memory"));
+		return NULL;
+	}
+	zr->tp = tp;
 	zr->readline_readnum = readnum;
-	zr->readline_buffer = malloc(bufsize > readnum ? bufsize : readnum);
+	zr->readline_bufsize = bufsize > readnum ? bufsize : readnum;
+	zr->readline_buffer = malloc(zr->readline_bufsize);
 	if (!zr->readline_buffer) {
 		log_fatal(_("out of memory"));
-		exit(1);
+		free(zr);
+		return NULL;
 	}
 	zr->no_timeout = no_timeout;
 	return zr;
 }
 
+void
+zreadline_free(zreadline_t *zr)
+{
+	free(zr->readline_buffer);
+	free(zr);
+}
+
 int
 zreadline_getc(zreadline_t *zr, int timeout)
 {
@@ -69,54 +80,54 @@ zreadline_getc(zreadline_t *zr, int timeout)
 		return readline_internal(zr, timeout);
 }
 
-static void
-zreadline_alarm_handler(int dummy LRZSZ_ATTRIB_UNUSED)
-{
-	/* doesn't need to do anything */
-}
-
 /*
  * This version of readline is reasonably well suited for
  * reading many characters.
  *
- * timeout is in tenths of seconds
+ * timeout is in tenths of seconds.  Each read takes as much as the
+ * buffer holds; waiting is left to the transport.
  */
 static int
 readline_internal(zreadline_t *zr, unsigned int timeout)
 {
-	if (!zr->no_timeout)
-	{
-		unsigned int n;
-		n = timeout/10;
-		if (n < 2 && timeout!=1)
-			n = 3;
-		else if (n==0)
-			n=1;
-		log_trace("Calling read: alarm=%d  Readnum=%d ",
-			 n, zr->readline_readnum);
-		signal(SIGALRM, zreadline_alarm_handler);
-		alarm(n);
-	}
-	else
-		log_trace("Calling read: Readnum=%d ", zr->readline_readnum);
+	int ms = zr->no_timeout ? -1 : (int) timeout * 100;
+	ssize_t n;
+
+	log_trace("Calling read: timeout=%dms Bufsize=%zu ",
+		  ms, zr->readline_bufsize);
 	zr->readline_ptr = zr->readline_buffer;
-	zr->readline_left = read(zr->readline_fd,
-				 zr->readline_ptr,
-				 zr->readline_readnum);
-	if (!zr->no_timeout)
-		alarm(0);
-	if (zr->readline_left == -1)
+	zr->readline_left = 0;
+	n = zr->tp->read(zr->tp->ctx, zr->readline_ptr,
+			 zr->readline_bufsize, ms);
+	if (n < 0)
 		log_trace("Read failure :%s\n", strerror(errno));
 	else
-		log_trace("Read returned %d bytes\n", zr->readline_left);
-	if (zr->readline_left < 1)
+		log_trace("Read returned %zd bytes\n", n);
+	if (n < 1)
 		return TIMEOUT;
-	zr->readline_left -- ;
+	zr->readline_left = (int) n - 1;
 	char c = *zr->readline_ptr;
 	zr->readline_ptr++;
 	return (unsigned char) c;
 }
 
+/* Return non 0 if input is waiting, reading what has arrived into
+   the buffer without waiting. */
+int
+zreadline_ready(zreadline_t *zr)
+{
+	ssize_t n;
+
+	if (zr->readline_left > 0)
+		return 1;
+	n = zr->tp->read(zr->tp->ctx, zr->readline_buffer,
+			 zr->readline_bufsize, 0);
+	if (n < 1)
+		return 0;
+	zr->readline_ptr = zr->readline_buffer;
+	zr->readline_left = (int) n;
+	return 1;
+}
 
 void
 zreadline_flush(zreadline_t *zr)
@@ -128,23 +139,7 @@ zreadline_flush(zreadline_t *zr)
 void
 zreadline_flushline(zreadline_t *zr)
 {
-  zr->readline_left = 0;
-  lseek(zr->readline_fd, 0, SEEK_END);
+	zr->readline_left = 0;
+	if (zr->tp->purge)
+		zr->tp->purge(zr->tp->ctx);
 }
-
-/* send cancel string to get the other end to shut up */
-void
-zreadline_canit (zreadline_t *zr, int fd)
-{
-	static char canistr[] =
-	{
-		24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 0
-	};
-	zreadline_flushline(zr);
-	write(fd,canistr,strlen(canistr));
-	if (fd==0)
-		write(1,canistr,strlen(canistr));
-}
-
-
-
@@ -0,0 +1,382 @@
+/* olddecode.c - the goto-driven receive decoder, kept for zmbench
+
+   This is the escape decoder and header hunt of zm.c as they were
+   before the transition tables, with the names changed, around the
+   data loop they had then.  Characters before a header go to
+   zm->intro_msg rather than to a buffer allocated for each call, so
+   that the hunt is measured and not the allocator. */
+
+#include "zglobal.h"
+
+#include <ctype.h>
+#include "log.h"
+#include "crctab.h"
+#include "zescape.h"
+#include "olddecode.h"
+
+#define ISPRINT(x) ((unsigned)(x) & 0x60u)
+#define badcrc _("Bad CRC")
+
+static const char *Zendnames[] = { "ZCRCE", "ZCRCG", "ZCRCQ", "ZCRCW"};
+
+static int old_get_escaped_char_internal(zm_t *zm, int c);
+
+static inline int
+old_get_ascii_char(zm_t *zm)
+{
+	register int c;
+
+	for (;;) {
+		if ((c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
+			return c;
+		c &= 0x7F;
+		switch (c) {
+		case XON:
+		case XOFF:
+			continue;
+		default:
+			if (zm->zctlesc && (c < ' '))
+				continue;
+			/* fall through */
+		case '\r':
+		case '\n':
+		case ZDLE:
+			return c;
+		}
+	}
+}
+
+/*
+ * Read a byte, checking for ZMODEM escape encoding
+ *  including CAN*5 which represents a quick abort
+ */
+static inline int
+old_get_escaped_char(zm_t *zm)
+{
+	int c = zreadline_getc(zm->zr, zm->rxtimeout);
+
+	/* Quick check for non control characters */
+	if (ISPRINT(c))
+		return c;
+	return old_get_escaped_char_internal(zm, c);
+}
+
+static inline size_t
+old_get_clean_span(zm_t *zm, char *buf, size_t max)
+{
+	zreadline_t *zr = zm->zr;
+	size_t n;
+
+	if (zr->readline_left <= 0)
+		return 0;
+	n = (size_t) zr->readline_left < max ? (size_t) zr->readline_left : max;
+	n = zm_unescape_span(buf, zr->readline_ptr, n, zm->zctlesc);
+	zr->readline_ptr += n;
+	zr->readline_left -= (int) n;
+	return n;
+}
+
+static int
+old_get_escaped_char_internal(zm_t *zm, int c)
+{
+	goto jump_over; /* bad style */
+
+again:
+	/* Quick check for non control characters */
+	c = zreadline_getc(zm->zr, zm->rxtimeout);
+	if (ISPRINT(c))
+		return c;
+jump_over:
+	switch (c) {
+	  /* Spec 7.2: ZDLE represents a control sequence of some
+	     sort. */
+	case ZDLE:
+		break;
+
+	/* Spec 7.2: The receiver ignores 021 (ASCII XON), 0221, 023
+	 * (ASCII XOFF), and 0223 characters in the data stream. */
+	case XON:
+	case (XON|0x80):
+	case XOFF:
+	case (XOFF|0x80):
+		goto again;
+	default:
+		if (zm->zctlesc && !ISPRINT(c)) {
+			goto again;
+		}
+		return c;
+	}
+again2:
+	/* We only end up here if the previous char was ZDLE.
+	 * We are in a control sequence. */
+
+	if ((c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
+		return c;
+
+	/* Spec 7.2: Receipt of five successive CAN characters will
+	 * abort a ZMODEM session. [Note that ZDLE is also CAN, so the
+	 * ZDLE counts as the 1st CAN character, so we only need 4
+	 * CAN's.] */
+	if (c == CAN && (c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
+		return c;
+	if (c == CAN && (c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
+		return c;
+	if (c == CAN && (c = zreadline_getc(zm->zr, zm->rxtimeout)) < 0)
+		return c;
+	switch (c) {
+	case CAN:
+		return GOTCAN;
+	case ZCRCE:
+	case ZCRCG:
+	case ZCRCQ:
+	case ZCRCW:
+		return (c | GOTOR);
+	case ZRUB0:
+		return 0x7F;
+	case ZRUB1:
+		return 0xFF;
+	/* Spec 7.2: The receiver ignores 021 (ASCII XON), 0221, 023
+	 * (ASCII XOFF), and 0223 characters in the data stream. */
+	case XON:
+	case (XON|0x80):
+	case XOFF:
+	case (XOFF|0x80):
+		goto again2;
+	default:
+		if (zm->zctlesc && ! ISPRINT(c)) {
+			goto again2;
+		}
+		/* Spec 7.2: The receiving program decodes any sequence
+		 * of ZDLE followed by a byte with bit 6 set and bit 5 reset
+		 * (uppercase letter, either parity) to the equivalent control
+		 * character by inverting bit 6 */
+		if ((c & 0b01100000) ==  0b01000000)
+			return (c ^ 0b01000000);
+		break;
+	}
+	log_debug(_("Bad escape sequence %x"), c);
+	return ERROR;
+}
+
+static inline uint32_t
+old_crc_update(uint32_t crc, const void *buf, size_t len, int crc32)
+{
+	if (crc32)
+		return crc32_update(crc, buf, len);
+	return crc16_update((uint16_t) crc, buf, len);
+}
+
+#define ZM_RECV_BLOCK 1024
+int
+old_receive_data(zm_t *zm, char *buf, int length, size_t *bytes_received)
+{
+	register int c;
+	register int d;
+	int crc32 = zm->rxframeind == ZBIN32;
+	uint32_t crc = crc32 ? 0xFFFFFFFFL : 0;
+	int done = 0;		/* bytes of buf already in crc */
+	int ntrailer = crc32 ? 5 : 3;
+	unsigned char trailer[5];
+
+	*bytes_received = 0;
+	for (int i = 0; i < length + 1; i ++) {
+		i += (int) old_get_clean_span(zm, buf + i, (size_t) (length + 1 - i));
+		if (i - done >= ZM_RECV_BLOCK) {
+			crc = old_crc_update(crc, buf + done, (size_t) (i - done), crc32);
+			done = i;
+		}
+		if (i == length + 1)
+			break;
+		if ((c = old_get_escaped_char(zm)) & ~0xFF) {
+crcfoo:
+			switch (c) {
+			case GOTCRCE:
+			case GOTCRCG:
+			case GOTCRCQ:
+			case GOTCRCW:
+				/* The frame end and the two or four
+				 * CRC bytes follow the data. */
+				d = c;
+				trailer[0] = (unsigned char) (c & 0xFF);
+				for (int n = 1; n < ntrailer; n++) {
+					if ((c = old_get_escaped_char(zm)) & ~0xFF)
+						goto crcfoo;
+					trailer[n] = (unsigned char) c;
+				}
+				crc = old_crc_update(crc, buf + done, (size_t) (i - done), crc32);
+				crc = old_crc_update(crc, trailer, (size_t) ntrailer, crc32);
+				if (crc32 ? crc != 0xDEBB20E3 : (crc & 0xFFFF) != 0) {
+					log_error(badcrc);
+					return ERROR;
+				}
+				*bytes_received = (size_t) i;
+				log_trace("zm_receive_data%s: %lu %s", crc32 ? "32" : "",
+					  (unsigned long) *bytes_received,
+					  Zendnames[(d-GOTCRCE)&3]);
+				return d;
+			case GOTCAN:
+				log_error(_("Sender Canceled"));
+				return ZCAN;
+			case TIMEOUT:
+				log_error(_("TIMEOUT"));
+				return c;
+			default:
+				log_error(_("Bad data subpacket"));
+				return c;
+			}
+		}
+		buf[i] = (char) c;
+	}
+	log_error(_("Data subpacket too long"));
+	return ERROR;
+}
+
+/* Receive a binary style header (type and position) with 32 bit FCS */
+static int
+old_read_binary_header32(zm_t *zm)
+{
+	register int c;
+	uint32_t crc;
+	unsigned char hdr[9];	/* type, 4 bytes of payload, 4 bytes of CRC */
+
+	if ((c = old_get_escaped_char(zm)) & ~0xFF)
+		return c;
+	zm->rxtype = c;
+	hdr[0] = (unsigned char) c;
+
+	for (int n = 0; n < 4; n++) {
+		if ((c = old_get_escaped_char(zm)) & ~0xFF)
+			return c;
+		hdr[n + 1] = (unsigned char) c;
+		zm->Rxhdr[n] = (char) c;
+	}
+	for (int n = 0; n < 4; n ++) {
+		if ((c = old_get_escaped_char(zm)) & ~0xFF)
+			return c;
+		hdr[n + 5] = (unsigned char) c;
+	}
+	crc = crc32_update(0xFFFFFFFFL, hdr, 9);
+	if (crc != 0xDEBB20E3) {
+		log_error(badcrc);
+		return ERROR;
+	}
+	zm->zmodem_requested=TRUE;
+	return zm->rxtype;
+}
+
+int
+old_get_header(zm_t *zm, uint32_t *payload)
+{
+	int c, cancount;
+	unsigned int intro_msg_len, max_intro_msg_len;
+	size_t rxpos=0;
+
+	/* Max bytes before start of frame */
+	max_intro_msg_len = (unsigned) (zm->zrwindow + zm->baudrate);
+	intro_msg_len = 0;
+
+	zm->rxframeind = zm->rxtype = 0;
+
+startover:
+	cancount = 5;
+again:
+	/* Return immediate ERROR if ZCRCW sequence seen */
+	c = zreadline_getc(zm->zr, zm->rxtimeout);
+	switch (c) {
+	case RCDO:
+	case TIMEOUT:
+		goto fifi;
+		break;
+	case CAN:
+gotcan:
+		if (--cancount <= 0) {
+			c = ZCAN;
+			goto fifi;
+		}
+		switch (c = zreadline_getc(zm->zr, 1)) {
+		case TIMEOUT:
+			goto again;
+			break;
+		case ZCRCW:
+			c = ERROR;
+			/* **** FALL THRU TO **** */
+		case RCDO:
+			goto fifi;
+			break;
+		default:
+			break;
+		case CAN:
+			if (--cancount <= 0) {
+				c = ZCAN;
+				goto fifi;
+			}
+			goto again;
+		}
+		/* fall through */
+	default:
+agn2:
+		if (intro_msg_len > max_intro_msg_len) {
+			log_error(_("Intro message length exceeded"));
+			return(ERROR);
+		}
+		if ((zm->eflag == 1 && isprint(c)) || zm->eflag == 2) {
+			if (intro_msg_len < ZM_INTRO_MAX)
+				zm->intro_msg[intro_msg_len] = (char) c;
+			intro_msg_len++;
+		}
+		goto startover;
+		break;
+
+	/* Spec 7.3.1.  A binary header begins with the sequence ZPAD, ZDLE, ZBIN */
+	/* Spec 7.3.2.  A 32 bit CRC binary header begins with ZPAD, ZDLE, ZBIN32 */
+	/* Spec 7.3.3.  A hex header begins with the sequence ZPAD, ZPAD, ZDLE, ZHEX. */
+	case ZPAD|0x80:
+	case ZPAD:
+		/* Received 1st byte of a packet header. */
+		break;
+	}
+	cancount = 5;
+multiplezpad:
+	switch (c = old_get_ascii_char(zm)) {
+	case ZPAD:
+		/* Multiple consecutive ZPADs can be treated as a single ZPAD. */
+		goto multiplezpad;
+	case RCDO:
+	case TIMEOUT:
+		goto fifi;
+	default:
+		goto agn2;
+	case ZDLE:
+		/* Received 2nd byte of a packet header. */
+		break;
+	}
+
+	switch (c = old_get_ascii_char(zm)) {
+	case RCDO:
+	case TIMEOUT:
+		goto fifi;
+	case ZBIN32:
+		/* If the 3rd byte of a header is ZBIN32, we're receiving a
+		 * binary packet with at 32-bit CRC. */
+		zm->crc32 = zm->rxframeind = ZBIN32;
+		c =  old_read_binary_header32(zm);
+		break;
+	case ZBIN:
+	case ZHEX:
+		c = ERROR;
+		goto fifi;
+	case CAN:
+		goto gotcan;
+	default:
+		goto agn2;
+	}
+	rxpos = zm->Rxhdr[ZP3] & 0xFF;
+	rxpos = (rxpos<<8) + (zm->Rxhdr[ZP2] & 0xFF);
+	rxpos = (rxpos<<8) + (zm->Rxhdr[ZP1] & 0xFF);
+	rxpos = (rxpos<<8) + (zm->Rxhdr[ZP0] & 0xFF);
+fifi:
+	log_trace("zm_get_header: %d %lx", c, (unsigned long) rxpos);
+	if (payload)
+		*payload = (uint32_t) rxpos;
+	return c;
+}
@@ -0,0 +1,18 @@
+#ifndef ZMBENCH_OLDDECODE_H
+#define ZMBENCH_OLDDECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "zm.h"
+
+/* The receive side of zm.c as it was before its escape decoder and
+   header hunt were driven from transition tables, for zmbench to
+   measure those against.  They take the same zm_t as zm_receive_data
+   and zm_get_header, and return the same.
+
+   old_get_header reads binary headers with a 32 bit CRC only, the
+   kind zmbench sends; the others are answered with ERROR. */
+int old_receive_data(zm_t *zm, char *buf, int length, size_t *received);
+int old_get_header(zm_t *zm, uint32_t *payload);
+
+#endif
@@ -0,0 +1,346 @@
+/* Transfer checks for "make check": send files between a sender and
+   a receiver in one process, over a socketpair, through a relay that
+   flips bits, and between two non-blocking sessions, and compare
+   what arrives with what was sent. */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "zmodem.h"
+
+#define TEST_DIR "zmtransfer.dir"
+#define DATA_SIZE (1024 * 1024)
+#define RELAY_BUF 4096
+
+struct test_case
+{
+  const char *name;
+  uint32_t flags;
+  double ber;			/* bit error rate from sender to receiver */
+};
+
+static const struct test_case cases[] =
+{
+  { "plain", RZSZ_FLAGS_NONE, 0 },
+  { "pipeline", RZSZ_FLAGS_PIPELINE, 0 },
+  { "monitor", RZSZ_FLAGS_MONITOR, 0 },
+  { "pipeline+monitor", RZSZ_FLAGS_PIPELINE | RZSZ_FLAGS_MONITOR, 0 },
+  { "uring", RZSZ_FLAGS_URING, 0 },
+  { "sack", RZSZ_FLAGS_SACK, 0 },
+  { "fec", RZSZ_FLAGS_SACK | RZSZ_FLAGS_FEC, 0 },
+  { "plain ber 1e-5", RZSZ_FLAGS_NONE, 1e-5 },
+  { "monitor ber 1e-5", RZSZ_FLAGS_MONITOR, 1e-5 },
+  { "sack ber 1e-5", RZSZ_FLAGS_SACK, 1e-5 },
+  { "fec ber 1e-5", RZSZ_FLAGS_SACK | RZSZ_FLAGS_FEC, 1e-5 },
+};
+
+static const char *files[] = { TEST_DIR "/random.bin", TEST_DIR "/text.txt" };
+#define N_FILES ((int) (sizeof files / sizeof files[0]))
+
+struct peer
+{
+  int fd;
+  uint32_t flags;
+  const zmodem_options_t *options;
+  const char *dir;
+  size_t bytes;
+};
+
+struct relay
+{
+  int in, out;
+  double ber;
+  unsigned int seed;
+};
+
+static bool
+write_file(const char *name, const char *buf, size_t len)
+{
+  FILE *f = fopen(name, "wb");
+
+  if (!f)
+    return false;
+  if (fwrite(buf, 1, len, f) != len)
+    {
+      fclose(f);
+      return false;
+    }
+  return fclose(f) == 0;
+}
+
+/* A megabyte of noise, and text with every kind of line end. */
+static bool
+make_files(void)
+{
+  char *buf = malloc(DATA_SIZE);
+  unsigned int seed = 1;
+  size_t i, len = 0;
+  bool ok;
+
+  if (!buf)
+    return false;
+  mkdir(TEST_DIR, 0755);
+  for (i = 0; i < DATA_SIZE; i++)
+    buf[i] = (char) (rand_r(&seed) >> 7);
+  ok = write_file(files[0], buf, DATA_SIZE);
+  for (i = 0; len < DATA_SIZE / 8; i++)
+    len += (size_t) snprintf(buf + len, DATA_SIZE - len,
+			     "line %zu of the text file%s", i,
+			     i % 3 == 0 ? "\r\n" : i % 3 == 1 ? "\n" : "\r");
+  ok = ok && write_file(files[1], buf, len);
+  free(buf);
+  return ok;
+}
+
+static bool
+same_file(const char *a, const char *b)
+{
+  FILE *fa = fopen(a, "rb");
+  FILE *fb = fopen(b, "rb");
+  bool same = fa && fb;
+  int ca, cb;
+
+  while (same)
+    {
+      ca = getc(fa);
+      cb = getc(fb);
+      if (ca != cb)
+	same = false;
+      else if (ca == EOF)
+	break;
+    }
+  if (fa)
+    fclose(fa);
+  if (fb)
+    fclose(fb);
+  return same;
+}
+
+static zmodem_transport_t *
+transport(int fd, uint32_t flags)
+{
+  zmodem_transport_t *tp = NULL;
+
+  /* zmodem_transport_uring returns NULL without io_uring. */
+  if (flags & RZSZ_FLAGS_URING)
+    tp = zmodem_transport_uring(fd, fd);
+  return tp ? tp : zmodem_transport_socket(fd);
+}
+
+static void *
+sender(void *arg)
+{
+  struct peer *p = arg;
+  zmodem_transport_t *tp = transport(p->fd, p->flags);
+
+  p->bytes = zmodem_send_ex(tp, N_FILES, files, NULL, NULL, 0,
+			    p->flags, p->options);
+  zmodem_transport_free(tp);
+  shutdown(p->fd, SHUT_RDWR);
+  return NULL;
+}
+
+static void *
+receiver(void *arg)
+{
+  struct peer *p = arg;
+  zmodem_transport_t *tp = transport(p->fd, p->flags);
+
+  p->bytes = zmodem_receive_ex(tp, p->dir, NULL, NULL, NULL, 0,
+			       p->flags, p->options);
+  zmodem_transport_free(tp);
+  shutdown(p->fd, SHUT_RDWR);
+  return NULL;
+}
+
+/* Copy one direction of the line, flipping a bit in a byte now and
+   then if BER is set. */
+static void *
+relay(void *arg)
+{
+  struct relay *r = arg;
+  char buf[RELAY_BUF];
+  double pbyte = 8 * r->ber;
+  ssize_t n, i;
+
+  while ((n = read(r->in, buf, sizeof buf)) > 0)
+    {
+      for (i = 0; pbyte > 0 && i < n; i++)
+	if (rand_r(&r->seed) < pbyte * RAND_MAX)
+	  buf[i] ^= (char) (1 << (rand_r(&r->seed) & 7));
+      for (i = 0; i < n; )
+	{
+	  ssize_t w = write(r->out, buf + i, (size_t) (n - i));
+	  if (w < 0)
+	    break;
+	  i += w;
+	}
+      if (i < n)
+	break;
+    }
+  /* Once either end is gone, so is the line: a sender still writing
+     must not wait for a reader that will never come. */
+  shutdown(r->in, SHUT_RDWR);
+  shutdown(r->out, SHUT_RDWR);
+  return NULL;
+}
+
+static bool
+check_received(const char *dir)
+{
+  char name[256];
+  bool ok = true;
+
+  for (int i = 0; i < N_FILES; i++)
+    {
+      snprintf(name, sizeof name, "%s/%s", dir, strrchr(files[i], '/') + 1);
+      if (!same_file(files[i], name))
+	{
+	  fprintf(stderr, "%s differs from %s\n", name, files[i]);
+	  ok = false;
+	}
+      unlink(name);
+    }
+  rmdir(dir);
+  return ok;
+}
+
+static bool
+run_case(const struct test_case *t, int index)
+{
+  int a[2], b[2];
+  char dir[64];
+  zmodem_options_t options = { 0 };
+  struct peer tx, rx;
+  struct relay fwd, back;
+  pthread_t threads[4];
+
+  snprintf(dir, sizeof dir, TEST_DIR "/rx%d", index);
+  mkdir(dir, 0755);
+  /* A receiver that waits forever would hang on a lost frame end. */
+  if (t->ber > 0)
+    options.timeout = 10;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, a) < 0
+      || socketpair(AF_UNIX, SOCK_STREAM, 0, b) < 0)
+    {
+      perror("socketpair");
+      return false;
+    }
+  tx = (struct peer) { a[0], t->flags, &options, NULL, 0 };
+  rx = (struct peer) { b[0], t->flags, &options, dir, 0 };
+  fwd = (struct relay) { a[1], b[1], t->ber, (unsigned int) index + 1 };
+  back = (struct relay) { b[1], a[1], 0, 0 };
+  pthread_create(&threads[0], NULL, relay, &fwd);
+  pthread_create(&threads[1], NULL, relay, &back);
+  pthread_create(&threads[2], NULL, receiver, &rx);
+  pthread_create(&threads[3], NULL, sender, &tx);
+  for (int i = 3; i >= 0; i--)
+    pthread_join(threads[i], NULL);
+  close(a[0]);
+  close(a[1]);
+  close(b[0]);
+  close(b[1]);
+  if (tx.bytes != rx.bytes)
+    fprintf(stderr, "sent %zu bytes, received %zu\n", tx.bytes, rx.bytes);
+  return check_received(dir) && tx.bytes == rx.bytes;
+}
+
+/* Move bytes from one session to the other; false if none moved. */
+static bool
+pump(zm_session_t *from, zm_session_t *to)
+{
+  size_t len;
+  const void *out = zm_session_poll_output(from, &len);
+
+  if (len == 0)
+    return false;
+  if (zm_session_feed(to, out, len) < 0)
+    return false;
+  zm_session_consume_output(from, len);
+  return true;
+}
+
+/* 77 tells the test driver the check was skipped. */
+static int
+run_sessions(void)
+{
+  const char *dir = TEST_DIR "/sessions";
+  zm_session_t *tx, *rx;
+  size_t sent = 0, received = 0;
+  bool ok;
+
+  mkdir(dir, 0755);
+  tx = zm_session_send(N_FILES, files, NULL, NULL, 0, RZSZ_FLAGS_NONE, NULL);
+  if (!tx && errno == ENOSYS)
+    {
+      rmdir(dir);
+      return 77;
+    }
+  rx = zm_session_receive(dir, NULL, NULL, NULL, 0, RZSZ_FLAGS_NONE, NULL);
+  if (!tx || !rx)
+    {
+      perror("zm_session");
+      return 1;
+    }
+  while (!zm_session_done(tx, &sent) || !zm_session_done(rx, &received))
+    {
+      bool moved = pump(tx, rx);
+      if (pump(rx, tx))
+	moved = true;
+      if (!moved)
+	break;
+    }
+  ok = zm_session_done(tx, &sent) && zm_session_done(rx, &received)
+    && sent == received;
+  zm_session_free(tx);
+  zm_session_free(rx);
+  if (!ok)
+    fprintf(stderr, "sessions stalled: sent %zu bytes, received %zu\n",
+	    sent, received);
+  return check_received(dir) && ok ? 0 : 1;
+}
+
+int
+main(void)
+{
+  int failed = 0;
+  int i;
+
+  /* Nothing here should take more than a few seconds. */
+  alarm(600);
+  signal(SIGPIPE, SIG_IGN);
+  if (!make_files())
+    {
+      perror(TEST_DIR);
+      return 99;
+    }
+  for (i = 0; i < (int) (sizeof cases / sizeof cases[0]); i++)
+    {
+      bool ok = run_case(&cases[i], i);
+      printf("%s: %s\n", ok ? "PASS" : "FAIL", cases[i].name);
+      if (!ok)
+	failed++;
+    }
+  switch (run_sessions())
+    {
+    case 0:
+      printf("PASS: sessions\n");
+      break;
+    case 77:
+      printf("SKIP: sessions\n");
+      break;
+    default:
+      printf("FAIL: sessions\n");
+      failed++;
+    }
+  for (i = 0; i < N_FILES; i++)
+    unlink(files[i]);
+  rmdir(TEST_DIR);
+  return failed ? 1 : 0;
+}